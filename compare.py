@@ -0,0 +1,304 @@
+#!/usr/bin/env python3
+"""Runs fib(n) on the reference interpreters and on every oif strategy.
+
+Each fib.* script is copied with its fib(42) replaced by fib(n), so every
+engine computes the same thing. Interpreters that aren't installed are
+skipped. oif binaries come from a CMake build directory (see README.md):
+each oif_<strategy> runs with n as its argument, and oif_script runs fib.das
+on each of its backends.
+
+Times are wall clock for the whole process, start-up included, and calls/s
+counts the fib calls a naive fib(n) makes, whether or not the engine makes
+them (memoize doesn't). Binaries that compute more than one fib per process
+(serving, batch) are credited with all of them. A run that exits non-zero or
+is killed by a signal is reported as such rather than timed. Peak RSS is
+sampled from /proc on Linux, where runs of a few milliseconds can go
+unmeasured, comes from wait4 on macOS and isn't measured on Windows.
+
+usage: compare.py [--n N] [--runs R] [--build DIR] [--only name,name,...]
+                  [--format table|csv|json] [--timeout SECONDS]
+"""
+
+import argparse
+import json
+import os
+import re
+import shutil
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+try:
+    import resource
+except ImportError:
+    # Windows, where there's no wait4 either
+    resource = None
+
+ROOT = os.path.dirname(os.path.abspath(__file__))
+
+# (name, candidate executables, script)
+INTERPRETERS = [
+    ("lua", ["lua", "lua5.4", "lua5.3", "lua5.1"], "fib.lua"),
+    ("luajit", ["luajit"], "fib.lua"),
+    ("python", ["python3", "python"], "fib.py"),
+    ("pypy", ["pypy3", "pypy"], "fib.py"),
+    ("node", ["node", "nodejs"], "fib.js"),
+    ("ruby", ["ruby"], "fib.rb"),
+    ("daslang", ["daslang", "daScript"], "fib.das"),
+]
+
+SCRIPT_BACKENDS = ["tree", "fused", "composed", "bytecode", "register", "tiered"]
+
+# Binaries that aren't a fib strategy taking n
+NOT_STRATEGIES = ["oif_benchmark", "oif_script"]
+
+
+def fib(n):
+    a, b = 0, 1
+    for _ in range(n):
+        a, b = b, a + b
+    return a
+
+
+def naive_calls(n):
+    # A naive fib(n) makes 2 * fib(n + 1) - 1 calls
+    return 2 * fib(n + 1) - 1
+
+
+def calls_for(name, n):
+    """Naive fib calls behind one run of a strategy, whose output is fib(n)."""
+    if name == "serving":
+        # 4 threads of 8 requests each, all fib(n)
+        return 32 * naive_calls(n)
+    if name == "batch":
+        # One batch of 8 lanes, fib(n) down to fib(n - 7)
+        return sum(naive_calls(max(n - i, 0)) for i in range(8))
+    return naive_calls(n)
+
+
+def exit_status(returncode):
+    """None for a clean exit, otherwise how the process ended."""
+    if returncode == 0:
+        return None
+    if returncode < 0:
+        return "signal %d" % -returncode
+    return "exit %d" % returncode
+
+
+def script_for(name, n, directory):
+    with open(os.path.join(ROOT, name)) as source:
+        text = source.read()
+    text, count = re.subn(r"fib\(42\)", "fib(%d)" % n, text)
+    if count != 1:
+        raise RuntimeError("%s: expected one call to fib(42)" % name)
+    path = os.path.join(directory, name)
+    with open(path, "w") as out:
+        out.write(text)
+    return path
+
+
+def sample_peak_rss(pid, command, done, peak):
+    """Polls /proc for the child's high-water RSS until done is set.
+
+    wait4's ru_maxrss can't be used on its own: Linux carries the high-water
+    mark of the process image replaced by exec over, so every child would
+    report at least the runner's own RSS. Samples from before the exec are
+    told apart by their executable, or for a Python child by its command
+    line. Wrappers like version manager shims count until they exec too.
+    """
+    runner = os.path.realpath("/proc/self/exe")
+    expected = "\0".join(command) + "\0"
+
+    while not done.is_set():
+        try:
+            exe = os.path.realpath("/proc/%d/exe" % pid)
+            with open("/proc/%d/cmdline" % pid) as f:
+                if exe != runner or f.read() == expected:
+                    with open("/proc/%d/status" % pid) as status:
+                        for line in status:
+                            if line.startswith("VmHWM:"):
+                                peak[0] = max(peak[0], int(line.split()[1]) * 1024)
+        except (OSError, ValueError):
+            pass
+        done.wait(0.001)
+
+
+def run_once(command, timeout):
+    """Returns (seconds, peak RSS in bytes or None, stdout, return code).
+
+    The return code follows subprocess: negative for a signal.
+    """
+    start = time.perf_counter()
+    process = subprocess.Popen(command, stdout=subprocess.PIPE, stderr=subprocess.DEVNULL)
+
+    if not hasattr(os, "wait4"):
+        try:
+            out, _ = process.communicate(timeout=timeout)
+        except subprocess.TimeoutExpired:
+            process.kill()
+            process.communicate()
+            raise
+        return time.perf_counter() - start, None, out.decode(errors="replace"), process.returncode
+
+    # Read output first so a chatty child can't block on a full pipe, then
+    # reap it ourselves to get its own resource usage
+    timer = threading.Timer(timeout, process.kill)
+    done = threading.Event()
+    peak = [0]
+    sampler = None
+    if sys.platform != "darwin" and os.path.isdir("/proc/self"):
+        sampler = threading.Thread(target=sample_peak_rss, args=(process.pid, command, done, peak))
+        sampler.start()
+    timer.start()
+    try:
+        out = process.stdout.read()
+        _, status, usage = os.wait4(process.pid, 0)
+    finally:
+        timer.cancel()
+        done.set()
+        if sampler:
+            sampler.join()
+    seconds = time.perf_counter() - start
+    if os.WIFSIGNALED(status):
+        process.returncode = -os.WTERMSIG(status)
+    else:
+        process.returncode = os.WEXITSTATUS(status)
+    process.stdout.close()
+
+    if seconds >= timeout:
+        raise subprocess.TimeoutExpired(command, timeout)
+
+    # macOS reports bytes for the new image only
+    if sys.platform == "darwin":
+        return seconds, usage.ru_maxrss, out.decode(errors="replace"), process.returncode
+
+    # A run too short to sample still shows up in wait4 if it outgrew us
+    rss = usage.ru_maxrss * 1024
+    if not peak[0] and rss > resource.getrusage(resource.RUSAGE_SELF).ru_maxrss * 1024:
+        peak[0] = rss
+    return seconds, peak[0] or None, out.decode(errors="replace"), process.returncode
+
+
+def measure(name, kind, command, options):
+    result = {"name": name, "kind": kind, "n": options.n, "median_ms": None, "min_ms": None,
+              "peak_rss_mb": None, "calls_per_s": None, "result": None, "status": "ok"}
+    times = []
+    rss = []
+
+    try:
+        for _ in range(options.runs):
+            seconds, peak, out, returncode = run_once(command, options.timeout)
+            failure = exit_status(returncode)
+            if failure:
+                result["status"] = failure
+                return result
+            times.append(seconds)
+            if peak is not None:
+                rss.append(peak)
+            lines = out.split()
+            result["result"] = lines[-1] if lines else ""
+    except subprocess.TimeoutExpired:
+        result["status"] = "timeout"
+        return result
+    except OSError as error:
+        result["status"] = "failed: %s" % error.strerror
+        return result
+
+    times.sort()
+    median = times[len(times) // 2]
+    result["median_ms"] = median * 1000
+    result["min_ms"] = times[0] * 1000
+    result["calls_per_s"] = calls_for(name, options.n) / median
+    if rss:
+        result["peak_rss_mb"] = max(rss) / (1024 * 1024)
+    if result["result"] != str(fib(options.n)):
+        result["status"] = "wrong result"
+    return result
+
+
+def candidates(options, directory):
+    """Yields (name, kind, command) for everything installed or built."""
+    for name, executables, script in INTERPRETERS:
+        for executable in executables:
+            path = shutil.which(executable)
+            if path:
+                yield name, "interpreter", [path, script_for(script, options.n, directory)]
+                break
+
+    build = os.path.abspath(options.build)
+    suffix = ".exe" if os.name == "nt" else ""
+    binaries = sorted(f[:len(f) - len(suffix)] for f in os.listdir(build)
+                      if f.startswith("oif_") and f.endswith(suffix)) if os.path.isdir(build) else []
+
+    for binary in binaries:
+        if binary in NOT_STRATEGIES:
+            continue
+        yield binary[len("oif_"):], "oif", [os.path.join(build, binary + suffix), str(options.n)]
+
+    if "oif_script" in binaries:
+        das = script_for("fib.das", options.n, directory)
+        for backend in SCRIPT_BACKENDS:
+            yield "script_" + backend, "oif script", [os.path.join(build, "oif_script" + suffix), "--backend", backend, das]
+
+
+def cell(value, digits):
+    if value is None:
+        return "-"
+    if isinstance(value, float):
+        return "%.*f" % (digits, value) if value < 1e6 else "%.4g" % value
+    return str(value)
+
+
+def report(results, options):
+    columns = ["name", "kind", "n", "median_ms", "min_ms", "peak_rss_mb", "calls_per_s", "result", "status"]
+
+    if options.format == "json":
+        json.dump(results, sys.stdout, indent=2)
+        sys.stdout.write("\n")
+        return
+    if options.format == "csv":
+        print(",".join(columns))
+        for result in results:
+            print(",".join("" if result[c] is None else str(result[c]) for c in columns))
+        return
+
+    headers = ["name", "kind", "n", "median ms", "min ms", "peak RSS MB", "calls/s", "result", "status"]
+    rows = [[cell(result[c], 1 if c == "peak_rss_mb" else 3) for c in columns] for result in results]
+    widths = [max(len(h), *(len(row[i]) for row in rows)) if rows else len(h) for i, h in enumerate(headers)]
+
+    print("  ".join(h.ljust(w) if i < 2 else h.rjust(w) for i, (h, w) in enumerate(zip(headers, widths))))
+    for row in rows:
+        print("  ".join(v.ljust(w) if i < 2 else v.rjust(w) for i, (v, w) in enumerate(zip(row, widths))))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Compare fib(n) across interpreters and oif strategies.")
+    parser.add_argument("--n", type=int, default=30)
+    parser.add_argument("--runs", type=int, default=3)
+    parser.add_argument("--build", default=os.path.join(ROOT, "build"), help="CMake build directory")
+    parser.add_argument("--only", help="comma-separated names to run")
+    parser.add_argument("--format", choices=["table", "csv", "json"], default="table")
+    parser.add_argument("--timeout", type=float, default=120, help="seconds per run")
+    options = parser.parse_args()
+
+    if options.n < 0 or options.runs < 1:
+        parser.error("--n must be at least 0 and --runs at least 1")
+
+    only = options.only.split(",") if options.only else None
+    results = []
+
+    with tempfile.TemporaryDirectory() as directory:
+        for name, kind, command in candidates(options, directory):
+            if only is None or name in only:
+                results.append(measure(name, kind, command, options))
+
+    # Fastest first
+    results.sort(key=lambda r: (r["median_ms"] is None, r["median_ms"] or 0))
+    report(results, options)
+    return 0 if all(r["status"] == "ok" for r in results) else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
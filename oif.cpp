@@ -1,25 +1,673 @@
+// fopen() and friends, for loading scripts, without /sdl turning C4996 into errors
+#if defined(_MSC_VER)
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#include <assert.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(PERF_COUNTERS) && defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#if defined(_WIN32)
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#elif defined(__unix__) || defined(__APPLE__)
+#define OIF_POSIX
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
 #include <initializer_list>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <new>
+#include <type_traits>
+#include <typeinfo>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// For slow paths that would otherwise be inlined into hot loops
+#if defined(_MSC_VER)
+#define NOINLINE __declspec(noinline)
+#else
+#define NOINLINE __attribute__((noinline))
+#endif
+
+// Memory for value stacks. A guarded stack ends right before an inaccessible
+// page, so the first push past the end faults and is reported as a stack
+// overflow. Pages are only backed by memory once the stack grows into them,
+// but on Windows the whole stack is committed up front, so it counts against
+// the commit limit from the start.
+namespace StackMemory {
+    struct Mapping {
+        void* base;
+        size_t size;
+    };
+
+    const uint32_t maxGuards = 256;
+
+    // Guard pages of live stacks, consulted by the fault handler
+    std::atomic<uintptr_t> guards[maxGuards];
+
+    size_t pageSize() {
+#if defined(_WIN32)
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        return info.dwPageSize;
+#elif defined(OIF_POSIX)
+        return (size_t) sysconf(_SC_PAGESIZE);
+#else
+        return 4096;
+#endif
+    }
+
+    // Called from the fault handler, so it only uses async-signal-safe calls
+    void reportOverflow() {
+        static const char message[] = "stack overflow: value stack exhausted\n";
+#if defined(_WIN32)
+        fputs(message, stderr);
+        ExitProcess(EXIT_FAILURE);
+#elif defined(OIF_POSIX)
+        ssize_t written = write(2, message, sizeof(message) - 1);
+        (void) written;
+        _exit(EXIT_FAILURE);
+#else
+        fputs(message, stderr);
+        exit(EXIT_FAILURE);
+#endif
+    }
+
+    bool isGuard(uintptr_t address, size_t page) {
+        for (uint32_t i = 0; i < maxGuards; i++) {
+            uintptr_t guard = guards[i].load(std::memory_order_relaxed);
+            if (guard && address >= guard && address < guard + page) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void addGuard(uintptr_t guard) {
+        for (uint32_t i = 0; i < maxGuards; i++) {
+            uintptr_t empty = 0;
+            if (guards[i].compare_exchange_strong(empty, guard)) {
+                return;
+            }
+        }
+        // Registry full: the stack still faults, just without the message
+    }
+
+    void removeGuard(uintptr_t guard) {
+        for (uint32_t i = 0; i < maxGuards; i++) {
+            uintptr_t expected = guard;
+            if (guards[i].compare_exchange_strong(expected, 0)) {
+                return;
+            }
+        }
+    }
+
+#if defined(_WIN32)
+    LONG CALLBACK onFault(EXCEPTION_POINTERS* info) {
+        if (info->ExceptionRecord->ExceptionCode == EXCEPTION_ACCESS_VIOLATION
+                && isGuard((uintptr_t) info->ExceptionRecord->ExceptionInformation[1], pageSize())) {
+            reportOverflow();
+        }
+        return EXCEPTION_CONTINUE_SEARCH;
+    }
+
+    void installHandler() {
+        static PVOID handler = AddVectoredExceptionHandler(1, onFault);
+        (void) handler;
+    }
+#elif defined(OIF_POSIX)
+    struct sigaction previousSegv;
+    struct sigaction previousBus;
+
+    void onFault(int signal, siginfo_t* info, void*) {
+        static size_t page = pageSize();
+
+        if (isGuard((uintptr_t) info->si_addr, page)) {
+            reportOverflow();
+        }
+
+        // Not ours: restore the previous handler and let the access fault again
+        sigaction(signal, signal == SIGSEGV ? &previousSegv : &previousBus, 0);
+    }
+
+    bool installHandlerOnce() {
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_sigaction = onFault;
+        action.sa_flags = SA_SIGINFO;
+        sigemptyset(&action.sa_mask);
+
+        sigaction(SIGSEGV, &action, &previousSegv);
+        sigaction(SIGBUS, &action, &previousBus);
+        return true;
+    }
+
+    void installHandler() {
+        static bool installed = installHandlerOnce();
+        (void) installed;
+    }
+#endif
+
+    uint32_t* allocate(uint32_t slots, bool guard, Mapping* mapping) {
+        mapping->base = 0;
+        mapping->size = 0;
+
+#if defined(_WIN32) || defined(OIF_POSIX)
+        if (guard) {
+            size_t page = pageSize();
+            size_t bytes = ((size_t) slots * sizeof(uint32_t) + page - 1) / page * page;
+            size_t size = bytes + page;
+
+#if defined(_WIN32)
+            char* base = (char*) VirtualAlloc(0, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+            DWORD oldProtect;
+            if (base && !VirtualProtect(base + bytes, page, PAGE_NOACCESS, &oldProtect)) {
+                VirtualFree(base, 0, MEM_RELEASE);
+                base = 0;
+            }
+#else
+            char* base = (char*) mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (base == (char*) MAP_FAILED) {
+                base = 0;
+            }
+            else if (mprotect(base + bytes, page, PROT_NONE) != 0) {
+                munmap(base, size);
+                base = 0;
+            }
+#endif
+            if (base) {
+                installHandler();
+                addGuard((uintptr_t) (base + bytes));
+                mapping->base = base;
+                mapping->size = size;
+
+                // End-align the slots so that slot `slots` is the first guarded byte
+                return (uint32_t*) (base + bytes) - slots;
+            }
+        }
+#endif
+
+        return new uint32_t[slots];
+    }
+
+    void release(uint32_t* stack, const Mapping& mapping) {
+        if (!mapping.base) {
+            delete[] stack;
+            return;
+        }
+
+        size_t page = pageSize();
+        removeGuard((uintptr_t) mapping.base + mapping.size - page);
+
+#if defined(_WIN32)
+        VirtualFree(mapping.base, 0, MEM_RELEASE);
+#elif defined(OIF_POSIX)
+        munmap(mapping.base, mapping.size);
+#endif
+    }
+}
+
+// Execution tracing, compiled in with TRACING. A Context given a Buffer
+// records a sampled subset of calls, as complete events with their start and
+// duration, and of returns, as instants. Events go into a fixed ring that
+// keeps the most recent ones; only the Context's thread writes to it, and
+// anyone can export it at any time in Chrome's trace format, which Perfetto
+// also reads. Without TRACING the hooks aren't there at all.
+#if defined(TRACING)
+namespace Tracing {
+    enum Kind : uint32_t {
+        EVENT_CALL,
+        EVENT_RETURN
+    };
+
+    // node is the CallNode or ReturnNode, function the callee, or for a
+    // return the function it returns from
+    struct Event {
+        uint64_t start;
+        uint64_t duration;
+        const void* node;
+        const void* function;
+        Kind kind;
+    };
+
+    uint64_t now() {
+        return (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    struct Buffer {
+        std::vector<Event> events;
+        uint64_t mask;
+        // Events written so far; the ring holds the last events.size() of them
+        std::atomic<uint64_t> head;
+        uint32_t sampleEvery;
+        uint32_t countdown;
+        // Innermost function being called, so returns know where they are
+        const void* function;
+
+        // capacity is rounded up to a power of two
+        Buffer(uint32_t capacity = 1 << 16, uint32_t sampleEvery = 1)
+            : head(0), sampleEvery(sampleEvery ? sampleEvery : 1), countdown(this->sampleEvery), function(0) {
+            uint64_t size = 1;
+            while (size < capacity) {
+                size *= 2;
+            }
+            events.resize(size);
+            mask = size - 1;
+        }
+
+        Buffer(const Buffer&) = delete;
+        Buffer& operator=(const Buffer&) = delete;
+
+        // True for every sampleEvery-th hook
+        bool sample() {
+            if (--countdown) {
+                return false;
+            }
+            countdown = sampleEvery;
+            return true;
+        }
+
+        void push(const Event& event) {
+            uint64_t at = head.load(std::memory_order_relaxed);
+            events[at & mask] = event;
+            head.store(at + 1, std::memory_order_release);
+        }
+
+        // Copies the events still in the ring, oldest first. Entries the
+        // writer may have overwritten during the copy, including the one it
+        // may be writing now, are dropped.
+        void snapshot(std::vector<Event>* out) const {
+            uint64_t end = head.load(std::memory_order_acquire);
+            uint64_t begin = end > events.size() ? end - events.size() : 0;
+
+            out->clear();
+            for (uint64_t i = begin; i < end; i++) {
+                out->push_back(events[i & mask]);
+            }
+
+            std::atomic_thread_fence(std::memory_order_acquire);
+            uint64_t reused = head.load(std::memory_order_relaxed) + 1;
+            if (reused > events.size() && reused - events.size() > begin) {
+                uint64_t lost = reused - events.size() - begin;
+                out->erase(out->begin(), out->begin() + (ptrdiff_t) std::min<uint64_t>(lost, out->size()));
+            }
+        }
+    };
+
+    // Hook for a call: records it on the way out if it was sampled
+    struct Scope {
+        Buffer* buffer;
+        const void* node;
+        const void* function;
+        const void* caller;
+        uint64_t start;
+
+        Scope(Buffer* buffer, const void* node, const void* function)
+            : buffer(buffer), node(node), function(function), caller(0), start(0) {
+            if (!buffer) {
+                return;
+            }
+            caller = buffer->function;
+            buffer->function = function;
+            if (buffer->sample()) {
+                start = now();
+            }
+        }
+
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+        ~Scope() {
+            if (!buffer) {
+                return;
+            }
+            buffer->function = caller;
+            if (start) {
+                buffer->push({ start, now() - start, node, function, EVENT_CALL });
+            }
+        }
+    };
+
+    // Hook for a return
+    void instant(Buffer* buffer, const void* node) {
+        if (buffer && buffer->sample()) {
+            buffer->push({ now(), 0, node, buffer->function, EVENT_RETURN });
+        }
+    }
+
+    // Short ids for pointers, in order of first appearance
+    uint32_t idOf(std::vector<const void*>* ids, const void* pointer) {
+        for (uint32_t i = 0; i < ids->size(); i++) {
+            if ((*ids)[i] == pointer) {
+                return i;
+            }
+        }
+        ids->push_back(pointer);
+        return (uint32_t) ids->size() - 1;
+    }
+
+    // Writes a JSON trace with one thread per buffer. Functions found in
+    // names are called by their name, the others "function <id>".
+    bool write(FILE* out, const std::vector<const Buffer*>& buffers,
+               const std::vector<std::pair<const void*, std::string>>& names) {
+        std::vector<const void*> nodes;
+        std::vector<const void*> functions;
+        std::vector<Event> events;
+        const char* separator = "";
+
+        fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+
+        for (uint32_t thread = 0; thread < buffers.size(); thread++) {
+            buffers[thread]->snapshot(&events);
+
+            for (const Event& event : events) {
+                uint32_t function = idOf(&functions, event.function);
+                std::string name = "function " + std::to_string(function);
+
+                for (const std::pair<const void*, std::string>& entry : names) {
+                    if (entry.first == event.function) {
+                        name = entry.second;
+                    }
+                }
+
+                // Timestamps are in microseconds
+                fprintf(out, "%s\n{\"name\":\"%s%s\",\"ph\":\"%s\",\"ts\":%.3f,", separator,
+                    event.kind == EVENT_RETURN ? "return from " : "", name.c_str(),
+                    event.kind == EVENT_CALL ? "X" : "i", event.start / 1000.0);
+                if (event.kind == EVENT_CALL) {
+                    fprintf(out, "\"dur\":%.3f,", event.duration / 1000.0);
+                }
+                else {
+                    fprintf(out, "\"s\":\"t\",");
+                }
+                fprintf(out, "\"pid\":1,\"tid\":%u,\"args\":{\"node\":%u,\"function\":%u}}",
+                    thread + 1, idOf(&nodes, event.node), function);
+                separator = ",";
+            }
+        }
+
+        fprintf(out, "\n]}\n");
+        return !ferror(out);
+    }
+}
+#endif
 
 namespace Simplest {
+    // Bump allocator that owns a module's trees. Objects are carved out of
+    // large blocks in the order they're built and released all at once, so
+    // nodes never own each other and need no destructors.
+    struct Arena {
+        struct Block {
+            Block* next;
+        };
+
+        static const size_t blockSize = 64 * 1024;
+
+        Block* blocks;
+        char* cursor;
+        char* end;
+
+        Arena() : blocks(0), cursor(0), end(0) {}
+
+        Arena(const Arena&) = delete;
+        Arena& operator=(const Arena&) = delete;
+
+        ~Arena() {
+            while (blocks) {
+                Block* next = blocks->next;
+                free(blocks);
+                blocks = next;
+            }
+        }
+
+        void* allocate(size_t size, size_t align) {
+            uintptr_t p = ((uintptr_t) cursor + align - 1) & ~(uintptr_t) (align - 1);
+
+            if (!cursor || p + size > (uintptr_t) end) {
+                grow(size + align);
+                p = ((uintptr_t) cursor + align - 1) & ~(uintptr_t) (align - 1);
+            }
+
+            cursor = (char*) p + size;
+            return (void*) p;
+        }
+
+        void grow(size_t minSize) {
+            size_t size = sizeof(Block) + minSize > blockSize ? sizeof(Block) + minSize : blockSize;
+            Block* block = (Block*) malloc(size);
+
+            block->next = blocks;
+            blocks = block;
+            cursor = (char*) (block + 1);
+            end = (char*) block + size;
+        }
+    };
+
+    // Owns every node and function of a program. make<T>() evaluates its
+    // arguments first, so children land just before their parents, roughly in
+    // the order they are evaluated.
+    struct Module {
+        Arena arena;
+
+        template<typename T, typename... Args>
+        T* make(Args&&... args) {
+            static_assert(std::is_trivially_destructible<T>::value, "arena objects are never destroyed");
+            return new (arena.allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+        }
+
+        template<typename T>
+        T* array(uint32_t count) {
+            return (T*) arena.allocate(sizeof(T) * count, alignof(T));
+        }
+    };
+
+    // Why a Context stopped evaluating
+    enum Stop : uint32_t {
+        STOP_NONE,
+        STOP_INTERRUPTED,
+        STOP_BUDGET,
+        STOP_DEADLINE
+    };
+
     struct Context {
+        // Ticks between checks of the budget, deadline and interrupt flag
+        static const uint32_t slice = 1024;
+
         bool stopForReturn;
         uint32_t returnValue;
         uint32_t* stack;
         uint32_t stackTop;
+        uint32_t stackSize;
+        // Base of the current call's frame, for functions with several slots
+        uint32_t frame;
+        // Callee of a pending tail call (a Frames::Function), if any
+        void* tailTarget;
+        StackMemory::Mapping stackMapping;
+        // Calls and loop iterations are ticks. ticks - 1 are left in this
+        // slice and budget beyond it, so the tick that takes ticks to 0 is
+        // the first one without an allowance, and that one checks.
+        uint32_t ticks;
+        // Atomic so the threads running one evaluation can share it
+        std::atomic<uint64_t> budget;
+        bool hasDeadline;
+        std::chrono::steady_clock::time_point deadline;
+        std::atomic<bool> interruptRequested;
+        Stop stop;
+        // Context whose budget, deadline and interrupt flag apply instead of
+        // this one's, while a Parallel worker runs a task another forked
+        Context* owner;
+#if defined(TRACING)
+        // Where calls and returns are recorded, if anywhere. Not owned.
+        Tracing::Buffer* trace;
+#endif
+
+        // Without a guard page (or where it can't be mapped), the stack is a
+        // plain heap array and only debug builds catch overflows.
+        Context(uint32_t stackSize = 4096, bool guardPage = true)
+            : stopForReturn(false), returnValue(0), stackTop(0), stackSize(stackSize), frame(0), tailTarget(0),
+              ticks(slice), budget(UINT64_MAX), hasDeadline(false), interruptRequested(false), stop(STOP_NONE),
+              owner(0) {
+            stack = StackMemory::allocate(stackSize, guardPage, &stackMapping);
+#if defined(TRACING)
+            trace = 0;
+#endif
+        }
 
-        Context() 
-            : stopForReturn(false), returnValue(0), stack(new uint32_t[4096]), stackTop(0) {}
+        Context(const Context&) = delete;
+        Context& operator=(const Context&) = delete;
 
         ~Context() {
-            delete[] stack;
+            StackMemory::release(stack, stackMapping);
+        }
+
+        // Back to the state of a new Context, keeping the stack
+        void reset() {
+            stopForReturn = false;
+            returnValue = 0;
+            stackTop = 0;
+            frame = 0;
+            tailTarget = 0;
+            ticks = slice;
+            budget.store(UINT64_MAX, std::memory_order_relaxed);
+            hasDeadline = false;
+            interruptRequested.store(false, std::memory_order_relaxed);
+            stop = STOP_NONE;
+            owner = 0;
+        }
+
+        // Allows exactly `ticks` more calls and loop iterations; the one
+        // after them stops evaluation
+        void setBudget(uint64_t ticks) {
+            uint32_t first = ticks < slice ? (uint32_t) ticks : slice;
+            this->ticks = first + 1;
+            budget.store(ticks - first, std::memory_order_relaxed);
+        }
+
+        void setDeadline(std::chrono::steady_clock::duration timeout) {
+            hasDeadline = true;
+            deadline = std::chrono::steady_clock::now() + timeout;
+        }
+
+        // Safe from any thread; takes effect within a slice of ticks
+        void interrupt() {
+            interruptRequested.store(true, std::memory_order_relaxed);
+        }
+
+        // Counts a call or loop iteration, true if evaluation must stop. Once
+        // stopped, every call returns at once, so the tree unwinds in time
+        // bounded by its depth; results are meaningless and callers check stop.
+        bool tick() {
+            return --ticks == 0 && checkStop();
+        }
+
+        // tick() for a count the caller keeps in a local, as the VMs do so
+        // stores to the stack don't force it back to memory. Called when the
+        // local runs out, which it refills unless evaluation must stop.
+        bool refill(uint32_t* ticks) {
+            bool stopped = checkStop();
+            *ticks = this->ticks;
+            return stopped;
+        }
+
+        // What a call returns once stopped. Out of line, so the compiler
+        // doesn't keep the 0 in a saved register on every call that goes on.
+        NOINLINE uint32_t stopped() {
+            return 0;
+        }
+
+        Context* limits() {
+            return owner ? owner : this;
+        }
+
+        // Up to a slice of the budget, 0 once it's spent
+        uint32_t takeSlice() {
+            uint64_t left = budget.load(std::memory_order_relaxed);
+            uint32_t taken;
+
+            do {
+                taken = left < slice ? (uint32_t) left : slice;
+            } while (taken && !budget.compare_exchange_weak(left, left - taken, std::memory_order_relaxed));
+
+            return taken;
+        }
+
+        NOINLINE bool checkStop() {
+            Context* limits = this->limits();
+
+            if (stop == STOP_NONE) {
+                if (limits->interruptRequested.load(std::memory_order_relaxed)) {
+                    stop = STOP_INTERRUPTED;
+                }
+                else if (limits->hasDeadline && std::chrono::steady_clock::now() >= limits->deadline) {
+                    stop = STOP_DEADLINE;
+                }
+                // The tick that got here takes the first of the new slice
+                else if (!(ticks = limits->takeSlice())) {
+                    stop = STOP_BUDGET;
+                }
+                else {
+                    return false;
+                }
+            }
+            // Every tick from here on comes back
+            ticks = 1;
+            return true;
+        }
+
+        // In release builds these are a plain store and increment; the guard
+        // page catches overflow without a check on every push.
+        void push(uint32_t value) {
+#if !defined(NDEBUG)
+            if (stackTop >= stackSize) {
+                StackMemory::reportOverflow();
+            }
+#endif
+            stack[stackTop] = value;
+            stackTop += 1;
+        }
+
+        void pop() {
+            stackTop -= 1;
+        }
+
+        // Claims `count` slots and returns the index of the first
+        uint32_t reserve(uint32_t count) {
+#if !defined(NDEBUG)
+            if (stackTop + count > stackSize) {
+                StackMemory::reportOverflow();
+            }
+#endif
+            uint32_t base = stackTop;
+            stackTop += count;
+            return base;
         }
     };
 
     struct Node {
-        virtual ~Node() {}
-
         virtual uint32_t eval(Context* ctx) { return 0; }
     };
 
@@ -39,11 +687,6 @@ namespace Simplest {
 
         AddNode(Node* lhs, Node* rhs) : lhs(lhs), rhs(rhs) {}
 
-        ~AddNode() {
-            delete lhs;
-            delete rhs;
-        }
-
         uint32_t eval(Context* ctx) override {
             return lhs->eval(ctx) + rhs->eval(ctx);
         }
@@ -55,11 +698,6 @@ namespace Simplest {
 
         SubNode(Node* lhs, Node* rhs) : lhs(lhs), rhs(rhs) {}
 
-        ~SubNode() {
-            delete lhs;
-            delete rhs;
-        }
-
         uint32_t eval(Context* ctx) override {
             return lhs->eval(ctx) - rhs->eval(ctx);
         }
@@ -69,11 +707,6 @@ namespace Simplest {
         Node* lhs;
         Node* rhs;
 
-        ~LessNode() {
-            delete lhs;
-            delete rhs;
-        }
-
         LessNode(Node* lhs, Node* rhs) : lhs(lhs), rhs(rhs) {}
 
         uint32_t eval(Context* ctx) override {
@@ -88,11 +721,6 @@ namespace Simplest {
         IfNode(Node* condition, Node* body)
             : condition(condition), body(body) {}
 
-        ~IfNode() {
-            delete condition;
-            delete body;
-        }
-
         uint32_t eval(Context* ctx) override {
             if (condition->eval(ctx)) {
                 body->eval(ctx);
@@ -108,9 +736,9 @@ namespace Simplest {
 
         Function() : body(0), numNodes(0) {}
 
-        void init(std::initializer_list<Node*> body) {
+        void init(Module* module, std::initializer_list<Node*> body) {
             numNodes = (uint32_t) body.size();
-            this->body = new Node * [numNodes];
+            this->body = module->array<Node*>(numNodes);
 
             uint32_t i = 0;
 
@@ -118,13 +746,6 @@ namespace Simplest {
                 this->body[i++] = statement;
             }
         }
-
-        ~Function() {
-            for (uint32_t i = 0; i < numNodes; i++) {
-                delete body[i];
-            }
-            delete[] body;
-        }
     };
 
     struct CallNode : Node {
@@ -134,13 +755,15 @@ namespace Simplest {
         CallNode(Function* function, Node* arg)
             : function(function), arg(arg) {}
 
-        ~CallNode() {
-            delete arg;
-        }
-
         uint32_t eval(Context* ctx) override {
-            ctx->stack[ctx->stackTop] = arg->eval(ctx);
-            ctx->stackTop += 1;
+            if (ctx->tick()) {
+                return ctx->stopped();
+            }
+
+            ctx->push(arg->eval(ctx));
+#if defined(TRACING)
+            Tracing::Scope scope(ctx->trace, this, function);
+#endif
 
             for (uint32_t i = 0, end_i = function->numNodes; i < end_i; i++) {
                 function->body[i]->eval(ctx);
@@ -150,7 +773,7 @@ namespace Simplest {
             }
 
             ctx->stopForReturn = false;
-            ctx->stackTop -= 1;
+            ctx->pop();
 
             return ctx->returnValue;
         }
@@ -161,13 +784,12 @@ namespace Simplest {
 
         ReturnNode(Node* rhs) : rhs(rhs) {}
 
-        ~ReturnNode() {
-            delete rhs;
-        }
-
         uint32_t eval(Context* ctx) override {
             ctx->returnValue = rhs->eval(ctx);
             ctx->stopForReturn = true;
+#if defined(TRACING)
+            Tracing::instant(ctx->trace, this);
+#endif
 
             // Since we pass the result in the ctx->retval field,
             // we don't need to return anything here
@@ -183,30 +805,71 @@ namespace Simplest {
         }
     };
 
+    // Two statements in a row, for blocks that aren't a function body. Longer
+    // blocks nest to the right, so every node keeps a fixed number of children.
+    struct SeqNode : Node {
+        Node* first;
+        Node* rest;
+
+        SeqNode(Node* first, Node* rest) : first(first), rest(rest) {}
+
+        uint32_t eval(Context* ctx) override {
+            first->eval(ctx);
+            if (!ctx->stopForReturn) {
+                rest->eval(ctx);
+            }
+
+            return 0;
+        }
+    };
+
+    // Prints text, then value if there is one. The value is evaluated first,
+    // so output from calls in it comes before the text.
+    struct PrintNode : Node {
+        const char* text;
+        Node* value;
+
+        PrintNode(const char* text, Node* value) : text(text), value(value) {}
+
+        uint32_t eval(Context* ctx) override {
+            uint32_t result = value ? value->eval(ctx) : 0;
+
+            // Once stopped, values are meaningless and nothing more is printed
+            if (ctx->stop != STOP_NONE) {
+                return 0;
+            }
+            if (!value) {
+                fputs(text, stdout);
+                return 0;
+            }
+
+            printf("%s%u", text, result);
+            return result;
+        }
+    };
+
     uint32_t fib(uint32_t n) {
         Context ctx;
+        Module module;
 
-        Function* function = new Function();
-
-        function->init({
-            new IfNode(
-                new LessNode(new ArgNode(), new ConstNode(2)),
-                new ReturnNode(new ArgNode())),
-            new ReturnNode(
-                new AddNode(
-                    new CallNode(function,
-                        new SubNode(new ArgNode(), new ConstNode(1))),
-                    new CallNode(function,
-                        new SubNode(new ArgNode(), new ConstNode(2)))))
+        Function* function = module.make<Function>();
+
+        function->init(&module, {
+            module.make<IfNode>(
+                module.make<LessNode>(module.make<ArgNode>(), module.make<ConstNode>(2)),
+                module.make<ReturnNode>(module.make<ArgNode>())),
+            module.make<ReturnNode>(
+                module.make<AddNode>(
+                    module.make<CallNode>(function,
+                        module.make<SubNode>(module.make<ArgNode>(), module.make<ConstNode>(1))),
+                    module.make<CallNode>(function,
+                        module.make<SubNode>(module.make<ArgNode>(), module.make<ConstNode>(2)))))
         });
 
-        CallNode* call = new CallNode(function, new ConstNode(n));
+        CallNode* call = module.make<CallNode>(function, module.make<ConstNode>(n));
 
         uint32_t result = call->eval(&ctx);
 
-        delete function;
-        delete call;
-
         return result;
     }
 }
@@ -221,10 +884,6 @@ namespace SimpleFusion {
         LessConstNode(Node* lhs, uint32_t constant) 
             : lhs(lhs), constant(constant) {}
 
-        ~LessConstNode() {
-            delete lhs;
-        }
-
         uint32_t eval(Context* ctx) {
             return lhs->eval(ctx) < constant;
         }
@@ -237,10 +896,6 @@ namespace SimpleFusion {
         SubConstNode(Node* lhs, uint32_t constant) 
             : lhs(lhs), constant(constant) {}
 
-        ~SubConstNode() {
-            delete lhs;
-        }
-
         uint32_t eval(Context* ctx) {
             return lhs->eval(ctx) - constant;
         }
@@ -248,36 +903,41 @@ namespace SimpleFusion {
 
     uint32_t fib(uint32_t n) {
         Context ctx;
+        Module module;
 
-        Function* function = new Function();
-
-        function->init({
-            new IfNode(
-                new LessConstNode(new ArgNode(), 2),
-                new ReturnNode(new ArgNode())),
-            new ReturnNode(
-                new AddNode(
-                    new CallNode(function,
-                        new SubConstNode(new ArgNode(), 1)),
-                    new CallNode(function,
-                        new SubConstNode(new ArgNode(), 2))))
+        Function* function = module.make<Function>();
+
+        function->init(&module, {
+            module.make<IfNode>(
+                module.make<LessConstNode>(module.make<ArgNode>(), 2),
+                module.make<ReturnNode>(module.make<ArgNode>())),
+            module.make<ReturnNode>(
+                module.make<AddNode>(
+                    module.make<CallNode>(function,
+                        module.make<SubConstNode>(module.make<ArgNode>(), 1)),
+                    module.make<CallNode>(function,
+                        module.make<SubConstNode>(module.make<ArgNode>(), 2))))
             });
 
-        CallNode* call = new CallNode(function, new ConstNode(n));
+        CallNode* call = module.make<CallNode>(function, module.make<ConstNode>(n));
 
         uint32_t result = call->eval(&ctx);
 
-        delete function;
-        delete call;
-
         return result;
     }
 }
 
-#if defined(__clang__)
+// Only used on functions defined in their class, which are inline already.
+// Defining FORCEINLINE as empty on the command line turns it off.
+#if defined(FORCEINLINE)
+#elif defined(__clang__)
 #define FORCEINLINE __attribute__((always_inline))
 #elif defined(_MSC_VER) // clang defines _MSC_VER on Windows for some reason
 #define FORCEINLINE __forceinline 
+#elif defined(__GNUC__)
+#define FORCEINLINE __attribute__((always_inline))
+#else
+#define FORCEINLINE
 #endif
 
 namespace BetterFusion {
@@ -345,9 +1005,9 @@ namespace BetterFusion {
 
         Function() : body(0), numNodes(0) {}
 
-        void init(std::initializer_list<Node*> body_list) {
+        void init(Module* module, std::initializer_list<Node*> body_list) {
             numNodes = (uint32_t) body_list.size();
-            body = new Node * [numNodes];
+            body = module->array<Node*>(numNodes);
 
             uint32_t i = 0;
 
@@ -355,13 +1015,6 @@ namespace BetterFusion {
                 body[i++] = statement;
             }
         }
-
-        ~Function() {
-            for (uint32_t i = 0; i < numNodes; i++) {
-                delete body[i];
-            }
-            delete[] body;
-        }
     };
 
     struct CallNode : Node {
@@ -371,13 +1024,15 @@ namespace BetterFusion {
         CallNode(Function* function, Node* arg)
             : function(function), arg(arg) {}
 
-        ~CallNode() {
-            delete arg;
-        }
-
         uint32_t eval(Context* ctx) override {
-            ctx->stack[ctx->stackTop] = arg->eval(ctx);
-            ctx->stackTop += 1;
+            if (ctx->tick()) {
+                return ctx->stopped();
+            }
+
+            ctx->push(arg->eval(ctx));
+#if defined(TRACING)
+            Tracing::Scope scope(ctx->trace, this, function);
+#endif
 
             for (uint32_t i = 0, end_i = function->numNodes; i < end_i; i++) {
                 function->body[i]->eval(ctx);
@@ -387,7 +1042,7 @@ namespace BetterFusion {
             }
 
             ctx->stopForReturn = false;
-            ctx->stackTop -= 1;
+            ctx->pop();
 
             return ctx->returnValue;
         }
@@ -395,26 +1050,24 @@ namespace BetterFusion {
 
     uint32_t fib(uint32_t n) {
         Context ctx;
+        Module module;
 
-        Function* function = new Function();
+        Function* function = module.make<Function>();
 
-        function->init({
-            new IfNode(
-                new LessArgConstNode(new ArgNode(), new ConstNode(2)),
-                new ReturnNode(new ArgNode())),
-            new ReturnNode(
-                new AddNode(
-                    new CallNode(function, new SubArgConstNode(new ArgNode(), new ConstNode(1))),
-                    new CallNode(function, new SubArgConstNode(new ArgNode(), new ConstNode(2)))))
+        function->init(&module, {
+            module.make<IfNode>(
+                module.make<LessArgConstNode>(module.make<ArgNode>(), module.make<ConstNode>(2)),
+                module.make<ReturnNode>(module.make<ArgNode>())),
+            module.make<ReturnNode>(
+                module.make<AddNode>(
+                    module.make<CallNode>(function, module.make<SubArgConstNode>(module.make<ArgNode>(), module.make<ConstNode>(1))),
+                    module.make<CallNode>(function, module.make<SubArgConstNode>(module.make<ArgNode>(), module.make<ConstNode>(2)))))
             });
 
-        CallNode* call = new CallNode(function, new ConstNode(n));
+        CallNode* call = module.make<CallNode>(function, module.make<ConstNode>(n));
 
         uint32_t result = call->eval(&ctx);
 
-        delete function;
-        delete call;
-
         return result;
     }
 }
@@ -428,18 +1081,20 @@ namespace SimplifyCalls {
 
         CallAnyNode(Node* function, Node* arg) : function(function), arg(arg) {}
 
-        ~CallAnyNode() {
-            delete arg;
-        }
-
         uint32_t eval(Context* ctx) override {
-            ctx->stack[ctx->stackTop] = arg->eval(ctx);
-            ctx->stackTop += 1;
+            if (ctx->tick()) {
+                return ctx->stopped();
+            }
 
+            ctx->push(arg->eval(ctx));
+
+#if defined(TRACING)
+            Tracing::Scope scope(ctx->trace, this, function);
+#endif
             uint32_t result = function->eval(ctx);
 
             ctx->stopForReturn = false;
-            ctx->stackTop -= 1;
+            ctx->pop();
 
             return result;
         }
@@ -453,12 +1108,6 @@ namespace SimplifyCalls {
         IfElseNode(Node* condition, Node* ifBody, Node* elseBody)
             : condition(condition), ifBody(ifBody), elseBody(elseBody) {}
 
-        ~IfElseNode() {
-            delete condition;
-            delete ifBody;
-            delete elseBody;
-        }
-
         uint32_t eval(Context* ctx) override {
             if (condition->eval(ctx)) {
                 return ifBody->eval(ctx);
@@ -469,51 +1118,7520 @@ namespace SimplifyCalls {
         }
     };
 
-    uint32_t fib(uint32_t n) {
+    // fib(n) as the single expression `n < 2 ? n : fib(n - 1) + fib(n - 2)`.
+    // The backends that compile, translate or parallelize SimplifyCalls trees
+    // all start from this one.
+    IfElseNode* buildFib(Module* module) {
         using BetterFusion::ArgNode;
         using BetterFusion::ConstNode;
+
+        IfElseNode* function = module->make<IfElseNode>(nullptr, nullptr, nullptr);
+
+        function->condition = module->make<LessArgConstNode>(module->make<ArgNode>(), module->make<ConstNode>(2));
+        function->ifBody = module->make<ArgNode>();
+        function->elseBody = module->make<AddNode>(
+            module->make<CallAnyNode>(function, module->make<SubArgConstNode>(module->make<ArgNode>(), module->make<ConstNode>(1))),
+            module->make<CallAnyNode>(function, module->make<SubArgConstNode>(module->make<ArgNode>(), module->make<ConstNode>(2))));
+
+        return function;
+    }
+
+    uint32_t fib(uint32_t n) {
+        using BetterFusion::ConstNode;
         
         Context ctx;
 
-        IfElseNode function(0, 0, 0);
+        Module module;
 
-        function.condition = new LessArgConstNode(new ArgNode(), new ConstNode(2));
-        function.ifBody = new ArgNode();
-        function.elseBody = new AddNode(
-            new CallAnyNode(&function, new SubArgConstNode(new ArgNode(), new ConstNode(1))),
-            new CallAnyNode(&function, new SubArgConstNode(new ArgNode(), new ConstNode(2))));
+        IfElseNode* function = buildFib(&module);
 
-        CallAnyNode call(&function, new ConstNode(n));
+        CallAnyNode* call = module.make<CallAnyNode>(function, module.make<ConstNode>(n));
 
-        uint32_t result = call.eval(&ctx);
+        uint32_t result = call->eval(&ctx);
 
         return result;
     }
 }
 
-uint32_t fib(uint32_t n) {
-    if (n < 2) {
-        return n;
+namespace Trees {
+    using namespace SimplifyCalls;
+
+    // Collects pointers to the child slots of a node, so passes can walk a tree
+    // and replace subtrees in place. Fused nodes with typed operands are leaves,
+    // and a call's function is not a child: it's owned and rewritten separately.
+    uint32_t childSlots(Node* node, Node** slots[3]) {
+        if (Simplest::AddNode* add = dynamic_cast<Simplest::AddNode*>(node)) {
+            slots[0] = &add->lhs;
+            slots[1] = &add->rhs;
+            return 2;
+        }
+        if (Simplest::SubNode* sub = dynamic_cast<Simplest::SubNode*>(node)) {
+            slots[0] = &sub->lhs;
+            slots[1] = &sub->rhs;
+            return 2;
+        }
+        if (Simplest::LessNode* less = dynamic_cast<Simplest::LessNode*>(node)) {
+            slots[0] = &less->lhs;
+            slots[1] = &less->rhs;
+            return 2;
+        }
+        if (Simplest::IfNode* ifNode = dynamic_cast<Simplest::IfNode*>(node)) {
+            slots[0] = &ifNode->condition;
+            slots[1] = &ifNode->body;
+            return 2;
+        }
+        if (Simplest::ReturnNode* ret = dynamic_cast<Simplest::ReturnNode*>(node)) {
+            slots[0] = &ret->rhs;
+            return 1;
+        }
+        if (Simplest::CallNode* call = dynamic_cast<Simplest::CallNode*>(node)) {
+            slots[0] = &call->arg;
+            return 1;
+        }
+        if (SimpleFusion::LessConstNode* less = dynamic_cast<SimpleFusion::LessConstNode*>(node)) {
+            slots[0] = &less->lhs;
+            return 1;
+        }
+        if (SimpleFusion::SubConstNode* sub = dynamic_cast<SimpleFusion::SubConstNode*>(node)) {
+            slots[0] = &sub->lhs;
+            return 1;
+        }
+        if (BetterFusion::CallNode* call = dynamic_cast<BetterFusion::CallNode*>(node)) {
+            slots[0] = &call->arg;
+            return 1;
+        }
+        if (CallAnyNode* call = dynamic_cast<CallAnyNode*>(node)) {
+            slots[0] = &call->arg;
+            return 1;
+        }
+        if (IfElseNode* ifElse = dynamic_cast<IfElseNode*>(node)) {
+            slots[0] = &ifElse->condition;
+            slots[1] = &ifElse->ifBody;
+            slots[2] = &ifElse->elseBody;
+            return 3;
+        }
+        if (Simplest::SeqNode* seq = dynamic_cast<Simplest::SeqNode*>(node)) {
+            slots[0] = &seq->first;
+            slots[1] = &seq->rest;
+            return 2;
+        }
+        if (Simplest::PrintNode* print = dynamic_cast<Simplest::PrintNode*>(node)) {
+            slots[0] = &print->value;
+            return print->value ? 1 : 0;
+        }
+        return 0;
     }
-    return fib(n - 1) + fib(n - 2);
+
+    // Type name used in profiles and diagnostics
+    const char* nodeName(Node* node) {
+        if (dynamic_cast<Simplest::ConstNode*>(node)) return "ConstNode";
+        if (dynamic_cast<Simplest::AddNode*>(node)) return "AddNode";
+        if (dynamic_cast<Simplest::SubNode*>(node)) return "SubNode";
+        if (dynamic_cast<Simplest::LessNode*>(node)) return "LessNode";
+        if (dynamic_cast<Simplest::IfNode*>(node)) return "IfNode";
+        if (dynamic_cast<Simplest::CallNode*>(node)) return "CallNode";
+        if (dynamic_cast<Simplest::ReturnNode*>(node)) return "ReturnNode";
+        if (dynamic_cast<Simplest::ArgNode*>(node)) return "ArgNode";
+        if (dynamic_cast<SimpleFusion::LessConstNode*>(node)) return "LessConstNode";
+        if (dynamic_cast<SimpleFusion::SubConstNode*>(node)) return "SubConstNode";
+        if (dynamic_cast<BetterFusion::ConstNode*>(node)) return "ConstNode";
+        if (dynamic_cast<BetterFusion::ArgNode*>(node)) return "ArgNode";
+        if (dynamic_cast<BetterFusion::LessArgConstNode*>(node)) return "LessArgConstNode";
+        if (dynamic_cast<BetterFusion::SubArgConstNode*>(node)) return "SubArgConstNode";
+        if (dynamic_cast<BetterFusion::CallNode*>(node)) return "CallNode";
+        if (dynamic_cast<CallAnyNode*>(node)) return "CallAnyNode";
+        if (dynamic_cast<IfElseNode*>(node)) return "IfElseNode";
+        if (dynamic_cast<Simplest::SeqNode*>(node)) return "SeqNode";
+        if (dynamic_cast<Simplest::PrintNode*>(node)) return "PrintNode";
+        return "Node";
+    }
+
+    // Functions a compiler has reached from its entry, each at the index its
+    // calls refer to it by. Compiling one can reach new callees, which go on
+    // the end, so compilers loop over the table by index while it grows.
+    template<typename T>
+    struct FunctionTable {
+        std::vector<T> functions;
+
+        // Adds function if it's new
+        uint32_t indexOf(const T& function) {
+            for (uint32_t i = 0; i < functions.size(); i++) {
+                if (functions[i] == function) {
+                    return i;
+                }
+            }
+            functions.push_back(function);
+            return (uint32_t) functions.size() - 1;
+        }
+
+        uint32_t size() const {
+            return (uint32_t) functions.size();
+        }
+
+        const T& operator[](uint32_t i) const {
+            return functions[i];
+        }
+    };
 }
 
-int main(int, const char**) {
-    uint32_t n = 42;
+namespace AutoFusion {
+    using namespace Simplest;
 
-#if defined(BASELINE)
-    printf("%d\n", fib(n));
-#elif defined(SIMPLEST)
-    printf("%d\n", Simplest::fib(n));
-#elif defined(SIMPLE_FUSION)
-    printf("%d\n", SimpleFusion::fib(n));
-#elif defined(BETTER_FUSION)
-    printf("%d\n", BetterFusion::fib(n));
-#elif defined(SIMPLIFY_CALLS)
-    printf("%d\n", SimplifyCalls::fib(n));
-#else
-#error Please define one of: BASELINE, SIMPLEST, SIMPLE_FUSION, BETTER_FUSION, or SIMPLIFY_CALLS
-#endif
+    // A rewrite rule: when `match` accepts a node, `fuse` builds its replacement
+    // in the module's arena. Children are rewritten first, so a rule always
+    // sees already-fused operands; the replaced nodes are simply dropped.
+    struct Rule {
+        const char* name;
+        bool (*match)(Node* node);
+        Node* (*fuse)(Module* module, Node* node);
+    };
 
-	return 0;
+    // Matches Op(Lhs, Rhs); use Node as a wildcard operand.
+    template<typename Op, typename Lhs, typename Rhs>
+    bool matchBinary(Node* node) {
+        Op* op = dynamic_cast<Op*>(node);
+        return op && dynamic_cast<Lhs*>(op->lhs) && dynamic_cast<Rhs*>(op->rhs);
+    }
+
+    // Op(Arg, Const) -> Fused(Arg, Const), with BetterFusion operands.
+    template<typename Op, typename Fused>
+    Node* fuseArgConst(Module* module, Node* node) {
+        Op* op = static_cast<Op*>(node);
+        uint32_t constant = static_cast<ConstNode*>(op->rhs)->value;
+
+        return module->make<Fused>(
+            module->make<BetterFusion::ArgNode>(), module->make<BetterFusion::ConstNode>(constant));
+    }
+
+    // Op(x, Const) -> Fused(x, constant), keeping x.
+    template<typename Op, typename Fused>
+    Node* fuseConst(Module* module, Node* node) {
+        Op* op = static_cast<Op*>(node);
+
+        return module->make<Fused>(op->lhs, static_cast<ConstNode*>(op->rhs)->value);
+    }
+
+    // Tried in order, so more specific shapes go first.
+    const Rule defaultRules[] = {
+        { "Less(Arg, Const)", matchBinary<LessNode, ArgNode, ConstNode>,
+            fuseArgConst<LessNode, BetterFusion::LessArgConstNode> },
+        { "Sub(Arg, Const)", matchBinary<SubNode, ArgNode, ConstNode>,
+            fuseArgConst<SubNode, BetterFusion::SubArgConstNode> },
+        { "Less(_, Const)", matchBinary<LessNode, Node, ConstNode>,
+            fuseConst<LessNode, SimpleFusion::LessConstNode> },
+        { "Sub(_, Const)", matchBinary<SubNode, Node, ConstNode>,
+            fuseConst<SubNode, SimpleFusion::SubConstNode> },
+    };
+
+    const uint32_t numDefaultRules = sizeof(defaultRules) / sizeof(defaultRules[0]);
+
+    // Rewrites the tree bottom-up and returns its new root. `numFused` counts
+    // the rules applied.
+    Node* rewrite(Module* module, Node* node, const Rule* rules, uint32_t numRules, uint32_t* numFused) {
+        Node** slots[3];
+
+        for (uint32_t i = 0, end_i = Trees::childSlots(node, slots); i < end_i; i++) {
+            *slots[i] = rewrite(module, *slots[i], rules, numRules, numFused);
+        }
+
+        for (uint32_t i = 0; i < numRules; i++) {
+            if (rules[i].match(node)) {
+                *numFused += 1;
+                return rules[i].fuse(module, node);
+            }
+        }
+
+        return node;
+    }
+
+    uint32_t fuse(Module* module, Function* function,
+                  const Rule* rules = defaultRules, uint32_t numRules = numDefaultRules) {
+        uint32_t numFused = 0;
+
+        for (uint32_t i = 0; i < function->numNodes; i++) {
+            function->body[i] = rewrite(module, function->body[i], rules, numRules, &numFused);
+        }
+
+        return numFused;
+    }
+
+    uint32_t fib(uint32_t n) {
+        Context ctx;
+        Module module;
+
+        Function* function = module.make<Function>();
+
+        // Same tree as Simplest::fib, fused by the pass instead of by hand
+        function->init(&module, {
+            module.make<IfNode>(
+                module.make<LessNode>(module.make<ArgNode>(), module.make<ConstNode>(2)),
+                module.make<ReturnNode>(module.make<ArgNode>())),
+            module.make<ReturnNode>(
+                module.make<AddNode>(
+                    module.make<CallNode>(function,
+                        module.make<SubNode>(module.make<ArgNode>(), module.make<ConstNode>(1))),
+                    module.make<CallNode>(function,
+                        module.make<SubNode>(module.make<ArgNode>(), module.make<ConstNode>(2)))))
+        });
+
+        fuse(&module, function);
+
+        CallNode* call = module.make<CallNode>(function, module.make<ConstNode>(n));
+
+        uint32_t result = call->eval(&ctx);
+
+        return result;
+    }
+}
+
+// Simplifies Simplest trees before fusion, so fusion rules see canonical
+// shapes: constants are folded and kept on the right, adding a "negative"
+// constant becomes subtracting a positive one, chains of constants are
+// combined, and statements with constant conditions or no effect are removed.
+namespace Folding {
+    using namespace Simplest;
+    using SimplifyCalls::IfElseNode;
+
+    bool constant(Node* node, uint32_t* value) {
+        ConstNode* constant = dynamic_cast<ConstNode*>(node);
+        if (constant) {
+            *value = constant->value;
+        }
+        return constant != 0;
+    }
+
+    // Evaluating these has no effect, so as statements they can go
+    bool isInert(Node* node) {
+        return dynamic_cast<ConstNode*>(node) || dynamic_cast<ArgNode*>(node);
+    }
+
+    // Above this, x + c is written x - (-c), and the other way round
+    const uint32_t maxOffset = 0x80000000u;
+
+    // Applies the rules at `node`, whose children are already simplified.
+    // Rewrites that build a new node simplify it again.
+    Node* simplifyNode(Module* module, Node* node, uint32_t* numFolded) {
+        uint32_t a, b;
+
+        if (AddNode* add = dynamic_cast<AddNode*>(node)) {
+            bool lhsConst = constant(add->lhs, &a);
+            bool rhsConst = constant(add->rhs, &b);
+
+            if (lhsConst && rhsConst) {
+                *numFolded += 1;
+                return module->make<ConstNode>(a + b);
+            }
+            if (lhsConst) {
+                *numFolded += 1;
+                return simplifyNode(module, module->make<AddNode>(add->rhs, add->lhs), numFolded);
+            }
+            if (!rhsConst) {
+                return node;
+            }
+            if (b == 0) {
+                *numFolded += 1;
+                return add->lhs;
+            }
+            if (b > maxOffset) {
+                *numFolded += 1;
+                return simplifyNode(module, module->make<SubNode>(add->lhs, module->make<ConstNode>(0 - b)), numFolded);
+            }
+            if (AddNode* inner = dynamic_cast<AddNode*>(add->lhs)) {
+                if (constant(inner->rhs, &a)) {
+                    *numFolded += 1;
+                    return simplifyNode(module, module->make<AddNode>(inner->lhs, module->make<ConstNode>(a + b)), numFolded);
+                }
+            }
+            if (SubNode* inner = dynamic_cast<SubNode*>(add->lhs)) {
+                if (constant(inner->rhs, &a)) {
+                    *numFolded += 1;
+                    return simplifyNode(module, module->make<AddNode>(inner->lhs, module->make<ConstNode>(b - a)), numFolded);
+                }
+            }
+            return node;
+        }
+
+        if (SubNode* sub = dynamic_cast<SubNode*>(node)) {
+            bool lhsConst = constant(sub->lhs, &a);
+            bool rhsConst = constant(sub->rhs, &b);
+
+            if (lhsConst && rhsConst) {
+                *numFolded += 1;
+                return module->make<ConstNode>(a - b);
+            }
+            if (!rhsConst) {
+                return node;
+            }
+            if (b == 0) {
+                *numFolded += 1;
+                return sub->lhs;
+            }
+            if (b > maxOffset) {
+                *numFolded += 1;
+                return simplifyNode(module, module->make<AddNode>(sub->lhs, module->make<ConstNode>(0 - b)), numFolded);
+            }
+            if (SubNode* inner = dynamic_cast<SubNode*>(sub->lhs)) {
+                if (constant(inner->rhs, &a)) {
+                    *numFolded += 1;
+                    return simplifyNode(module, module->make<SubNode>(inner->lhs, module->make<ConstNode>(a + b)), numFolded);
+                }
+            }
+            if (AddNode* inner = dynamic_cast<AddNode*>(sub->lhs)) {
+                if (constant(inner->rhs, &a)) {
+                    *numFolded += 1;
+                    return simplifyNode(module, module->make<AddNode>(inner->lhs, module->make<ConstNode>(a - b)), numFolded);
+                }
+            }
+            return node;
+        }
+
+        if (LessNode* less = dynamic_cast<LessNode*>(node)) {
+            bool lhsConst = constant(less->lhs, &a);
+            bool rhsConst = constant(less->rhs, &b);
+
+            if (lhsConst && rhsConst) {
+                *numFolded += 1;
+                return module->make<ConstNode>(a < b);
+            }
+            // Nothing is below 0 unsigned
+            if (rhsConst && b == 0 && isInert(less->lhs)) {
+                *numFolded += 1;
+                return module->make<ConstNode>(0);
+            }
+            return node;
+        }
+
+        // IfNode is a statement, so a removed one is just an inert ConstNode
+        if (IfNode* ifNode = dynamic_cast<IfNode*>(node)) {
+            if (constant(ifNode->condition, &a)) {
+                *numFolded += 1;
+                return a ? ifNode->body : module->make<ConstNode>(0);
+            }
+            if (isInert(ifNode->body)) {
+                *numFolded += 1;
+                return isInert(ifNode->condition) ? module->make<ConstNode>(0) : ifNode->condition;
+            }
+            return node;
+        }
+
+        if (IfElseNode* ifElse = dynamic_cast<IfElseNode*>(node)) {
+            if (constant(ifElse->condition, &a)) {
+                *numFolded += 1;
+                return a ? ifElse->ifBody : ifElse->elseBody;
+            }
+            return node;
+        }
+
+        if (SeqNode* seq = dynamic_cast<SeqNode*>(node)) {
+            if (isInert(seq->first)) {
+                *numFolded += 1;
+                return seq->rest;
+            }
+            if (isInert(seq->rest) || dynamic_cast<ReturnNode*>(seq->first)) {
+                *numFolded += 1;
+                return seq->first;
+            }
+            return node;
+        }
+
+        return node;
+    }
+
+    Node* simplify(Module* module, Node* node, uint32_t* numFolded) {
+        Node** slots[3];
+
+        for (uint32_t i = 0, end_i = Trees::childSlots(node, slots); i < end_i; i++) {
+            *slots[i] = simplify(module, *slots[i], numFolded);
+        }
+
+        return simplifyNode(module, node, numFolded);
+    }
+
+    // Simplifies every statement, then drops the ones without effect and
+    // everything after an unconditional return. Returns the rewrites made.
+    uint32_t simplify(Module* module, Function* function) {
+        uint32_t numFolded = 0;
+        uint32_t numKept = 0;
+
+        for (uint32_t i = 0; i < function->numNodes; i++) {
+            Node* statement = simplify(module, function->body[i], &numFolded);
+
+            if (isInert(statement)) {
+                numFolded += 1;
+                continue;
+            }
+
+            function->body[numKept++] = statement;
+
+            if (dynamic_cast<ReturnNode*>(statement)) {
+                numFolded += function->numNodes - 1 - i;
+                break;
+            }
+        }
+
+        function->numNodes = numKept;
+        return numFolded;
+    }
+
+    uint32_t fib(uint32_t n) {
+        Context ctx;
+        Module module;
+
+        Function* function = module.make<Function>();
+
+        // fib the way a naive front end might build it:
+        //
+        //     if (n < 1 + 1) { return n + 0 }
+        //     return fib(n + -1) + fib(0 - 2 + n)
+        function->init(&module, {
+            module.make<IfNode>(
+                module.make<LessNode>(module.make<ArgNode>(),
+                    module.make<AddNode>(module.make<ConstNode>(1), module.make<ConstNode>(1))),
+                module.make<ReturnNode>(module.make<AddNode>(module.make<ArgNode>(), module.make<ConstNode>(0)))),
+            module.make<ReturnNode>(
+                module.make<AddNode>(
+                    module.make<CallNode>(function,
+                        module.make<AddNode>(module.make<ArgNode>(), module.make<ConstNode>(0xffffffffu))),
+                    module.make<CallNode>(function,
+                        module.make<AddNode>(
+                            module.make<SubNode>(module.make<ConstNode>(0), module.make<ConstNode>(2)),
+                            module.make<ArgNode>()))))
+        });
+
+        // Afterwards it's Simplest::fib's tree, and fuses to the same nodes
+        simplify(&module, function);
+        AutoFusion::fuse(&module, function);
+
+        CallNode* call = module.make<CallNode>(function, module.make<ConstNode>(n));
+
+        uint32_t result = call->eval(&ctx);
+
+        return result;
+    }
+}
+
+namespace Composed {
+    using namespace Simplest;
+
+    // Operators: the node they fuse and what they compute
+    struct OpAdd {
+        typedef AddNode Source;
+        static const char* name() { return "Add"; }
+        static uint32_t FORCEINLINE apply(uint32_t lhs, uint32_t rhs) { return lhs + rhs; }
+    };
+
+    struct OpSub {
+        typedef SubNode Source;
+        static const char* name() { return "Sub"; }
+        static uint32_t FORCEINLINE apply(uint32_t lhs, uint32_t rhs) { return lhs - rhs; }
+    };
+
+    struct OpLess {
+        typedef LessNode Source;
+        static const char* name() { return "Less"; }
+        static uint32_t FORCEINLINE apply(uint32_t lhs, uint32_t rhs) { return lhs < rhs; }
+    };
+
+    // Operands are held by value inside the fused node. Each one says which
+    // node it matches, how it's built from that node and how it computes;
+    // describe() appends its part of the rule name.
+    struct Arg {
+        static void describe(std::string* out) { *out += "Arg"; }
+        static bool match(Node* node) { return dynamic_cast<ArgNode*>(node) != 0; }
+        static Arg build(Node* node) { return Arg(); }
+
+        uint32_t FORCEINLINE compute(Context* ctx) {
+            return ctx->stack[ctx->stackTop - 1];
+        }
+    };
+
+    struct Const {
+        uint32_t value;
+
+        static void describe(std::string* out) { *out += "Const"; }
+        static bool match(Node* node) { return dynamic_cast<ConstNode*>(node) != 0; }
+        static Const build(Node* node) { Const operand = { static_cast<ConstNode*>(node)->value }; return operand; }
+
+        uint32_t FORCEINLINE compute(Context* ctx) {
+            return value;
+        }
+    };
+
+    // Any other subtree, evaluated through its vtable as usual
+    struct Any {
+        Node* node;
+
+        static void describe(std::string* out) { *out += "_"; }
+        static bool match(Node* node) { return true; }
+        static Any build(Node* node) { Any operand = { node }; return operand; }
+
+        uint32_t FORCEINLINE compute(Context* ctx) {
+            return node->eval(ctx);
+        }
+    };
+
+    template<typename Op, typename Lhs, typename Rhs>
+    struct Binary {
+        Lhs lhs;
+        Rhs rhs;
+
+        // Nothing is gained over the plain node when both operands are opaque
+        static const bool opaque = std::is_same<Lhs, Any>::value && std::is_same<Rhs, Any>::value;
+
+        static void describe(std::string* out) {
+            *out += Op::name();
+            *out += "(";
+            Lhs::describe(out);
+            *out += ", ";
+            Rhs::describe(out);
+            *out += ")";
+        }
+
+        static bool match(Node* node) {
+            typename Op::Source* op = dynamic_cast<typename Op::Source*>(node);
+            return op && Lhs::match(op->lhs) && Rhs::match(op->rhs);
+        }
+
+        static Binary build(Node* node) {
+            typename Op::Source* op = static_cast<typename Op::Source*>(node);
+            Binary shape = { Lhs::build(op->lhs), Rhs::build(op->rhs) };
+            return shape;
+        }
+
+        uint32_t FORCEINLINE compute(Context* ctx) {
+            return Op::apply(lhs.compute(ctx), rhs.compute(ctx));
+        }
+    };
+
+    // The one virtual call for a whole fused shape
+    template<typename Shape>
+    struct FusedNode : Node {
+        Shape shape;
+
+        FusedNode(const Shape& shape) : shape(shape) {}
+
+        uint32_t eval(Context* ctx) override {
+            return shape.compute(ctx);
+        }
+    };
+
+    // An operand that has already been fused into Shape. The pass works
+    // bottom-up, so this is how a shape absorbs a fused child: its shape is
+    // copied in and the child node dropped.
+    template<typename Shape>
+    struct Fused {
+        Shape shape;
+
+        static void describe(std::string* out) { Shape::describe(out); }
+        static bool match(Node* node) { return dynamic_cast<FusedNode<Shape>*>(node) != 0; }
+        static Fused build(Node* node) { Fused operand = { static_cast<FusedNode<Shape>*>(node)->shape }; return operand; }
+
+        uint32_t FORCEINLINE compute(Context* ctx) {
+            return shape.compute(ctx);
+        }
+    };
+
+    // Type lists, to spell out the shapes as products instead of by hand
+    template<typename... Ts> struct List {};
+
+    template<typename... Lists> struct Concat;
+    template<> struct Concat<> { typedef List<> type; };
+    template<typename... Ts> struct Concat<List<Ts...>> { typedef List<Ts...> type; };
+    template<typename... As, typename... Bs, typename... Rest>
+    struct Concat<List<As...>, List<Bs...>, Rest...> : Concat<List<As..., Bs...>, Rest...> {};
+
+    template<typename Op, typename Lhs, typename Rhs> struct Row;
+    template<typename Op, typename Lhs, typename... Rhs>
+    struct Row<Op, Lhs, List<Rhs...>> { typedef List<Binary<Op, Lhs, Rhs>...> type; };
+
+    template<typename Op, typename Lhs, typename Rhs> struct Table;
+    template<typename Op, typename... Lhs, typename Rhs>
+    struct Table<Op, List<Lhs...>, Rhs> : Concat<typename Row<Op, Lhs, Rhs>::type...> {};
+
+    // Binary<Op, Lhs, Rhs> for every combination, Rhs varying fastest
+    template<typename Ops, typename Lhs, typename Rhs> struct Product;
+    template<typename... Ops, typename Lhs, typename Rhs>
+    struct Product<List<Ops...>, Lhs, Rhs> : Concat<typename Table<Ops, Lhs, Rhs>::type...> {};
+
+    template<typename Shapes> struct FusedList;
+    template<typename... Shapes>
+    struct FusedList<List<Shapes...>> { typedef List<Fused<Shapes>...> type; };
+
+    typedef List<OpAdd, OpSub, OpLess> Ops;
+    typedef List<Arg, Const, Any> Leaves;
+    typedef List<Arg, Const> Simple;
+
+    // Every shape one level deep, and every shape with one of the simple ones
+    // nested on the left, as in `n - 1 < 2` or `a + b - c`. That's 132 rules;
+    // each shape costs compile time, so right-nested ones are left out.
+    // Rules are tried in order: nested shapes go first, and Any comes last in
+    // each position, so the most specific match wins.
+    typedef FusedList<Product<Ops, Simple, Simple>::type>::type Nested;
+    typedef Concat<
+        Product<Ops, Nested, Leaves>::type,
+        Product<Ops, Leaves, Leaves>::type>::type Shapes;
+
+    template<typename Shape>
+    Node* build(Module* module, Node* node) {
+        return module->make<FusedNode<Shape>>(Shape::build(node));
+    }
+
+    template<typename Shape>
+    void addRule(std::vector<AutoFusion::Rule>* rules) {
+        if (Shape::opaque) {
+            return;
+        }
+
+        // Names live as long as the table
+        static std::string name;
+        if (name.empty()) {
+            Shape::describe(&name);
+        }
+
+        AutoFusion::Rule rule = { name.c_str(), Shape::match, build<Shape> };
+        rules->push_back(rule);
+    }
+
+    template<typename... Shapes>
+    std::vector<AutoFusion::Rule> makeRules(List<Shapes...>) {
+        std::vector<AutoFusion::Rule> rules;
+        int expand[] = { 0, (addRule<Shapes>(&rules), 0)... };
+        (void) expand;
+        return rules;
+    }
+
+    // Rule table for AutoFusion::fuse
+    const std::vector<AutoFusion::Rule>& rules() {
+        static const std::vector<AutoFusion::Rule> table = makeRules(Shapes());
+        return table;
+    }
+
+    uint32_t fib(uint32_t n) {
+        Context ctx;
+        Module module;
+
+        Function* function = module.make<Function>();
+
+        // Same tree as Simplest::fib, fused from the generated table
+        function->init(&module, {
+            module.make<IfNode>(
+                module.make<LessNode>(module.make<ArgNode>(), module.make<ConstNode>(2)),
+                module.make<ReturnNode>(module.make<ArgNode>())),
+            module.make<ReturnNode>(
+                module.make<AddNode>(
+                    module.make<CallNode>(function,
+                        module.make<SubNode>(module.make<ArgNode>(), module.make<ConstNode>(1))),
+                    module.make<CallNode>(function,
+                        module.make<SubNode>(module.make<ArgNode>(), module.make<ConstNode>(2)))))
+        });
+
+        const std::vector<AutoFusion::Rule>& table = rules();
+        AutoFusion::fuse(&module, function, table.data(), (uint32_t) table.size());
+
+        CallNode* call = module.make<CallNode>(function, module.make<ConstNode>(n));
+
+        uint32_t result = call->eval(&ctx);
+
+        return result;
+    }
+}
+
+// Nodes that specialize themselves the first time they run. install() swaps
+// the Add, Sub and Less nodes of a tree for quickening nodes that remember
+// the parent slot pointing at them. On first eval one evaluates its operands,
+// which quickens them first, picks a fused node for the operand types it
+// finds (the shapes AutoFusion matches, plus their Add versions) or the plain
+// node otherwise, and stores it in that slot. Code that never runs is never
+// specialized.
+namespace Quickening {
+    using namespace Simplest;
+
+    struct AddConstNode : Node {
+        Node* lhs;
+        uint32_t constant;
+
+        AddConstNode(Node* lhs, uint32_t constant) : lhs(lhs), constant(constant) {}
+
+        uint32_t eval(Context* ctx) override {
+            return lhs->eval(ctx) + constant;
+        }
+    };
+
+    struct AddArgConstNode : Node {
+        BetterFusion::ArgNode* lhs;
+        BetterFusion::ConstNode* rhs;
+
+        AddArgConstNode(BetterFusion::ArgNode* lhs, BetterFusion::ConstNode* rhs) : lhs(lhs), rhs(rhs) {}
+
+        uint32_t eval(Context* ctx) override {
+            return compute(ctx);
+        }
+
+        uint32_t FORCEINLINE compute(Context* ctx) {
+            return lhs->compute(ctx) + rhs->compute(ctx);
+        }
+    };
+
+    // Specializations per operation, with Composed's ops as the keys
+    template<typename Op> struct Specialized;
+
+    template<> struct Specialized<Composed::OpAdd> {
+        typedef AddArgConstNode ArgConst;
+        typedef AddConstNode Const;
+    };
+
+    template<> struct Specialized<Composed::OpSub> {
+        typedef BetterFusion::SubArgConstNode ArgConst;
+        typedef SimpleFusion::SubConstNode Const;
+    };
+
+    template<> struct Specialized<Composed::OpLess> {
+        typedef BetterFusion::LessArgConstNode ArgConst;
+        typedef SimpleFusion::LessConstNode Const;
+    };
+
+    struct Stats {
+        uint32_t numInstalled;
+        uint32_t numQuickened;
+        // Quickened to the plain node, for lack of a better shape
+        uint32_t numGeneric;
+
+        Stats() : numInstalled(0), numQuickened(0), numGeneric(0) {}
+    };
+
+    struct Quickener {
+        Module* module;
+        Stats* stats;
+
+        Quickener(Module* module, Stats* stats) : module(module), stats(stats) {}
+    };
+
+    // The part every quickening node shares. Once quickened, the node only
+    // forwards, for anyone still holding a pointer to it.
+    struct QuickeningNode : Node {
+        Node** slot;
+        Node* quickened;
+        Quickener* quickener;
+
+        QuickeningNode(Node** slot, Quickener* quickener) : slot(slot), quickened(0), quickener(quickener) {}
+    };
+
+    template<typename Op>
+    struct QuickenNode : QuickeningNode {
+        Node* lhs;
+        Node* rhs;
+
+        QuickenNode(Node* lhs, Node* rhs, Node** slot, Quickener* quickener)
+            : QuickeningNode(slot, quickener), lhs(lhs), rhs(rhs) {}
+
+        static bool isConst(Node* node, uint32_t* value) {
+            if (ConstNode* constant = dynamic_cast<ConstNode*>(node)) {
+                *value = constant->value;
+                return true;
+            }
+            if (BetterFusion::ConstNode* constant = dynamic_cast<BetterFusion::ConstNode*>(node)) {
+                *value = constant->value;
+                return true;
+            }
+            return false;
+        }
+
+        Node* specialize() {
+            Module* module = quickener->module;
+            uint32_t value;
+
+            if (!isConst(rhs, &value)) {
+                quickener->stats->numGeneric += 1;
+                return module->make<typename Op::Source>(lhs, rhs);
+            }
+            if (dynamic_cast<ArgNode*>(lhs) || dynamic_cast<BetterFusion::ArgNode*>(lhs)) {
+                return module->make<typename Specialized<Op>::ArgConst>(
+                    module->make<BetterFusion::ArgNode>(), module->make<BetterFusion::ConstNode>(value));
+            }
+            return module->make<typename Specialized<Op>::Const>(lhs, value);
+        }
+
+        uint32_t eval(Context* ctx) override {
+            if (quickened) {
+                return quickened->eval(ctx);
+            }
+
+            // Operands quicken first and update lhs and rhs as they do
+            uint32_t l = lhs->eval(ctx);
+            uint32_t r = rhs->eval(ctx);
+
+            // A recursive call through this node may have finished first
+            if (!quickened) {
+                quickened = specialize();
+                *slot = quickened;
+                quickener->stats->numQuickened += 1;
+            }
+
+            return Op::apply(l, r);
+        }
+    };
+
+    void install(Quickener* quickener, Node** slot);
+
+    template<typename Op>
+    void installBinary(Quickener* quickener, Node** slot) {
+        typename Op::Source* source = static_cast<typename Op::Source*>(*slot);
+        QuickenNode<Op>* node = quickener->module->make<QuickenNode<Op>>(source->lhs, source->rhs, slot, quickener);
+
+        *slot = node;
+        quickener->stats->numInstalled += 1;
+
+        install(quickener, &node->lhs);
+        install(quickener, &node->rhs);
+    }
+
+    // Top-down, so a node is replaced before its children are visited and
+    // their slots are the quickening node's own
+    void install(Quickener* quickener, Node** slot) {
+        if (dynamic_cast<AddNode*>(*slot)) {
+            installBinary<Composed::OpAdd>(quickener, slot);
+            return;
+        }
+        if (dynamic_cast<SubNode*>(*slot)) {
+            installBinary<Composed::OpSub>(quickener, slot);
+            return;
+        }
+        if (dynamic_cast<LessNode*>(*slot)) {
+            installBinary<Composed::OpLess>(quickener, slot);
+            return;
+        }
+
+        Node** slots[3];
+
+        for (uint32_t i = 0, end_i = Trees::childSlots(*slot, slots); i < end_i; i++) {
+            install(quickener, slots[i]);
+        }
+    }
+
+    void install(Quickener* quickener, Function* function) {
+        for (uint32_t i = 0; i < function->numNodes; i++) {
+            install(quickener, &function->body[i]);
+        }
+    }
+
+    uint32_t fib(uint32_t n, Stats* stats) {
+        Context ctx;
+        Module module;
+        Quickener quickener(&module, stats);
+
+        Function* function = module.make<Function>();
+
+        // Simplest::fib's tree, specialized as it runs
+        function->init(&module, {
+            module.make<IfNode>(
+                module.make<LessNode>(module.make<ArgNode>(), module.make<ConstNode>(2)),
+                module.make<ReturnNode>(module.make<ArgNode>())),
+            module.make<ReturnNode>(
+                module.make<AddNode>(
+                    module.make<CallNode>(function,
+                        module.make<SubNode>(module.make<ArgNode>(), module.make<ConstNode>(1))),
+                    module.make<CallNode>(function,
+                        module.make<SubNode>(module.make<ArgNode>(), module.make<ConstNode>(2)))))
+        });
+
+        install(&quickener, function);
+
+        CallNode* call = module.make<CallNode>(function, module.make<ConstNode>(n));
+
+        uint32_t result = call->eval(&ctx);
+
+        return result;
+    }
+
+    uint32_t fib(uint32_t n) {
+        Stats stats;
+        return fib(n, &stats);
+    }
+}
+
+namespace Bytecode {
+    using namespace SimplifyCalls;
+
+#if defined(__GNUC__) || defined(__clang__)
+#define BYTECODE_COMPUTED_GOTO
+#endif
+
+#define BYTECODE_OPS(X) \
+    X(OP_CONST) X(OP_ARG) X(OP_ADD) X(OP_SUB) X(OP_LESS) \
+    X(OP_LESS_CONST) X(OP_SUB_CONST) X(OP_LESS_ARG_CONST) X(OP_SUB_ARG_CONST) \
+    X(OP_JUMP) X(OP_JUMP_IF_FALSE) X(OP_POP) X(OP_CALL) X(OP_RET) X(OP_HALT) \
+    X(OP_PRINT) X(OP_PRINT_TEXT)
+
+    enum Op : uint32_t {
+#define X(op) op,
+        BYTECODE_OPS(X)
+#undef X
+    };
+
+    struct Instruction {
+        uint32_t op;
+        uint32_t operand;
+    };
+
+    // Code for every function reachable from the entry function. The program
+    // starts with `CALL entry; HALT`, so run() just pushes the argument.
+    // Print instructions refer to their text by index into `strings`.
+    struct Program {
+        std::vector<Instruction> code;
+        std::vector<std::string> strings;
+    };
+
+    // Compiles SimplifyCalls-style expression functions as well as
+    // statement-bodied Simplest and BetterFusion functions. Calls are emitted
+    // with the callee's index and patched to its entry once everything is compiled.
+    struct Compiler {
+        enum Kind { EXPRESSION_FUNCTION, SIMPLEST_FUNCTION, BETTER_FUSION_FUNCTION };
+
+        struct Pending {
+            Kind kind;
+            const void* function;
+
+            bool operator==(const Pending& other) const {
+                return function == other.function;
+            }
+        };
+
+        Program* program;
+        Trees::FunctionTable<Pending> functions;
+        std::vector<uint32_t> entries;
+        std::vector<uint32_t> calls;
+        const char* error;
+
+        Compiler(Program* program) : program(program), error(0) {}
+
+        uint32_t emit(Op op, uint32_t operand = 0) {
+            program->code.push_back({ op, operand });
+            return (uint32_t) program->code.size() - 1;
+        }
+
+        uint32_t here() {
+            return (uint32_t) program->code.size();
+        }
+
+        uint32_t string(const char* text) {
+            program->strings.push_back(text);
+            return (uint32_t) program->strings.size() - 1;
+        }
+
+        void emitCall(Kind kind, const void* function) {
+            calls.push_back(emit(OP_CALL, functions.indexOf({ kind, function })));
+        }
+
+        bool fail(const char* message) {
+            error = message;
+            return false;
+        }
+
+        template<typename Call>
+        bool compileCall(Call* call, Kind kind) {
+            if (!compileExpression(call->arg)) {
+                return false;
+            }
+            emitCall(kind, call->function);
+            return true;
+        }
+
+        bool compileExpression(Node* node) {
+            if (Simplest::ConstNode* constant = dynamic_cast<Simplest::ConstNode*>(node)) {
+                emit(OP_CONST, constant->value);
+                return true;
+            }
+            if (BetterFusion::ConstNode* constant = dynamic_cast<BetterFusion::ConstNode*>(node)) {
+                emit(OP_CONST, constant->value);
+                return true;
+            }
+            if (dynamic_cast<Simplest::ArgNode*>(node) || dynamic_cast<BetterFusion::ArgNode*>(node)) {
+                emit(OP_ARG);
+                return true;
+            }
+            if (AddNode* add = dynamic_cast<AddNode*>(node)) {
+                return compileBinary(add->lhs, add->rhs, OP_ADD);
+            }
+            if (SubNode* sub = dynamic_cast<SubNode*>(node)) {
+                return compileBinary(sub->lhs, sub->rhs, OP_SUB);
+            }
+            if (LessNode* less = dynamic_cast<LessNode*>(node)) {
+                return compileBinary(less->lhs, less->rhs, OP_LESS);
+            }
+            if (SimpleFusion::LessConstNode* less = dynamic_cast<SimpleFusion::LessConstNode*>(node)) {
+                if (!compileExpression(less->lhs)) {
+                    return false;
+                }
+                emit(OP_LESS_CONST, less->constant);
+                return true;
+            }
+            if (SimpleFusion::SubConstNode* sub = dynamic_cast<SimpleFusion::SubConstNode*>(node)) {
+                if (!compileExpression(sub->lhs)) {
+                    return false;
+                }
+                emit(OP_SUB_CONST, sub->constant);
+                return true;
+            }
+            if (LessArgConstNode* less = dynamic_cast<LessArgConstNode*>(node)) {
+                emit(OP_LESS_ARG_CONST, less->rhs->value);
+                return true;
+            }
+            if (SubArgConstNode* sub = dynamic_cast<SubArgConstNode*>(node)) {
+                emit(OP_SUB_ARG_CONST, sub->rhs->value);
+                return true;
+            }
+            if (IfElseNode* ifElse = dynamic_cast<IfElseNode*>(node)) {
+                return compileIfElse(ifElse, &Compiler::compileExpression);
+            }
+            if (CallAnyNode* call = dynamic_cast<CallAnyNode*>(node)) {
+                return compileCall(call, EXPRESSION_FUNCTION);
+            }
+            if (Simplest::CallNode* call = dynamic_cast<Simplest::CallNode*>(node)) {
+                return compileCall(call, SIMPLEST_FUNCTION);
+            }
+            if (BetterFusion::CallNode* call = dynamic_cast<BetterFusion::CallNode*>(node)) {
+                return compileCall(call, BETTER_FUSION_FUNCTION);
+            }
+            return fail("unsupported expression node");
+        }
+
+        bool compileBinary(Node* lhs, Node* rhs, Op op) {
+            if (!compileExpression(lhs) || !compileExpression(rhs)) {
+                return false;
+            }
+            emit(op);
+            return true;
+        }
+
+        bool compileIfElse(IfElseNode* ifElse, bool (Compiler::*compileBranch)(Node*)) {
+            if (!compileExpression(ifElse->condition)) {
+                return false;
+            }
+            uint32_t toElse = emit(OP_JUMP_IF_FALSE);
+            if (!(this->*compileBranch)(ifElse->ifBody)) {
+                return false;
+            }
+            uint32_t toEnd = emit(OP_JUMP);
+            program->code[toElse].operand = here();
+            if (!(this->*compileBranch)(ifElse->elseBody)) {
+                return false;
+            }
+            program->code[toEnd].operand = here();
+            return true;
+        }
+
+        bool compileStatement(Node* node) {
+            if (IfNode* ifNode = dynamic_cast<IfNode*>(node)) {
+                if (!compileExpression(ifNode->condition)) {
+                    return false;
+                }
+                uint32_t toEnd = emit(OP_JUMP_IF_FALSE);
+                if (!compileStatement(ifNode->body)) {
+                    return false;
+                }
+                program->code[toEnd].operand = here();
+                return true;
+            }
+            if (IfElseNode* ifElse = dynamic_cast<IfElseNode*>(node)) {
+                return compileIfElse(ifElse, &Compiler::compileStatement);
+            }
+            if (ReturnNode* ret = dynamic_cast<ReturnNode*>(node)) {
+                if (!compileExpression(ret->rhs)) {
+                    return false;
+                }
+                emit(OP_RET);
+                return true;
+            }
+            if (Simplest::SeqNode* seq = dynamic_cast<Simplest::SeqNode*>(node)) {
+                return compileStatement(seq->first) && compileStatement(seq->rest);
+            }
+            if (Simplest::PrintNode* print = dynamic_cast<Simplest::PrintNode*>(node)) {
+                if (!print->value) {
+                    emit(OP_PRINT_TEXT, string(print->text));
+                    return true;
+                }
+                if (!compileExpression(print->value)) {
+                    return false;
+                }
+                emit(OP_PRINT, string(print->text));
+                return true;
+            }
+            if (!compileExpression(node)) {
+                return false;
+            }
+            emit(OP_POP);
+            return true;
+        }
+
+        template<typename Function>
+        bool compileStatements(const Function* function) {
+            for (uint32_t i = 0; i < function->numNodes; i++) {
+                if (!compileStatement(function->body[i])) {
+                    return false;
+                }
+            }
+
+            // Falling off the end returns 0
+            emit(OP_CONST, 0);
+            emit(OP_RET);
+            return true;
+        }
+
+        bool compileFunction(const Pending& pending) {
+            switch (pending.kind) {
+            case EXPRESSION_FUNCTION:
+                if (!compileExpression((Node*) pending.function)) {
+                    return false;
+                }
+                emit(OP_RET);
+                return true;
+            case SIMPLEST_FUNCTION:
+                return compileStatements((const Simplest::Function*) pending.function);
+            case BETTER_FUSION_FUNCTION:
+                return compileStatements((const BetterFusion::Function*) pending.function);
+            }
+            return fail("unknown function kind");
+        }
+
+        bool compile(Kind kind, const void* entry) {
+            program->code.clear();
+            program->strings.clear();
+            emitCall(kind, entry);
+            emit(OP_HALT);
+
+            for (uint32_t i = 0; i < functions.size(); i++) {
+                entries.push_back(here());
+                if (!compileFunction(functions[i])) {
+                    return false;
+                }
+            }
+
+            for (uint32_t call : calls) {
+                program->code[call].operand = entries[program->code[call].operand];
+            }
+            return true;
+        }
+    };
+
+    // The arguments and saved registers of a call live on ctx->stack:
+    // fp[0] is the argument, fp[1] the return address, fp[2] the caller's fp.
+    uint32_t run(const Program& program, uint32_t arg, Context* ctx) {
+        const Instruction* code = program.code.data();
+        const Instruction* ip = code;
+        uint32_t* stack = ctx->stack + ctx->stackTop;
+        uint32_t* fp = stack;
+        uint32_t* sp = stack;
+
+        *sp++ = arg;
+
+        // Written back on the way out
+        uint32_t ticks = ctx->ticks;
+
+#if defined(BYTECODE_COMPUTED_GOTO)
+        static void* labels[] = {
+#define X(op) &&label_##op,
+            BYTECODE_OPS(X)
+#undef X
+        };
+#define CASE(op) label_##op:
+#define NEXT() goto *labels[ip->op]
+        NEXT();
+#else
+#define CASE(op) case op:
+#define NEXT() continue
+        for (;;) switch (ip->op) {
+#endif
+        CASE(OP_CONST) {
+            *sp++ = ip->operand;
+            ip++;
+            NEXT();
+        }
+        CASE(OP_ARG) {
+            *sp++ = fp[0];
+            ip++;
+            NEXT();
+        }
+        CASE(OP_ADD) {
+            sp--;
+            sp[-1] = sp[-1] + sp[0];
+            ip++;
+            NEXT();
+        }
+        CASE(OP_SUB) {
+            sp--;
+            sp[-1] = sp[-1] - sp[0];
+            ip++;
+            NEXT();
+        }
+        CASE(OP_LESS) {
+            sp--;
+            sp[-1] = sp[-1] < sp[0];
+            ip++;
+            NEXT();
+        }
+        CASE(OP_LESS_CONST) {
+            sp[-1] = sp[-1] < ip->operand;
+            ip++;
+            NEXT();
+        }
+        CASE(OP_SUB_CONST) {
+            sp[-1] = sp[-1] - ip->operand;
+            ip++;
+            NEXT();
+        }
+        CASE(OP_LESS_ARG_CONST) {
+            *sp++ = fp[0] < ip->operand;
+            ip++;
+            NEXT();
+        }
+        CASE(OP_SUB_ARG_CONST) {
+            *sp++ = fp[0] - ip->operand;
+            ip++;
+            NEXT();
+        }
+        CASE(OP_JUMP) {
+            // Backward jumps close loops
+            if (ip->operand <= (uint32_t) (ip - code) && --ticks == 0 && ctx->refill(&ticks)) {
+                return 0;
+            }
+            ip = code + ip->operand;
+            NEXT();
+        }
+        CASE(OP_JUMP_IF_FALSE) {
+            sp--;
+            ip = sp[0] ? ip + 1 : code + ip->operand;
+            NEXT();
+        }
+        CASE(OP_POP) {
+            sp--;
+            ip++;
+            NEXT();
+        }
+        CASE(OP_CALL) {
+            if (--ticks == 0 && ctx->refill(&ticks)) {
+                return 0;
+            }
+            sp[0] = (uint32_t) (ip + 1 - code);
+            sp[1] = (uint32_t) (fp - stack);
+            fp = sp - 1;
+            sp += 2;
+            ip = code + ip->operand;
+            NEXT();
+        }
+        CASE(OP_RET) {
+            uint32_t result = sp[-1];
+            ip = code + fp[1];
+            sp = fp;
+            fp = stack + fp[2];
+            *sp++ = result;
+            NEXT();
+        }
+        CASE(OP_HALT) {
+            ctx->ticks = ticks;
+            return sp[-1];
+        }
+        CASE(OP_PRINT) {
+            sp--;
+            printf("%s%u", program.strings[ip->operand].c_str(), sp[0]);
+            ip++;
+            NEXT();
+        }
+        CASE(OP_PRINT_TEXT) {
+            fputs(program.strings[ip->operand].c_str(), stdout);
+            ip++;
+            NEXT();
+        }
+#if !defined(BYTECODE_COMPUTED_GOTO)
+        }
+#endif
+#undef CASE
+#undef NEXT
+    }
+
+    uint32_t fib(uint32_t n) {
+        Context ctx;
+
+        // Same tree as SimplifyCalls::fib, compiled instead of walked
+        Module module;
+
+        IfElseNode* function = buildFib(&module);
+
+        Program program;
+        Compiler compiler(&program);
+
+        if (!compiler.compile(Compiler::EXPRESSION_FUNCTION, function)) {
+            fprintf(stderr, "bytecode: %s\n", compiler.error);
+            return 0;
+        }
+
+        return run(program, n, &ctx);
+    }
+}
+
+// Register-based counterpart of Bytecode: each instruction names the frame
+// slots it reads and writes, like `SUB_CONST r3, r0, 1`, so operands that
+// BetterFusion specializes into nodes become register or constant operands
+// instead of pushes. r0 is the argument and r1/r2 hold the return address
+// and the caller's frame; temporaries start at r3.
+namespace RegisterVM {
+    using namespace SimplifyCalls;
+
+#define REGISTER_OPS(X) \
+    X(OP_MOVE) X(OP_CONST) X(OP_ADD) X(OP_SUB) X(OP_LESS) \
+    X(OP_ADD_CONST) X(OP_SUB_CONST) X(OP_LESS_CONST) \
+    X(OP_JUMP) X(OP_JUMP_IF_FALSE) X(OP_JUMP_UNLESS_LESS_CONST) \
+    X(OP_CALL) X(OP_RET) X(OP_HALT) X(OP_PRINT) X(OP_PRINT_TEXT)
+
+    enum Op : uint32_t {
+#define X(op) op,
+        REGISTER_OPS(X)
+#undef X
+    };
+
+    // dst is the register written (compared, for JUMP_UNLESS_LESS_CONST); a
+    // is a register, except for jumps, where it's the target; b is a
+    // register, a constant, a call target or a string index, depending on op.
+    struct Instruction {
+        uint32_t op;
+        uint32_t dst;
+        uint32_t a;
+        uint32_t b;
+    };
+
+    enum Register : uint32_t { ARG = 0, RETURN_ADDRESS = 1, SAVED_FRAME = 2, FIRST_TEMP = 3 };
+
+    // Starts with `CALL r0, r0, entry; HALT r0`, so run() just stores the
+    // argument in r0 of the outermost frame.
+    struct Program {
+        std::vector<Instruction> code;
+        std::vector<std::string> strings;
+    };
+
+    // Compiles the same functions as Bytecode::Compiler. Registers are handed
+    // out like a stack while compiling an expression. A call's frame starts at
+    // its argument's register, so every temporary live across the call sits
+    // below it.
+    struct Compiler {
+        enum Kind { EXPRESSION_FUNCTION, SIMPLEST_FUNCTION, BETTER_FUSION_FUNCTION };
+
+        struct Pending {
+            Kind kind;
+            const void* function;
+
+            bool operator==(const Pending& other) const {
+                return function == other.function;
+            }
+        };
+
+        Program* program;
+        Trees::FunctionTable<Pending> functions;
+        std::vector<uint32_t> entries;
+        std::vector<uint32_t> calls;
+        uint32_t nextRegister;
+        const char* error;
+
+        Compiler(Program* program) : program(program), nextRegister(FIRST_TEMP), error(0) {}
+
+        uint32_t emit(Op op, uint32_t dst = 0, uint32_t a = 0, uint32_t b = 0) {
+            program->code.push_back({ op, dst, a, b });
+            return (uint32_t) program->code.size() - 1;
+        }
+
+        uint32_t here() {
+            return (uint32_t) program->code.size();
+        }
+
+        uint32_t string(const char* text) {
+            program->strings.push_back(text);
+            return (uint32_t) program->strings.size() - 1;
+        }
+
+        uint32_t temp() {
+            return nextRegister++;
+        }
+
+        bool fail(const char* message) {
+            error = message;
+            return false;
+        }
+
+        bool constant(Node* node, uint32_t* value) {
+            if (Simplest::ConstNode* constant = dynamic_cast<Simplest::ConstNode*>(node)) {
+                *value = constant->value;
+                return true;
+            }
+            if (BetterFusion::ConstNode* constant = dynamic_cast<BetterFusion::ConstNode*>(node)) {
+                *value = constant->value;
+                return true;
+            }
+            return false;
+        }
+
+        bool isArg(Node* node) {
+            return dynamic_cast<Simplest::ArgNode*>(node) || dynamic_cast<BetterFusion::ArgNode*>(node);
+        }
+
+        // The register holding node's value: r0 for the argument, otherwise
+        // a new temporary
+        bool operand(Node* node, uint32_t* reg) {
+            if (isArg(node)) {
+                *reg = ARG;
+                return true;
+            }
+            *reg = temp();
+            return compileExpression(node, *reg);
+        }
+
+        bool compileBinary(Node* lhs, Node* rhs, Op op, Op constOp, uint32_t dst) {
+            uint32_t saved = nextRegister;
+            uint32_t a, b, value;
+
+            if (!operand(lhs, &a)) {
+                return false;
+            }
+            if (constant(rhs, &value)) {
+                emit(constOp, dst, a, value);
+            }
+            else {
+                if (!operand(rhs, &b)) {
+                    return false;
+                }
+                emit(op, dst, a, b);
+            }
+
+            nextRegister = saved;
+            return true;
+        }
+
+        // The argument is computed straight into dst when dst is the newest
+        // register, otherwise into a temporary above everything live
+        template<typename Call>
+        bool compileCall(Call* call, Kind kind, uint32_t dst) {
+            uint32_t saved = nextRegister;
+            uint32_t arg = dst + 1 == nextRegister ? dst : temp();
+
+            if (!compileExpression(call->arg, arg)) {
+                return false;
+            }
+            calls.push_back(emit(OP_CALL, dst, arg, functions.indexOf({ kind, call->function })));
+
+            nextRegister = saved;
+            return true;
+        }
+
+        bool compileExpression(Node* node, uint32_t dst) {
+            uint32_t value;
+
+            if (constant(node, &value)) {
+                emit(OP_CONST, dst, 0, value);
+                return true;
+            }
+            if (isArg(node)) {
+                emit(OP_MOVE, dst, ARG);
+                return true;
+            }
+            if (AddNode* add = dynamic_cast<AddNode*>(node)) {
+                return compileBinary(add->lhs, add->rhs, OP_ADD, OP_ADD_CONST, dst);
+            }
+            if (SubNode* sub = dynamic_cast<SubNode*>(node)) {
+                return compileBinary(sub->lhs, sub->rhs, OP_SUB, OP_SUB_CONST, dst);
+            }
+            if (LessNode* less = dynamic_cast<LessNode*>(node)) {
+                return compileBinary(less->lhs, less->rhs, OP_LESS, OP_LESS_CONST, dst);
+            }
+            if (SimpleFusion::LessConstNode* less = dynamic_cast<SimpleFusion::LessConstNode*>(node)) {
+                uint32_t saved = nextRegister;
+                uint32_t a;
+                if (!operand(less->lhs, &a)) {
+                    return false;
+                }
+                emit(OP_LESS_CONST, dst, a, less->constant);
+                nextRegister = saved;
+                return true;
+            }
+            if (SimpleFusion::SubConstNode* sub = dynamic_cast<SimpleFusion::SubConstNode*>(node)) {
+                uint32_t saved = nextRegister;
+                uint32_t a;
+                if (!operand(sub->lhs, &a)) {
+                    return false;
+                }
+                emit(OP_SUB_CONST, dst, a, sub->constant);
+                nextRegister = saved;
+                return true;
+            }
+            if (LessArgConstNode* less = dynamic_cast<LessArgConstNode*>(node)) {
+                emit(OP_LESS_CONST, dst, ARG, less->rhs->value);
+                return true;
+            }
+            if (SubArgConstNode* sub = dynamic_cast<SubArgConstNode*>(node)) {
+                emit(OP_SUB_CONST, dst, ARG, sub->rhs->value);
+                return true;
+            }
+            if (IfElseNode* ifElse = dynamic_cast<IfElseNode*>(node)) {
+                uint32_t toElse, toEnd;
+                if (!compileCondition(ifElse->condition, &toElse) || !compileExpression(ifElse->ifBody, dst)) {
+                    return false;
+                }
+                toEnd = emit(OP_JUMP);
+                program->code[toElse].a = here();
+                if (!compileExpression(ifElse->elseBody, dst)) {
+                    return false;
+                }
+                program->code[toEnd].a = here();
+                return true;
+            }
+            if (CallAnyNode* call = dynamic_cast<CallAnyNode*>(node)) {
+                return compileCall(call, EXPRESSION_FUNCTION, dst);
+            }
+            if (Simplest::CallNode* call = dynamic_cast<Simplest::CallNode*>(node)) {
+                return compileCall(call, SIMPLEST_FUNCTION, dst);
+            }
+            if (BetterFusion::CallNode* call = dynamic_cast<BetterFusion::CallNode*>(node)) {
+                return compileCall(call, BETTER_FUSION_FUNCTION, dst);
+            }
+            return fail("unsupported expression node");
+        }
+
+        // Emits the condition and a jump whose target is patched later.
+        // Comparing with a constant and branching is a single instruction.
+        bool compileCondition(Node* condition, uint32_t* jump) {
+            uint32_t saved = nextRegister;
+            uint32_t reg, value;
+
+            if (LessArgConstNode* less = dynamic_cast<LessArgConstNode*>(condition)) {
+                *jump = emit(OP_JUMP_UNLESS_LESS_CONST, ARG, 0, less->rhs->value);
+                return true;
+            }
+            LessNode* less = dynamic_cast<LessNode*>(condition);
+            if (less && constant(less->rhs, &value)) {
+                if (!operand(less->lhs, &reg)) {
+                    return false;
+                }
+                *jump = emit(OP_JUMP_UNLESS_LESS_CONST, reg, 0, value);
+                nextRegister = saved;
+                return true;
+            }
+
+            if (!operand(condition, &reg)) {
+                return false;
+            }
+            *jump = emit(OP_JUMP_IF_FALSE, 0, 0, reg);
+
+            nextRegister = saved;
+            return true;
+        }
+
+        // Branches of a returned IfElseNode return on their own, and a
+        // returned argument needs no move
+        bool compileReturn(Node* node) {
+            if (IfElseNode* ifElse = dynamic_cast<IfElseNode*>(node)) {
+                uint32_t toElse;
+                if (!compileCondition(ifElse->condition, &toElse) || !compileReturn(ifElse->ifBody)) {
+                    return false;
+                }
+                program->code[toElse].a = here();
+                return compileReturn(ifElse->elseBody);
+            }
+
+            uint32_t saved = nextRegister;
+            uint32_t reg;
+
+            if (!operand(node, &reg)) {
+                return false;
+            }
+            emit(OP_RET, 0, reg);
+
+            nextRegister = saved;
+            return true;
+        }
+
+        bool compileStatement(Node* node) {
+            if (IfNode* ifNode = dynamic_cast<IfNode*>(node)) {
+                uint32_t toEnd;
+                if (!compileCondition(ifNode->condition, &toEnd) || !compileStatement(ifNode->body)) {
+                    return false;
+                }
+                program->code[toEnd].a = here();
+                return true;
+            }
+            if (IfElseNode* ifElse = dynamic_cast<IfElseNode*>(node)) {
+                uint32_t toElse, toEnd;
+                if (!compileCondition(ifElse->condition, &toElse) || !compileStatement(ifElse->ifBody)) {
+                    return false;
+                }
+                toEnd = emit(OP_JUMP);
+                program->code[toElse].a = here();
+                if (!compileStatement(ifElse->elseBody)) {
+                    return false;
+                }
+                program->code[toEnd].a = here();
+                return true;
+            }
+            if (ReturnNode* ret = dynamic_cast<ReturnNode*>(node)) {
+                return compileReturn(ret->rhs);
+            }
+            if (Simplest::SeqNode* seq = dynamic_cast<Simplest::SeqNode*>(node)) {
+                return compileStatement(seq->first) && compileStatement(seq->rest);
+            }
+            if (Simplest::PrintNode* print = dynamic_cast<Simplest::PrintNode*>(node)) {
+                if (!print->value) {
+                    emit(OP_PRINT_TEXT, 0, 0, string(print->text));
+                    return true;
+                }
+
+                uint32_t saved = nextRegister;
+                uint32_t reg;
+                if (!operand(print->value, &reg)) {
+                    return false;
+                }
+                emit(OP_PRINT, 0, reg, string(print->text));
+                nextRegister = saved;
+                return true;
+            }
+
+            uint32_t saved = nextRegister;
+            if (!compileExpression(node, temp())) {
+                return false;
+            }
+            nextRegister = saved;
+            return true;
+        }
+
+        template<typename Function>
+        bool compileStatements(const Function* function) {
+            for (uint32_t i = 0; i < function->numNodes; i++) {
+                if (!compileStatement(function->body[i])) {
+                    return false;
+                }
+            }
+
+            // Falling off the end returns 0
+            emit(OP_CONST, FIRST_TEMP, 0, 0);
+            emit(OP_RET, 0, FIRST_TEMP);
+            return true;
+        }
+
+        bool compileFunction(const Pending& pending) {
+            nextRegister = FIRST_TEMP;
+
+            switch (pending.kind) {
+            case EXPRESSION_FUNCTION:
+                return compileReturn((Node*) pending.function);
+            case SIMPLEST_FUNCTION:
+                return compileStatements((const Simplest::Function*) pending.function);
+            case BETTER_FUSION_FUNCTION:
+                return compileStatements((const BetterFusion::Function*) pending.function);
+            }
+            return fail("unknown function kind");
+        }
+
+        bool compile(Kind kind, const void* entry) {
+            program->code.clear();
+            program->strings.clear();
+            calls.push_back(emit(OP_CALL, ARG, ARG, functions.indexOf({ kind, entry })));
+            emit(OP_HALT, 0, ARG);
+
+            for (uint32_t i = 0; i < functions.size(); i++) {
+                entries.push_back(here());
+                if (!compileFunction(functions[i])) {
+                    return false;
+                }
+            }
+
+            for (uint32_t call : calls) {
+                program->code[call].b = entries[program->code[call].b];
+            }
+            return true;
+        }
+    };
+
+    // Frames live on ctx->stack. CALL starts the callee's frame at the
+    // argument's register; RET writes the result to the dst of the CALL just
+    // before the return address.
+    uint32_t run(const Program& program, uint32_t arg, Context* ctx) {
+        const Instruction* code = program.code.data();
+        const Instruction* ip = code;
+        uint32_t* stack = ctx->stack + ctx->stackTop;
+        uint32_t* fp = stack;
+
+        fp[ARG] = arg;
+
+        // Written back on the way out
+        uint32_t ticks = ctx->ticks;
+
+#if defined(BYTECODE_COMPUTED_GOTO)
+        static void* labels[] = {
+#define X(op) &&label_##op,
+            REGISTER_OPS(X)
+#undef X
+        };
+#define CASE(op) label_##op:
+#define NEXT() goto *labels[ip->op]
+        NEXT();
+#else
+#define CASE(op) case op:
+#define NEXT() continue
+        for (;;) switch (ip->op) {
+#endif
+        CASE(OP_MOVE) {
+            fp[ip->dst] = fp[ip->a];
+            ip++;
+            NEXT();
+        }
+        CASE(OP_CONST) {
+            fp[ip->dst] = ip->b;
+            ip++;
+            NEXT();
+        }
+        CASE(OP_ADD) {
+            fp[ip->dst] = fp[ip->a] + fp[ip->b];
+            ip++;
+            NEXT();
+        }
+        CASE(OP_SUB) {
+            fp[ip->dst] = fp[ip->a] - fp[ip->b];
+            ip++;
+            NEXT();
+        }
+        CASE(OP_LESS) {
+            fp[ip->dst] = fp[ip->a] < fp[ip->b];
+            ip++;
+            NEXT();
+        }
+        CASE(OP_ADD_CONST) {
+            fp[ip->dst] = fp[ip->a] + ip->b;
+            ip++;
+            NEXT();
+        }
+        CASE(OP_SUB_CONST) {
+            fp[ip->dst] = fp[ip->a] - ip->b;
+            ip++;
+            NEXT();
+        }
+        CASE(OP_LESS_CONST) {
+            fp[ip->dst] = fp[ip->a] < ip->b;
+            ip++;
+            NEXT();
+        }
+        CASE(OP_JUMP) {
+            // Backward jumps close loops
+            if (ip->a <= (uint32_t) (ip - code) && --ticks == 0 && ctx->refill(&ticks)) {
+                return 0;
+            }
+            ip = code + ip->a;
+            NEXT();
+        }
+        CASE(OP_JUMP_IF_FALSE) {
+            ip = fp[ip->b] ? ip + 1 : code + ip->a;
+            NEXT();
+        }
+        CASE(OP_JUMP_UNLESS_LESS_CONST) {
+            ip = fp[ip->dst] < ip->b ? ip + 1 : code + ip->a;
+            NEXT();
+        }
+        CASE(OP_CALL) {
+            if (--ticks == 0 && ctx->refill(&ticks)) {
+                return 0;
+            }
+            uint32_t* callee = fp + ip->a;
+            callee[RETURN_ADDRESS] = (uint32_t) (ip + 1 - code);
+            callee[SAVED_FRAME] = (uint32_t) (fp - stack);
+            fp = callee;
+            ip = code + ip->b;
+            NEXT();
+        }
+        CASE(OP_RET) {
+            uint32_t result = fp[ip->a];
+            ip = code + fp[RETURN_ADDRESS];
+            fp = stack + fp[SAVED_FRAME];
+            fp[ip[-1].dst] = result;
+            NEXT();
+        }
+        CASE(OP_HALT) {
+            ctx->ticks = ticks;
+            return fp[ip->a];
+        }
+        CASE(OP_PRINT) {
+            printf("%s%u", program.strings[ip->b].c_str(), fp[ip->a]);
+            ip++;
+            NEXT();
+        }
+        CASE(OP_PRINT_TEXT) {
+            fputs(program.strings[ip->b].c_str(), stdout);
+            ip++;
+            NEXT();
+        }
+#if !defined(BYTECODE_COMPUTED_GOTO)
+        }
+#endif
+#undef CASE
+#undef NEXT
+    }
+
+    uint32_t fib(uint32_t n) {
+        Context ctx;
+
+        // Same tree as SimplifyCalls::fib and Bytecode::fib
+        Module module;
+
+        IfElseNode* function = buildFib(&module);
+
+        Program program;
+        Compiler compiler(&program);
+
+        if (!compiler.compile(Compiler::EXPRESSION_FUNCTION, function)) {
+            fprintf(stderr, "register vm: %s\n", compiler.error);
+            return 0;
+        }
+
+        return run(program, n, &ctx);
+    }
+}
+
+// Native code for SimplifyCalls trees, stitched together from fixed x86-64
+// instruction templates with holes for constants, frame slots and call
+// targets. The argument lives in ebx and the Context in r12 for the whole
+// call; values are computed into eax, and a binary node parks its left
+// operand in a frame slot while computing the right one. A subtree without a
+// template is handed to the tree walker through a helper call, and where
+// there's no JIT at all (other CPUs, or Windows and its calling convention)
+// trees are just walked.
+namespace Jit {
+    using namespace SimplifyCalls;
+
+#if defined(__x86_64__) && defined(OIF_POSIX)
+#define JIT_X86_64
+#endif
+
+    typedef uint32_t (*Entry)(uint32_t arg, Context* ctx);
+
+    // Evaluates a tree the JIT has no template for, as a call would
+    uint32_t fallback(Node* node, Context* ctx, uint32_t arg) {
+        ctx->push(arg);
+        uint32_t result = node->eval(ctx);
+        ctx->stopForReturn = false;
+        ctx->pop();
+        return result;
+    }
+
+    // Machine code for a function tree and everything it calls. Compiled code
+    // is written, then made executable and read-only.
+    struct Program {
+        void* memory;
+        size_t size;
+        Entry entry;
+        // Subtrees that went to the tree walker
+        uint32_t numFallbacks;
+
+        Program() : memory(0), size(0), entry(0), numFallbacks(0) {}
+
+        Program(const Program&) = delete;
+        Program& operator=(const Program&) = delete;
+
+        ~Program() {
+#if defined(JIT_X86_64)
+            if (memory) {
+                munmap(memory, size);
+            }
+#endif
+        }
+
+        uint32_t run(uint32_t arg, Context* ctx) const {
+            return entry(arg, ctx);
+        }
+    };
+
+    struct Compiler {
+        struct Patch {
+            uint32_t offset;
+            uint32_t function;
+        };
+
+        std::vector<uint8_t> code;
+        Trees::FunctionTable<Node*> functions;
+        std::vector<uint32_t> entries;
+        std::vector<Patch> calls;
+        // Frame slots in use and the most the current function needs at once
+        uint32_t depth;
+        uint32_t maxDepth;
+        uint32_t numFallbacks;
+
+        Compiler() : depth(0), maxDepth(0), numFallbacks(0) {}
+
+        void emit(std::initializer_list<uint8_t> bytes) {
+            code.insert(code.end(), bytes.begin(), bytes.end());
+        }
+
+        void emit32(uint32_t value) {
+            for (uint32_t i = 0; i < 4; i++) {
+                code.push_back((uint8_t) (value >> (8 * i)));
+            }
+        }
+
+        void emit64(uint64_t value) {
+            emit32((uint32_t) value);
+            emit32((uint32_t) (value >> 32));
+        }
+
+        void patch32(uint32_t offset, uint32_t value) {
+            for (uint32_t i = 0; i < 4; i++) {
+                code[offset + i] = (uint8_t) (value >> (8 * i));
+            }
+        }
+
+        uint32_t here() {
+            return (uint32_t) code.size();
+        }
+
+        // Points the rel32 ending at `offset + 4` to target
+        void patchJump(uint32_t offset, uint32_t target) {
+            patch32(offset, target - (offset + 4));
+        }
+
+        bool constant(Node* node, uint32_t* value) {
+            if (Simplest::ConstNode* constant = dynamic_cast<Simplest::ConstNode*>(node)) {
+                *value = constant->value;
+                return true;
+            }
+            if (BetterFusion::ConstNode* constant = dynamic_cast<BetterFusion::ConstNode*>(node)) {
+                *value = constant->value;
+                return true;
+            }
+            return false;
+        }
+
+        void compileSetBelow() {
+            emit({ 0x0f, 0x92, 0xc0 });             // setb al
+            emit({ 0x0f, 0xb6, 0xc0 });             // movzx eax, al
+        }
+
+        // eax = lhs op rhs, with rhs folded into the instruction if it's a
+        // constant and parked in a frame slot otherwise
+        void compileBinary(Node* lhs, Node* rhs, uint8_t opConst, bool less) {
+            uint32_t value;
+
+            compileExpression(lhs);
+
+            if (constant(rhs, &value)) {
+                emit({ opConst });                  // add/sub/cmp eax, imm32
+                emit32(value);
+                if (less) {
+                    compileSetBelow();
+                }
+                return;
+            }
+
+            uint32_t slot = 8 * depth;
+            depth += 1;
+            maxDepth = depth > maxDepth ? depth : maxDepth;
+
+            emit({ 0x89, 0x84, 0x24 });             // mov [rsp + slot], eax
+            emit32(slot);
+            compileExpression(rhs);
+            depth -= 1;
+
+            emit({ 0x89, 0xc1 });                   // mov ecx, eax
+            emit({ 0x8b, 0x84, 0x24 });             // mov eax, [rsp + slot]
+            emit32(slot);
+
+            if (opConst == 0x05) {
+                emit({ 0x01, 0xc8 });               // add eax, ecx
+            }
+            else if (opConst == 0x2d) {
+                emit({ 0x29, 0xc8 });               // sub eax, ecx
+            }
+            else {
+                emit({ 0x39, 0xc8 });               // cmp eax, ecx
+                compileSetBelow();
+            }
+        }
+
+        void compileExpression(Node* node) {
+            uint32_t value;
+
+            if (constant(node, &value)) {
+                emit({ 0xb8 });                     // mov eax, imm32
+                emit32(value);
+                return;
+            }
+            if (dynamic_cast<Simplest::ArgNode*>(node) || dynamic_cast<BetterFusion::ArgNode*>(node)) {
+                emit({ 0x89, 0xd8 });               // mov eax, ebx
+                return;
+            }
+            if (AddNode* add = dynamic_cast<AddNode*>(node)) {
+                compileBinary(add->lhs, add->rhs, 0x05, false);
+                return;
+            }
+            if (SubNode* sub = dynamic_cast<SubNode*>(node)) {
+                compileBinary(sub->lhs, sub->rhs, 0x2d, false);
+                return;
+            }
+            if (LessNode* less = dynamic_cast<LessNode*>(node)) {
+                compileBinary(less->lhs, less->rhs, 0x3d, true);
+                return;
+            }
+            if (SimpleFusion::LessConstNode* less = dynamic_cast<SimpleFusion::LessConstNode*>(node)) {
+                compileExpression(less->lhs);
+                emit({ 0x3d });                     // cmp eax, imm32
+                emit32(less->constant);
+                compileSetBelow();
+                return;
+            }
+            if (SimpleFusion::SubConstNode* sub = dynamic_cast<SimpleFusion::SubConstNode*>(node)) {
+                compileExpression(sub->lhs);
+                emit({ 0x2d });                     // sub eax, imm32
+                emit32(sub->constant);
+                return;
+            }
+            if (LessArgConstNode* less = dynamic_cast<LessArgConstNode*>(node)) {
+                emit({ 0x31, 0xc0 });               // xor eax, eax
+                emit({ 0x81, 0xfb });               // cmp ebx, imm32
+                emit32(less->rhs->value);
+                emit({ 0x0f, 0x92, 0xc0 });         // setb al
+                return;
+            }
+            if (SubArgConstNode* sub = dynamic_cast<SubArgConstNode*>(node)) {
+                emit({ 0x89, 0xd8 });               // mov eax, ebx
+                emit({ 0x2d });                     // sub eax, imm32
+                emit32(sub->rhs->value);
+                return;
+            }
+            if (IfElseNode* ifElse = dynamic_cast<IfElseNode*>(node)) {
+                compileExpression(ifElse->condition);
+                emit({ 0x85, 0xc0 });               // test eax, eax
+                emit({ 0x0f, 0x84 });               // jz else
+                uint32_t toElse = here();
+                emit32(0);
+                compileExpression(ifElse->ifBody);
+                emit({ 0xe9 });                     // jmp end
+                uint32_t toEnd = here();
+                emit32(0);
+                patchJump(toElse, here());
+                compileExpression(ifElse->elseBody);
+                patchJump(toEnd, here());
+                return;
+            }
+            if (CallAnyNode* call = dynamic_cast<CallAnyNode*>(node)) {
+                compileExpression(call->arg);
+                emit({ 0x89, 0xc7 });               // mov edi, eax
+                emit({ 0x4c, 0x89, 0xe6 });         // mov rsi, r12
+                emit({ 0xe8 });                     // call function
+                calls.push_back({ here(), functions.indexOf(call->function) });
+                emit32(0);
+                return;
+            }
+
+            numFallbacks += 1;
+            emit({ 0x48, 0xbf });                   // mov rdi, node
+            emit64((uint64_t) (uintptr_t) node);
+            emit({ 0x4c, 0x89, 0xe6 });             // mov rsi, r12
+            emit({ 0x89, 0xda });                   // mov edx, ebx
+            emit({ 0x48, 0xb8 });                   // mov rax, fallback
+            emit64((uint64_t) (uintptr_t) &fallback);
+            emit({ 0xff, 0xd0 });                   // call rax
+        }
+
+        // Entry rsp is 8 off 16-byte alignment; the two pushes keep it that
+        // way, so the frame is an odd number of slots to realign calls.
+        void compileFunction(Node* function) {
+            depth = 0;
+            maxDepth = 0;
+
+            emit({ 0x53 });                         // push rbx
+            emit({ 0x41, 0x54 });                   // push r12
+            emit({ 0x48, 0x81, 0xec });             // sub rsp, frame
+            uint32_t prologue = here();
+            emit32(0);
+            emit({ 0x89, 0xfb });                   // mov ebx, edi
+            emit({ 0x49, 0x89, 0xf4 });             // mov r12, rsi
+
+            compileExpression(function);
+
+            uint32_t frame = 8 * (maxDepth | 1);
+            patch32(prologue, frame);
+
+            emit({ 0x48, 0x81, 0xc4 });             // add rsp, frame
+            emit32(frame);
+            emit({ 0x41, 0x5c });                   // pop r12
+            emit({ 0x5b });                         // pop rbx
+            emit({ 0xc3 });                         // ret
+        }
+
+        // False if there's no JIT for this platform or memory can't be mapped
+        bool compile(Node* entry, Program* program) {
+#if defined(JIT_X86_64)
+            functions.indexOf(entry);
+
+            for (uint32_t i = 0; i < functions.size(); i++) {
+                entries.push_back(here());
+                compileFunction(functions[i]);
+            }
+
+            for (const Patch& call : calls) {
+                patchJump(call.offset, entries[call.function]);
+            }
+
+            size_t size = code.size();
+            void* memory = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (memory == MAP_FAILED) {
+                return false;
+            }
+
+            memcpy(memory, code.data(), size);
+
+            if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+                munmap(memory, size);
+                return false;
+            }
+
+            program->memory = memory;
+            program->size = size;
+            program->entry = (Entry) memory;
+            program->numFallbacks = numFallbacks;
+            return true;
+#else
+            return false;
+#endif
+        }
+    };
+
+    uint32_t fib(uint32_t n) {
+        Context ctx;
+
+        // Same tree as SimplifyCalls::fib, running natively
+        Module module;
+
+        IfElseNode* function = buildFib(&module);
+
+        Program program;
+        Compiler compiler;
+
+        if (!compiler.compile(function, &program)) {
+            return fallback(function, &ctx, n);
+        }
+
+        return program.run(n, &ctx);
+    }
+}
+
+// Tiered execution for Simplest functions. Every function starts as its
+// plain tree; counted calls fuse it in place once it's warm and compile it
+// to bytecode once it's hot. Fusion only swaps child pointers to equivalent
+// nodes and never frees the old ones, so calls already running carry on
+// safely; a compiled function is used from its next call on, while running
+// calls finish in the tree.
+namespace Tiering {
+    using namespace Simplest;
+
+    enum Tier : uint32_t { TIER_TREE, TIER_FUSED, TIER_BYTECODE };
+
+    struct Tiered {
+        Function* function;
+        uint32_t numCalls;
+        Tier tier;
+        // Set once compiled; the function and its callees then run in the VM
+        Bytecode::Program* program;
+
+        Tiered(Function* function) : function(function), numCalls(0), tier(TIER_TREE), program(0) {}
+    };
+
+    struct Engine {
+        Module* module;
+        std::vector<Tiered*> functions;
+        std::vector<Bytecode::Program*> programs;
+        uint32_t fuseAfter;
+        uint32_t compileAfter;
+        uint32_t numFused;
+        uint32_t numCompiled;
+
+        Engine(Module* module, uint32_t fuseAfter = 64, uint32_t compileAfter = 4096)
+            : module(module), fuseAfter(fuseAfter), compileAfter(compileAfter), numFused(0), numCompiled(0) {}
+
+        Engine(const Engine&) = delete;
+        Engine& operator=(const Engine&) = delete;
+
+        ~Engine() {
+            for (Bytecode::Program* program : programs) {
+                delete program;
+            }
+        }
+
+        Tiered* find(Function* function) {
+            for (Tiered* tiered : functions) {
+                if (tiered->function == function) {
+                    return tiered;
+                }
+            }
+            functions.push_back(module->make<Tiered>(function));
+            return functions.back();
+        }
+
+        // A function the bytecode compiler can't handle stays fused
+        void promote(Tiered* tiered) {
+            if (tiered->tier == TIER_TREE) {
+                AutoFusion::fuse(module, tiered->function);
+                tiered->tier = TIER_FUSED;
+                numFused += 1;
+                return;
+            }
+
+            Bytecode::Program* program = new Bytecode::Program();
+            Bytecode::Compiler compiler(program);
+
+            tiered->tier = TIER_BYTECODE;
+
+            if (!compiler.compile(Bytecode::Compiler::SIMPLEST_FUNCTION, tiered->function)) {
+                delete program;
+                return;
+            }
+
+            programs.push_back(program);
+            tiered->program = program;
+            numCompiled += 1;
+        }
+    };
+
+    // A CallNode that counts calls to promote its function. Passes and
+    // compilers take it for a plain CallNode.
+    struct TieredCallNode : CallNode {
+        Tiered* tiered;
+        Engine* engine;
+
+        TieredCallNode(Tiered* tiered, Node* arg, Engine* engine)
+            : CallNode(tiered->function, arg), tiered(tiered), engine(engine) {}
+
+        uint32_t eval(Context* ctx) override {
+            if (ctx->tick()) {
+                return ctx->stopped();
+            }
+
+            uint32_t value = arg->eval(ctx);
+#if defined(TRACING)
+            // Once compiled, the calls the bytecode makes aren't hooked
+            Tracing::Scope scope(ctx->trace, this, function);
+#endif
+
+            if (tiered->program) {
+                return Bytecode::run(*tiered->program, value, ctx);
+            }
+
+            tiered->numCalls += 1;
+            if (tiered->numCalls == engine->fuseAfter || tiered->numCalls == engine->compileAfter) {
+                engine->promote(tiered);
+            }
+
+            ctx->push(value);
+
+            for (uint32_t i = 0, end_i = function->numNodes; i < end_i; i++) {
+                function->body[i]->eval(ctx);
+                if (ctx->stopForReturn) {
+                    break;
+                }
+            }
+
+            ctx->stopForReturn = false;
+            ctx->pop();
+
+            return ctx->returnValue;
+        }
+    };
+
+    Node* instrument(Engine* engine, Node* node) {
+        Node** slots[3];
+
+        for (uint32_t i = 0, end_i = Trees::childSlots(node, slots); i < end_i; i++) {
+            *slots[i] = instrument(engine, *slots[i]);
+        }
+
+        CallNode* call = dynamic_cast<CallNode*>(node);
+        if (call && !dynamic_cast<TieredCallNode*>(node)) {
+            return engine->module->make<TieredCallNode>(engine->find(call->function), call->arg, engine);
+        }
+        return node;
+    }
+
+    // Turns the call sites in functions into TieredCallNodes
+    void instrument(Engine* engine, Function** functions, uint32_t numFunctions) {
+        for (uint32_t i = 0; i < numFunctions; i++) {
+            Function* function = functions[i];
+            for (uint32_t j = 0; j < function->numNodes; j++) {
+                function->body[j] = instrument(engine, function->body[j]);
+            }
+        }
+    }
+
+    uint32_t fib(uint32_t n) {
+        Context ctx;
+        Module module;
+        Engine engine(&module);
+
+        Function* function = module.make<Function>();
+
+        // Simplest::fib's tree, left to the engine
+        function->init(&module, {
+            module.make<IfNode>(
+                module.make<LessNode>(module.make<ArgNode>(), module.make<ConstNode>(2)),
+                module.make<ReturnNode>(module.make<ArgNode>())),
+            module.make<ReturnNode>(
+                module.make<AddNode>(
+                    module.make<CallNode>(function,
+                        module.make<SubNode>(module.make<ArgNode>(), module.make<ConstNode>(1))),
+                    module.make<CallNode>(function,
+                        module.make<SubNode>(module.make<ArgNode>(), module.make<ConstNode>(2)))))
+        });
+
+        instrument(&engine, &function, 1);
+
+        Node* call = instrument(&engine, module.make<CallNode>(function, module.make<ConstNode>(n)));
+
+        uint32_t result = call->eval(&ctx);
+
+        return result;
+    }
+}
+
+// A pointer-free file format for SimplifyCalls trees, so a program can be
+// mapped and run without building it. The file is a header and an array of
+// 32-bit words in native byte order: each node is a record of its tag and
+// then its fields, constants inline and children as offsets in words from
+// the start of the record. A tree's children always follow it, so only a
+// call's function can point backwards. Images run in place, or are relinked
+// into an arena as ordinary nodes, all carved out of one allocation.
+namespace Image {
+    using namespace SimplifyCalls;
+
+#define IMAGE_TAGS(X) \
+    X(TAG_CONST, 1) X(TAG_ARG, 0) X(TAG_ADD, 2) X(TAG_SUB, 2) X(TAG_LESS, 2) \
+    X(TAG_LESS_CONST, 2) X(TAG_SUB_CONST, 2) X(TAG_LESS_ARG_CONST, 1) X(TAG_SUB_ARG_CONST, 1) \
+    X(TAG_IF_ELSE, 3) X(TAG_CALL, 2)
+
+    enum Tag : uint32_t {
+#define X(tag, numFields) tag,
+        IMAGE_TAGS(X)
+#undef X
+        NUM_TAGS
+    };
+
+    const uint32_t numFields[] = {
+#define X(tag, numFields) numFields,
+        IMAGE_TAGS(X)
+#undef X
+    };
+
+    // "OIFI" when read back in the byte order it was written in
+    const uint32_t magic = 0x4946494f;
+    const uint32_t version = 1;
+
+    struct Header {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t numWords;
+        // Record of the entry function's root
+        uint32_t entry;
+    };
+
+    // Serializes the entry function and everything it calls. Like the
+    // bytecode compiler, calls hold the callee's index until every function
+    // has been written and are then patched to its offset.
+    struct Writer {
+        std::vector<uint32_t> words;
+        Trees::FunctionTable<Node*> functions;
+        std::vector<uint32_t> entries;
+        std::vector<uint32_t> calls;
+        const char* error;
+
+        Writer() : error(0) {}
+
+        uint32_t record(Tag tag) {
+            uint32_t start = (uint32_t) words.size();
+            words.push_back(tag);
+            words.resize(words.size() + numFields[tag], 0);
+            return start;
+        }
+
+        bool fail(const char* message) {
+            error = message;
+            return false;
+        }
+
+        // Writes the child and stores its offset in field i of the record
+        bool writeChild(uint32_t start, uint32_t i, Node* child) {
+            uint32_t offset;
+
+            if (!writeNode(child, &offset)) {
+                return false;
+            }
+            words[start + i] = offset - start;
+            return true;
+        }
+
+        bool writeBinary(Tag tag, Node* lhs, Node* rhs, uint32_t* offset) {
+            *offset = record(tag);
+            return writeChild(*offset, 1, lhs) && writeChild(*offset, 2, rhs);
+        }
+
+        bool writeNode(Node* node, uint32_t* offset) {
+            if (Simplest::ConstNode* constant = dynamic_cast<Simplest::ConstNode*>(node)) {
+                *offset = record(TAG_CONST);
+                words[*offset + 1] = constant->value;
+                return true;
+            }
+            if (BetterFusion::ConstNode* constant = dynamic_cast<BetterFusion::ConstNode*>(node)) {
+                *offset = record(TAG_CONST);
+                words[*offset + 1] = constant->value;
+                return true;
+            }
+            if (dynamic_cast<Simplest::ArgNode*>(node) || dynamic_cast<BetterFusion::ArgNode*>(node)) {
+                *offset = record(TAG_ARG);
+                return true;
+            }
+            if (AddNode* add = dynamic_cast<AddNode*>(node)) {
+                return writeBinary(TAG_ADD, add->lhs, add->rhs, offset);
+            }
+            if (SubNode* sub = dynamic_cast<SubNode*>(node)) {
+                return writeBinary(TAG_SUB, sub->lhs, sub->rhs, offset);
+            }
+            if (LessNode* less = dynamic_cast<LessNode*>(node)) {
+                return writeBinary(TAG_LESS, less->lhs, less->rhs, offset);
+            }
+            if (SimpleFusion::LessConstNode* less = dynamic_cast<SimpleFusion::LessConstNode*>(node)) {
+                *offset = record(TAG_LESS_CONST);
+                words[*offset + 2] = less->constant;
+                return writeChild(*offset, 1, less->lhs);
+            }
+            if (SimpleFusion::SubConstNode* sub = dynamic_cast<SimpleFusion::SubConstNode*>(node)) {
+                *offset = record(TAG_SUB_CONST);
+                words[*offset + 2] = sub->constant;
+                return writeChild(*offset, 1, sub->lhs);
+            }
+            if (LessArgConstNode* less = dynamic_cast<LessArgConstNode*>(node)) {
+                *offset = record(TAG_LESS_ARG_CONST);
+                words[*offset + 1] = less->rhs->value;
+                return true;
+            }
+            if (SubArgConstNode* sub = dynamic_cast<SubArgConstNode*>(node)) {
+                *offset = record(TAG_SUB_ARG_CONST);
+                words[*offset + 1] = sub->rhs->value;
+                return true;
+            }
+            if (IfElseNode* ifElse = dynamic_cast<IfElseNode*>(node)) {
+                *offset = record(TAG_IF_ELSE);
+                return writeChild(*offset, 1, ifElse->condition) && writeChild(*offset, 2, ifElse->ifBody) &&
+                    writeChild(*offset, 3, ifElse->elseBody);
+            }
+            if (CallAnyNode* call = dynamic_cast<CallAnyNode*>(node)) {
+                *offset = record(TAG_CALL);
+                words[*offset + 1] = functions.indexOf(call->function);
+                calls.push_back(*offset);
+                return writeChild(*offset, 2, call->arg);
+            }
+            return fail("unsupported node");
+        }
+
+        bool write(Node* entry) {
+            words.clear();
+            functions.indexOf(entry);
+
+            for (uint32_t i = 0; i < functions.size(); i++) {
+                uint32_t offset;
+
+                if (!writeNode(functions[i], &offset)) {
+                    return false;
+                }
+                entries.push_back(offset);
+            }
+
+            for (uint32_t call : calls) {
+                words[call + 1] = entries[words[call + 1]] - call;
+            }
+            return true;
+        }
+
+        bool save(FILE* file) const {
+            Header header = { magic, version, (uint32_t) words.size(), entries[0] };
+
+            return fwrite(&header, sizeof(header), 1, file) == 1 &&
+                fwrite(words.data(), sizeof(uint32_t), words.size(), file) == words.size() &&
+                fflush(file) == 0;
+        }
+    };
+
+    const uint32_t* child(const uint32_t* record, uint32_t i) {
+        return record + (int32_t) record[i];
+    }
+
+    // Walks a tree in place, as its nodes would
+    uint32_t eval(const uint32_t* record, Context* ctx) {
+        switch (record[0]) {
+        case TAG_CONST:
+            return record[1];
+        case TAG_ARG:
+            return ctx->stack[ctx->stackTop - 1];
+        case TAG_ADD:
+            return eval(child(record, 1), ctx) + eval(child(record, 2), ctx);
+        case TAG_SUB:
+            return eval(child(record, 1), ctx) - eval(child(record, 2), ctx);
+        case TAG_LESS:
+            return eval(child(record, 1), ctx) < eval(child(record, 2), ctx);
+        case TAG_LESS_CONST:
+            return eval(child(record, 1), ctx) < record[2];
+        case TAG_SUB_CONST:
+            return eval(child(record, 1), ctx) - record[2];
+        case TAG_LESS_ARG_CONST:
+            return ctx->stack[ctx->stackTop - 1] < record[1];
+        case TAG_SUB_ARG_CONST:
+            return ctx->stack[ctx->stackTop - 1] - record[1];
+        case TAG_IF_ELSE:
+            if (eval(child(record, 1), ctx)) {
+                return eval(child(record, 2), ctx);
+            }
+            else {
+                return eval(child(record, 3), ctx);
+            }
+        case TAG_CALL: {
+            if (ctx->tick()) {
+                return ctx->stopped();
+            }
+            ctx->push(eval(child(record, 2), ctx));
+            uint32_t result = eval(child(record, 1), ctx);
+            ctx->pop();
+            return result;
+        }
+        }
+        return 0;
+    }
+
+    // A loaded image: the file mapped read-only where there's mmap, read
+    // into memory elsewhere. Loading only checks the header, so it takes
+    // the same time for any size of program.
+    struct Program {
+        void* memory;
+        size_t size;
+        const uint32_t* words;
+        uint32_t numWords;
+        uint32_t entry;
+
+        Program() : memory(0), size(0), words(0), numWords(0), entry(0) {}
+
+        Program(const Program&) = delete;
+        Program& operator=(const Program&) = delete;
+
+        ~Program() {
+            if (!memory) {
+                return;
+            }
+#if defined(OIF_POSIX)
+            munmap(memory, size);
+#else
+            free(memory);
+#endif
+        }
+
+        bool load(FILE* file) {
+            if (fseek(file, 0, SEEK_END) != 0) {
+                return false;
+            }
+            long length = ftell(file);
+            if (length < (long) sizeof(Header) || length % sizeof(uint32_t) != 0) {
+                return false;
+            }
+            size = (size_t) length;
+
+#if defined(OIF_POSIX)
+            memory = mmap(0, size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+            if (memory == MAP_FAILED) {
+                memory = 0;
+                return false;
+            }
+#else
+            memory = malloc(size);
+            if (fseek(file, 0, SEEK_SET) != 0 || fread(memory, size, 1, file) != 1) {
+                return false;
+            }
+#endif
+
+            const Header* header = (const Header*) memory;
+
+            if (header->magic != magic || header->version != version ||
+                header->numWords != (size - sizeof(Header)) / sizeof(uint32_t) || header->entry >= header->numWords) {
+                return false;
+            }
+
+            words = (const uint32_t*) (header + 1);
+            numWords = header->numWords;
+            entry = header->entry;
+            return true;
+        }
+
+        // Checks every record once: tags are known, records fit, and children
+        // land on records inside the image. Children other than callees must
+        // follow their parent, so a tree can't contain itself.
+        bool verify() const {
+            std::vector<bool> starts(numWords, false);
+
+            for (uint32_t i = 0; i < numWords; i += 1 + numFields[words[i]]) {
+                if (words[i] >= NUM_TAGS || numFields[words[i]] >= numWords - i) {
+                    return false;
+                }
+                starts[i] = true;
+            }
+            if (!starts[entry]) {
+                return false;
+            }
+
+            for (uint32_t i = 0; i < numWords; i += 1 + numFields[words[i]]) {
+                uint32_t first = 1, last = 0;
+
+                switch (words[i]) {
+                case TAG_ADD: case TAG_SUB: case TAG_LESS: last = 2; break;
+                case TAG_LESS_CONST: case TAG_SUB_CONST: last = 1; break;
+                case TAG_IF_ELSE: last = 3; break;
+                case TAG_CALL: first = 2; last = 2; break;
+                }
+
+                for (uint32_t j = first; j <= last; j++) {
+                    uint32_t target = i + words[i + j];
+                    if (target <= i || target >= numWords || !starts[target]) {
+                        return false;
+                    }
+                }
+                if (words[i] == TAG_CALL) {
+                    uint32_t target = i + words[i + 1];
+                    if (target >= numWords || !starts[target]) {
+                        return false;
+                    }
+                }
+            }
+            return true;
+        }
+
+        // A call to the entry function
+        uint32_t run(uint32_t arg, Context* ctx) const {
+            ctx->push(arg);
+            uint32_t result = eval(words + entry, ctx);
+            ctx->pop();
+            return result;
+        }
+    };
+
+    // Bytes a node takes in a relinked block, padded so the next one is aligned
+    template<typename T>
+    size_t footprint() {
+        static_assert(std::is_trivially_destructible<T>::value, "arena objects are never destroyed");
+        static_assert(alignof(T) <= alignof(Node*), "nodes are packed at pointer alignment");
+        return (sizeof(T) + alignof(Node*) - 1) & ~(alignof(Node*) - 1);
+    }
+
+    // Fused nodes with typed operands carry them right behind themselves
+    size_t footprint(uint32_t tag) {
+        switch (tag) {
+        case TAG_CONST: return footprint<BetterFusion::ConstNode>();
+        case TAG_ARG: return footprint<BetterFusion::ArgNode>();
+        case TAG_ADD: return footprint<AddNode>();
+        case TAG_SUB: return footprint<SubNode>();
+        case TAG_LESS: return footprint<LessNode>();
+        case TAG_LESS_CONST: return footprint<SimpleFusion::LessConstNode>();
+        case TAG_SUB_CONST: return footprint<SimpleFusion::SubConstNode>();
+        case TAG_LESS_ARG_CONST:
+            return footprint<LessArgConstNode>() + footprint<BetterFusion::ArgNode>() + footprint<BetterFusion::ConstNode>();
+        case TAG_SUB_ARG_CONST:
+            return footprint<SubArgConstNode>() + footprint<BetterFusion::ArgNode>() + footprint<BetterFusion::ConstNode>();
+        case TAG_IF_ELSE: return footprint<IfElseNode>();
+        case TAG_CALL: return footprint<CallAnyNode>();
+        }
+        return 0;
+    }
+
+    // Builds ordinary nodes for a verified image in module and returns the
+    // entry function. Every node goes in one block, in record order: a pass
+    // sizes the block, one places each record in it, and one constructs the
+    // nodes, by which time every child's address is known.
+    Node* relink(const Program& program, Module* module) {
+        const uint32_t* words = program.words;
+        uint32_t numWords = program.numWords;
+        Node** nodes = module->array<Node*>(numWords);
+        size_t size = 0;
+
+        for (uint32_t i = 0; i < numWords; i += 1 + numFields[words[i]]) {
+            size += footprint(words[i]);
+        }
+
+        char* block = (char*) module->arena.allocate(size, alignof(Node*));
+        char* cursor = block;
+
+        for (uint32_t i = 0; i < numWords; i += 1 + numFields[words[i]]) {
+            nodes[i] = (Node*) cursor;
+            cursor += footprint(words[i]);
+        }
+
+        for (uint32_t i = 0; i < numWords; i += 1 + numFields[words[i]]) {
+            const uint32_t* record = words + i;
+            void* at = nodes[i];
+            auto linked = [&](uint32_t field) { return nodes[child(record, field) - words]; };
+
+            switch (record[0]) {
+            case TAG_CONST:
+                new (at) BetterFusion::ConstNode(record[1]);
+                break;
+            case TAG_ARG:
+                new (at) BetterFusion::ArgNode();
+                break;
+            case TAG_ADD:
+                new (at) AddNode(linked(1), linked(2));
+                break;
+            case TAG_SUB:
+                new (at) SubNode(linked(1), linked(2));
+                break;
+            case TAG_LESS:
+                new (at) LessNode(linked(1), linked(2));
+                break;
+            case TAG_LESS_CONST:
+                new (at) SimpleFusion::LessConstNode(linked(1), record[2]);
+                break;
+            case TAG_SUB_CONST:
+                new (at) SimpleFusion::SubConstNode(linked(1), record[2]);
+                break;
+            case TAG_LESS_ARG_CONST:
+            case TAG_SUB_ARG_CONST: {
+                char* operands = (char*) at + (record[0] == TAG_LESS_ARG_CONST ?
+                    footprint<LessArgConstNode>() : footprint<SubArgConstNode>());
+                BetterFusion::ArgNode* arg = new (operands) BetterFusion::ArgNode();
+                BetterFusion::ConstNode* constant = new (operands + footprint<BetterFusion::ArgNode>())
+                    BetterFusion::ConstNode(record[1]);
+
+                if (record[0] == TAG_LESS_ARG_CONST) {
+                    new (at) LessArgConstNode(arg, constant);
+                }
+                else {
+                    new (at) SubArgConstNode(arg, constant);
+                }
+                break;
+            }
+            case TAG_IF_ELSE:
+                new (at) IfElseNode(linked(1), linked(2), linked(3));
+                break;
+            case TAG_CALL:
+                new (at) CallAnyNode(linked(1), linked(2));
+                break;
+            }
+        }
+
+        return nodes[program.entry];
+    }
+
+    // Saves SimplifyCalls::fib's tree, maps it back and runs it in place and
+    // relinked. Both must agree.
+    uint32_t fib(uint32_t n) {
+        using BetterFusion::ConstNode;
+
+        Context ctx;
+
+        Module module;
+
+        IfElseNode* function = buildFib(&module);
+
+        Writer writer;
+        FILE* file = tmpfile();
+
+        if (!file || !writer.write(function) || !writer.save(file)) {
+            return 0;
+        }
+
+        Program program;
+        bool loaded = program.load(file) && program.verify();
+
+        fclose(file);
+
+        if (!loaded) {
+            return 0;
+        }
+
+        uint32_t direct = program.run(n, &ctx);
+
+        Module relinked;
+        CallAnyNode* call = relinked.make<CallAnyNode>(relink(program, &relinked), relinked.make<ConstNode>(n));
+
+        if (call->eval(&ctx) != direct) {
+            return 0;
+        }
+        return direct;
+    }
+}
+
+// SimplifyCalls trees without virtual dispatch: every node of a program sits
+// in one array as a one-byte tag and two 32-bit operands, which are child
+// indices or inline constants. An IfElse's else branch has no operand of its
+// own and is always the node right after it. Nodes take 12 bytes instead of
+// a vtable pointer plus 8 per child, and are evaluated either by a switch on
+// the tag or through a table of functions indexed by it.
+namespace Tagged {
+    using Simplest::Context;
+
+    enum Tag : uint8_t {
+        TAG_CONST,
+        TAG_ARG,
+        TAG_ADD,
+        TAG_SUB,
+        TAG_LESS,
+        TAG_LESS_CONST,
+        TAG_SUB_CONST,
+        TAG_LESS_ARG_CONST,
+        TAG_SUB_ARG_CONST,
+        TAG_IF_ELSE,
+        TAG_CALL,
+        // Stands in for a node that's already elsewhere in the array, for
+        // an else branch that can't be placed after its IfElse
+        TAG_ALIAS,
+        NUM_TAGS
+    };
+
+    // Operands by tag: CONST value; ADD, SUB and LESS lhs and rhs; LESS_CONST
+    // and SUB_CONST lhs and constant; the ARG_CONST forms the constant;
+    // IF_ELSE condition and if branch; CALL the callee's root and argument;
+    // ALIAS the node it stands for.
+    struct Node {
+        uint8_t tag;
+        uint32_t a;
+        uint32_t b;
+    };
+
+    static_assert(sizeof(Node) == 12, "nodes are a tag and two operands");
+
+    struct Program {
+        std::vector<Node> nodes;
+        uint32_t entry;
+
+        Program() : entry(0) {}
+    };
+
+    // Lays out a tree and everything it calls. Nodes are added before their
+    // children, so a call can find a callee that's still being translated;
+    // operands are set once the children are in, since adding them can move
+    // the array.
+    struct Translator {
+        Program* program;
+        std::unordered_map<Simplest::Node*, uint32_t> translated;
+
+        Translator(Program* program) : program(program) {}
+
+        uint32_t add(Simplest::Node* source, Tag tag, uint32_t a = 0, uint32_t b = 0) {
+            program->nodes.push_back({ tag, a, b });
+            translated[source] = (uint32_t) program->nodes.size() - 1;
+            return (uint32_t) program->nodes.size() - 1;
+        }
+
+        bool binary(Simplest::Node* source, Tag tag, Simplest::Node* lhs, Simplest::Node* rhs, uint32_t* index) {
+            uint32_t a, b;
+
+            *index = add(source, tag);
+            if (!translate(lhs, &a) || !translate(rhs, &b)) {
+                return false;
+            }
+            program->nodes[*index].a = a;
+            program->nodes[*index].b = b;
+            return true;
+        }
+
+        bool withConst(Simplest::Node* source, Tag tag, Simplest::Node* lhs, uint32_t constant, uint32_t* index) {
+            uint32_t a;
+
+            *index = add(source, tag, 0, constant);
+            if (!translate(lhs, &a)) {
+                return false;
+            }
+            program->nodes[*index].a = a;
+            return true;
+        }
+
+        bool translate(Simplest::Node* node, uint32_t* index) {
+            std::unordered_map<Simplest::Node*, uint32_t>::const_iterator found = translated.find(node);
+            if (found != translated.end()) {
+                *index = found->second;
+                return true;
+            }
+
+            if (Simplest::ConstNode* constant = dynamic_cast<Simplest::ConstNode*>(node)) {
+                *index = add(node, TAG_CONST, constant->value);
+                return true;
+            }
+            if (BetterFusion::ConstNode* constant = dynamic_cast<BetterFusion::ConstNode*>(node)) {
+                *index = add(node, TAG_CONST, constant->value);
+                return true;
+            }
+            if (dynamic_cast<Simplest::ArgNode*>(node) || dynamic_cast<BetterFusion::ArgNode*>(node)) {
+                *index = add(node, TAG_ARG);
+                return true;
+            }
+            if (Simplest::AddNode* add = dynamic_cast<Simplest::AddNode*>(node)) {
+                return binary(node, TAG_ADD, add->lhs, add->rhs, index);
+            }
+            if (Simplest::SubNode* sub = dynamic_cast<Simplest::SubNode*>(node)) {
+                return binary(node, TAG_SUB, sub->lhs, sub->rhs, index);
+            }
+            if (Simplest::LessNode* less = dynamic_cast<Simplest::LessNode*>(node)) {
+                return binary(node, TAG_LESS, less->lhs, less->rhs, index);
+            }
+            if (SimpleFusion::LessConstNode* less = dynamic_cast<SimpleFusion::LessConstNode*>(node)) {
+                return withConst(node, TAG_LESS_CONST, less->lhs, less->constant, index);
+            }
+            if (SimpleFusion::SubConstNode* sub = dynamic_cast<SimpleFusion::SubConstNode*>(node)) {
+                return withConst(node, TAG_SUB_CONST, sub->lhs, sub->constant, index);
+            }
+            if (BetterFusion::LessArgConstNode* less = dynamic_cast<BetterFusion::LessArgConstNode*>(node)) {
+                *index = add(node, TAG_LESS_ARG_CONST, less->rhs->value);
+                return true;
+            }
+            if (BetterFusion::SubArgConstNode* sub = dynamic_cast<BetterFusion::SubArgConstNode*>(node)) {
+                *index = add(node, TAG_SUB_ARG_CONST, sub->rhs->value);
+                return true;
+            }
+            if (SimplifyCalls::IfElseNode* ifElse = dynamic_cast<SimplifyCalls::IfElseNode*>(node)) {
+                uint32_t elseBody, a, b;
+
+                // The else branch goes first to land right after its IfElse,
+                // unless it was translated before
+                *index = add(node, TAG_IF_ELSE);
+                if (!translate(ifElse->elseBody, &elseBody)) {
+                    return false;
+                }
+                if (elseBody != *index + 1) {
+                    program->nodes.push_back({ TAG_ALIAS, elseBody, 0 });
+                }
+                if (!translate(ifElse->condition, &a) || !translate(ifElse->ifBody, &b)) {
+                    return false;
+                }
+                program->nodes[*index].a = a;
+                program->nodes[*index].b = b;
+                return true;
+            }
+            if (SimplifyCalls::CallAnyNode* call = dynamic_cast<SimplifyCalls::CallAnyNode*>(node)) {
+                return binary(node, TAG_CALL, call->function, call->arg, index);
+            }
+            return false;
+        }
+
+        bool translate(Simplest::Node* entry) {
+            return translate(entry, &program->entry);
+        }
+    };
+
+    uint32_t eval(const Node* nodes, uint32_t index, Context* ctx) {
+        const Node& node = nodes[index];
+
+        switch (node.tag) {
+        case TAG_CONST:
+            return node.a;
+        case TAG_ARG:
+            return ctx->stack[ctx->stackTop - 1];
+        case TAG_ADD:
+            return eval(nodes, node.a, ctx) + eval(nodes, node.b, ctx);
+        case TAG_SUB:
+            return eval(nodes, node.a, ctx) - eval(nodes, node.b, ctx);
+        case TAG_LESS:
+            return eval(nodes, node.a, ctx) < eval(nodes, node.b, ctx);
+        case TAG_LESS_CONST:
+            return eval(nodes, node.a, ctx) < node.b;
+        case TAG_SUB_CONST:
+            return eval(nodes, node.a, ctx) - node.b;
+        case TAG_LESS_ARG_CONST:
+            return ctx->stack[ctx->stackTop - 1] < node.a;
+        case TAG_SUB_ARG_CONST:
+            return ctx->stack[ctx->stackTop - 1] - node.a;
+        case TAG_IF_ELSE:
+            if (eval(nodes, node.a, ctx)) {
+                return eval(nodes, node.b, ctx);
+            }
+            else {
+                return eval(nodes, index + 1, ctx);
+            }
+        case TAG_CALL: {
+            if (ctx->tick()) {
+                return ctx->stopped();
+            }
+            ctx->push(eval(nodes, node.b, ctx));
+            uint32_t result = eval(nodes, node.a, ctx);
+            ctx->pop();
+            return result;
+        }
+        case TAG_ALIAS:
+            return eval(nodes, node.a, ctx);
+        }
+        return 0;
+    }
+
+    // The same evaluation split into one function per tag
+    typedef uint32_t (*Handler)(const Node* nodes, uint32_t index, Context* ctx);
+
+    extern const Handler handlers[NUM_TAGS];
+
+    uint32_t dispatch(const Node* nodes, uint32_t index, Context* ctx) {
+        return handlers[nodes[index].tag](nodes, index, ctx);
+    }
+
+    uint32_t evalConst(const Node* nodes, uint32_t index, Context* ctx) {
+        return nodes[index].a;
+    }
+
+    uint32_t evalArg(const Node* nodes, uint32_t index, Context* ctx) {
+        return ctx->stack[ctx->stackTop - 1];
+    }
+
+    uint32_t evalAdd(const Node* nodes, uint32_t index, Context* ctx) {
+        return dispatch(nodes, nodes[index].a, ctx) + dispatch(nodes, nodes[index].b, ctx);
+    }
+
+    uint32_t evalSub(const Node* nodes, uint32_t index, Context* ctx) {
+        return dispatch(nodes, nodes[index].a, ctx) - dispatch(nodes, nodes[index].b, ctx);
+    }
+
+    uint32_t evalLess(const Node* nodes, uint32_t index, Context* ctx) {
+        return dispatch(nodes, nodes[index].a, ctx) < dispatch(nodes, nodes[index].b, ctx);
+    }
+
+    uint32_t evalLessConst(const Node* nodes, uint32_t index, Context* ctx) {
+        return dispatch(nodes, nodes[index].a, ctx) < nodes[index].b;
+    }
+
+    uint32_t evalSubConst(const Node* nodes, uint32_t index, Context* ctx) {
+        return dispatch(nodes, nodes[index].a, ctx) - nodes[index].b;
+    }
+
+    uint32_t evalLessArgConst(const Node* nodes, uint32_t index, Context* ctx) {
+        return ctx->stack[ctx->stackTop - 1] < nodes[index].a;
+    }
+
+    uint32_t evalSubArgConst(const Node* nodes, uint32_t index, Context* ctx) {
+        return ctx->stack[ctx->stackTop - 1] - nodes[index].a;
+    }
+
+    uint32_t evalIfElse(const Node* nodes, uint32_t index, Context* ctx) {
+        if (dispatch(nodes, nodes[index].a, ctx)) {
+            return dispatch(nodes, nodes[index].b, ctx);
+        }
+        else {
+            return dispatch(nodes, index + 1, ctx);
+        }
+    }
+
+    uint32_t evalCall(const Node* nodes, uint32_t index, Context* ctx) {
+        if (ctx->tick()) {
+            return ctx->stopped();
+        }
+        ctx->push(dispatch(nodes, nodes[index].b, ctx));
+        uint32_t result = dispatch(nodes, nodes[index].a, ctx);
+        ctx->pop();
+        return result;
+    }
+
+    uint32_t evalAlias(const Node* nodes, uint32_t index, Context* ctx) {
+        return dispatch(nodes, nodes[index].a, ctx);
+    }
+
+    // In Tag order
+    const Handler handlers[NUM_TAGS] = {
+        evalConst, evalArg, evalAdd, evalSub, evalLess, evalLessConst, evalSubConst,
+        evalLessArgConst, evalSubArgConst, evalIfElse, evalCall, evalAlias,
+    };
+
+    // A call to the entry function
+    template<uint32_t (*Eval)(const Node*, uint32_t, Context*)>
+    uint32_t run(const Program& program, uint32_t arg, Context* ctx) {
+        ctx->push(arg);
+        uint32_t result = Eval(program.nodes.data(), program.entry, ctx);
+        ctx->pop();
+        return result;
+    }
+
+    template<uint32_t (*Eval)(const Node*, uint32_t, Context*)>
+    uint32_t fib(uint32_t n) {
+        Context ctx;
+
+        // Same tree as SimplifyCalls::fib, translated
+        Simplest::Module module;
+
+        SimplifyCalls::IfElseNode* function = SimplifyCalls::buildFib(&module);
+
+        Program program;
+        Translator translator(&program);
+
+        if (!translator.translate(function)) {
+            return 0;
+        }
+
+        return run<Eval>(program, n, &ctx);
+    }
+
+    uint32_t fib(uint32_t n) {
+        return fib<eval>(n);
+    }
+
+    uint32_t tableFib(uint32_t n) {
+        return fib<dispatch>(n);
+    }
+}
+
+// Trees over 64-bit integers and doubles instead of uint32_t. A Value is a
+// type tag and a payload; mixing an integer with a double gives a double,
+// and integers wrap at 64 bits. Generic nodes check types as they go. Each
+// function also gets a version for integer arguments, specialized where
+// every operand is known to be an integer, so integer-only code like fib
+// runs on plain int64_t with no checks. The uint32_t strategies don't
+// change at all.
+namespace Values {
+    using Simplest::Module;
+
+    enum Type : uint32_t {
+        TYPE_INT,
+        TYPE_DOUBLE,
+        // Not known before running
+        TYPE_ANY
+    };
+
+    struct Value {
+        Type type;
+        union {
+            int64_t i;
+            double d;
+        };
+
+        static Value integer(int64_t i) {
+            Value value;
+            value.type = TYPE_INT;
+            value.i = i;
+            return value;
+        }
+
+        static Value real(double d) {
+            Value value;
+            value.type = TYPE_DOUBLE;
+            value.d = d;
+            return value;
+        }
+
+        double toDouble() const {
+            return type == TYPE_INT ? (double) i : d;
+        }
+
+        bool isTrue() const {
+            return type == TYPE_INT ? i != 0 : d != 0;
+        }
+    };
+
+    struct Context {
+        std::vector<Value> stack;
+        uint32_t stackTop;
+
+        Context(uint32_t stackSize = 4096) : stack(stackSize), stackTop(0) {}
+
+        void push(Value value) {
+            if (stackTop >= stack.size()) {
+                StackMemory::reportOverflow();
+            }
+            stack[stackTop] = value;
+            stackTop += 1;
+        }
+
+        void pop() {
+            stackTop -= 1;
+        }
+
+        const Value& arg() const {
+            return stack[stackTop - 1];
+        }
+    };
+
+    // evalInt() is only called on nodes known to produce an integer
+    struct Node {
+        virtual Value eval(Context* ctx) = 0;
+
+        virtual int64_t evalInt(Context* ctx) {
+            return eval(ctx).i;
+        }
+    };
+
+    // Integers wrap instead of overflowing
+    struct OpAdd {
+        static Type type(Type lhs, Type rhs) { return lhs == TYPE_ANY || rhs == TYPE_ANY ? TYPE_ANY : lhs == rhs ? lhs : TYPE_DOUBLE; }
+        static int64_t FORCEINLINE applyInt(int64_t lhs, int64_t rhs) { return (int64_t) ((uint64_t) lhs + (uint64_t) rhs); }
+        static double applyDouble(double lhs, double rhs) { return lhs + rhs; }
+    };
+
+    struct OpSub {
+        static Type type(Type lhs, Type rhs) { return OpAdd::type(lhs, rhs); }
+        static int64_t FORCEINLINE applyInt(int64_t lhs, int64_t rhs) { return (int64_t) ((uint64_t) lhs - (uint64_t) rhs); }
+        static double applyDouble(double lhs, double rhs) { return lhs - rhs; }
+    };
+
+    // Comparisons give an integer whatever they compare
+    struct OpLess {
+        static Type type(Type lhs, Type rhs) { return TYPE_INT; }
+        static int64_t FORCEINLINE applyInt(int64_t lhs, int64_t rhs) { return lhs < rhs; }
+        static int64_t applyDouble(double lhs, double rhs) { return lhs < rhs; }
+    };
+
+    template<typename Op>
+    Value apply(const Value& lhs, const Value& rhs) {
+        if (lhs.type == TYPE_INT && rhs.type == TYPE_INT) {
+            return Value::integer(Op::applyInt(lhs.i, rhs.i));
+        }
+        if (Op::type(TYPE_DOUBLE, TYPE_DOUBLE) == TYPE_INT) {
+            return Value::integer((int64_t) Op::applyDouble(lhs.toDouble(), rhs.toDouble()));
+        }
+        return Value::real((double) Op::applyDouble(lhs.toDouble(), rhs.toDouble()));
+    }
+
+    // A function's generic body, and one for integer arguments if every call
+    // of it with an integer returns one
+    struct Function {
+        Node* body;
+        Node* intBody;
+
+        Function() : body(0), intBody(0) {}
+    };
+
+    struct ConstNode : Node {
+        Value value;
+
+        ConstNode(Value value) : value(value) {}
+
+        Value eval(Context* ctx) override {
+            return value;
+        }
+    };
+
+    struct ArgNode : Node {
+        Value eval(Context* ctx) override {
+            return ctx->arg();
+        }
+    };
+
+    template<typename Op>
+    struct BinaryNode : Node {
+        Node* lhs;
+        Node* rhs;
+
+        BinaryNode(Node* lhs, Node* rhs) : lhs(lhs), rhs(rhs) {}
+
+        Value eval(Context* ctx) override {
+            Value l = lhs->eval(ctx);
+            return apply<Op>(l, rhs->eval(ctx));
+        }
+    };
+
+    struct IfElseNode : Node {
+        Node* condition;
+        Node* ifBody;
+        Node* elseBody;
+
+        IfElseNode(Node* condition, Node* ifBody, Node* elseBody)
+            : condition(condition), ifBody(ifBody), elseBody(elseBody) {}
+
+        Value eval(Context* ctx) override {
+            if (condition->eval(ctx).isTrue()) {
+                return ifBody->eval(ctx);
+            }
+            else {
+                return elseBody->eval(ctx);
+            }
+        }
+    };
+
+    // Takes the integer version of the callee for an integer argument
+    struct CallNode : Node {
+        Function* function;
+        Node* arg;
+
+        CallNode(Function* function, Node* arg) : function(function), arg(arg) {}
+
+        Value eval(Context* ctx) override {
+            Value value = arg->eval(ctx);
+            Value result;
+
+            ctx->push(value);
+            if (value.type == TYPE_INT && function->intBody) {
+                result = Value::integer(function->intBody->evalInt(ctx));
+            }
+            else {
+                result = function->body->eval(ctx);
+            }
+            ctx->pop();
+
+            return result;
+        }
+    };
+
+    // Integer nodes, all of whose operands are known to be integers too.
+    // eval() boxes their result for generic parents.
+    struct IntNode : Node {
+        Value eval(Context* ctx) override {
+            return Value::integer(evalInt(ctx));
+        }
+    };
+
+    struct IntConstNode : IntNode {
+        int64_t value;
+
+        IntConstNode(int64_t value) : value(value) {}
+
+        int64_t evalInt(Context* ctx) override {
+            return value;
+        }
+    };
+
+    struct IntArgNode : IntNode {
+        int64_t evalInt(Context* ctx) override {
+            return ctx->arg().i;
+        }
+    };
+
+    template<typename Op>
+    struct IntBinaryNode : IntNode {
+        Node* lhs;
+        Node* rhs;
+
+        IntBinaryNode(Node* lhs, Node* rhs) : lhs(lhs), rhs(rhs) {}
+
+        int64_t evalInt(Context* ctx) override {
+            int64_t l = lhs->evalInt(ctx);
+            return Op::applyInt(l, rhs->evalInt(ctx));
+        }
+    };
+
+    // Op(Arg, Const), fused as in BetterFusion
+    template<typename Op>
+    struct IntArgConstNode : IntNode {
+        int64_t constant;
+
+        IntArgConstNode(int64_t constant) : constant(constant) {}
+
+        int64_t evalInt(Context* ctx) override {
+            return Op::applyInt(ctx->arg().i, constant);
+        }
+    };
+
+    struct IntIfElseNode : IntNode {
+        Node* condition;
+        Node* ifBody;
+        Node* elseBody;
+
+        IntIfElseNode(Node* condition, Node* ifBody, Node* elseBody)
+            : condition(condition), ifBody(ifBody), elseBody(elseBody) {}
+
+        int64_t evalInt(Context* ctx) override {
+            if (condition->evalInt(ctx)) {
+                return ifBody->evalInt(ctx);
+            }
+            else {
+                return elseBody->evalInt(ctx);
+            }
+        }
+    };
+
+    // A call with an integer argument to a function with an integer version
+    struct IntCallNode : IntNode {
+        Function* function;
+        Node* arg;
+
+        IntCallNode(Function* function, Node* arg) : function(function), arg(arg) {}
+
+        int64_t evalInt(Context* ctx) override {
+            ctx->push(Value::integer(arg->evalInt(ctx)));
+            int64_t result = function->intBody->evalInt(ctx);
+            ctx->pop();
+            return result;
+        }
+    };
+
+    // Builds generic trees from SimplifyCalls trees, with a Function for
+    // every tree that's called. uint32_t constants become integers.
+    struct Translator {
+        Module* module;
+        std::vector<std::pair<Simplest::Node*, Function*>> functions;
+
+        Translator(Module* module) : module(module) {}
+
+        Function* function(Simplest::Node* body) {
+            for (const std::pair<Simplest::Node*, Function*>& entry : functions) {
+                if (entry.first == body) {
+                    return entry.second;
+                }
+            }
+
+            Function* function = module->make<Function>();
+            functions.push_back(std::make_pair(body, function));
+            function->body = translate(body);
+            return function->body ? function : 0;
+        }
+
+        template<typename Op>
+        Node* binary(Simplest::Node* lhs, Simplest::Node* rhs) {
+            Node* l = translate(lhs);
+            Node* r = translate(rhs);
+            return l && r ? module->make<BinaryNode<Op>>(l, r) : 0;
+        }
+
+        Node* translate(Simplest::Node* node) {
+            if (Simplest::ConstNode* constant = dynamic_cast<Simplest::ConstNode*>(node)) {
+                return module->make<ConstNode>(Value::integer(constant->value));
+            }
+            if (BetterFusion::ConstNode* constant = dynamic_cast<BetterFusion::ConstNode*>(node)) {
+                return module->make<ConstNode>(Value::integer(constant->value));
+            }
+            if (dynamic_cast<Simplest::ArgNode*>(node) || dynamic_cast<BetterFusion::ArgNode*>(node)) {
+                return module->make<ArgNode>();
+            }
+            if (Simplest::AddNode* add = dynamic_cast<Simplest::AddNode*>(node)) {
+                return binary<OpAdd>(add->lhs, add->rhs);
+            }
+            if (Simplest::SubNode* sub = dynamic_cast<Simplest::SubNode*>(node)) {
+                return binary<OpSub>(sub->lhs, sub->rhs);
+            }
+            if (Simplest::LessNode* less = dynamic_cast<Simplest::LessNode*>(node)) {
+                return binary<OpLess>(less->lhs, less->rhs);
+            }
+            if (BetterFusion::SubArgConstNode* sub = dynamic_cast<BetterFusion::SubArgConstNode*>(node)) {
+                return binary<OpSub>(sub->lhs, sub->rhs);
+            }
+            if (BetterFusion::LessArgConstNode* less = dynamic_cast<BetterFusion::LessArgConstNode*>(node)) {
+                return binary<OpLess>(less->lhs, less->rhs);
+            }
+            if (SimplifyCalls::IfElseNode* ifElse = dynamic_cast<SimplifyCalls::IfElseNode*>(node)) {
+                Node* condition = translate(ifElse->condition);
+                Node* ifBody = translate(ifElse->ifBody);
+                Node* elseBody = translate(ifElse->elseBody);
+                return condition && ifBody && elseBody ? module->make<IfElseNode>(condition, ifBody, elseBody) : 0;
+            }
+            if (SimplifyCalls::CallAnyNode* call = dynamic_cast<SimplifyCalls::CallAnyNode*>(node)) {
+                Function* callee = function(call->function);
+                Node* arg = translate(call->arg);
+                return callee && arg ? module->make<CallNode>(callee, arg) : 0;
+            }
+            return 0;
+        }
+    };
+
+    // Builds the integer version of functions by inferring types with the
+    // argument known to be an integer. Calls are assumed to return integers
+    // while their callee is being specialized; a function whose body turns
+    // out otherwise loses its integer version and the rest are redone, until
+    // every assumption holds.
+    struct Specializer {
+        Module* module;
+
+        Specializer(Module* module) : module(module) {}
+
+        template<typename Op>
+        Node* binary(BinaryNode<Op>* node, Type* type) {
+            Type lhsType, rhsType;
+            Node* lhs = specialize(node->lhs, &lhsType);
+            Node* rhs = specialize(node->rhs, &rhsType);
+
+            if (lhsType != TYPE_INT || rhsType != TYPE_INT) {
+                *type = Op::type(lhsType, rhsType);
+                return module->make<BinaryNode<Op>>(lhs, rhs);
+            }
+
+            *type = TYPE_INT;
+            if (dynamic_cast<IntArgNode*>(lhs) && dynamic_cast<IntConstNode*>(rhs)) {
+                return module->make<IntArgConstNode<Op>>(static_cast<IntConstNode*>(rhs)->value);
+            }
+            return module->make<IntBinaryNode<Op>>(lhs, rhs);
+        }
+
+        Node* specialize(Node* node, Type* type) {
+            if (ConstNode* constant = dynamic_cast<ConstNode*>(node)) {
+                *type = constant->value.type;
+                return *type == TYPE_INT ? module->make<IntConstNode>(constant->value.i) : node;
+            }
+            if (dynamic_cast<ArgNode*>(node)) {
+                *type = TYPE_INT;
+                return module->make<IntArgNode>();
+            }
+            if (BinaryNode<OpAdd>* add = dynamic_cast<BinaryNode<OpAdd>*>(node)) {
+                return binary(add, type);
+            }
+            if (BinaryNode<OpSub>* sub = dynamic_cast<BinaryNode<OpSub>*>(node)) {
+                return binary(sub, type);
+            }
+            if (BinaryNode<OpLess>* less = dynamic_cast<BinaryNode<OpLess>*>(node)) {
+                return binary(less, type);
+            }
+            if (IfElseNode* ifElse = dynamic_cast<IfElseNode*>(node)) {
+                Type conditionType, ifType, elseType;
+                Node* condition = specialize(ifElse->condition, &conditionType);
+                Node* ifBody = specialize(ifElse->ifBody, &ifType);
+                Node* elseBody = specialize(ifElse->elseBody, &elseType);
+
+                *type = ifType == elseType ? ifType : TYPE_ANY;
+                if (conditionType == TYPE_INT && *type == TYPE_INT) {
+                    return module->make<IntIfElseNode>(condition, ifBody, elseBody);
+                }
+                return module->make<IfElseNode>(condition, ifBody, elseBody);
+            }
+            if (CallNode* call = dynamic_cast<CallNode*>(node)) {
+                Type argType;
+                Node* arg = specialize(call->arg, &argType);
+
+                if (argType == TYPE_INT && call->function->intBody) {
+                    *type = TYPE_INT;
+                    return module->make<IntCallNode>(call->function, arg);
+                }
+                *type = TYPE_ANY;
+                return module->make<CallNode>(call->function, arg);
+            }
+            *type = TYPE_ANY;
+            return node;
+        }
+
+        // Returns how many functions kept an integer version
+        uint32_t specialize(const std::vector<Function*>& functions) {
+            // Any non-null intBody marks a function as assumed integer
+            for (Function* function : functions) {
+                function->intBody = function->body;
+            }
+
+            for (bool changed = true; changed; ) {
+                changed = false;
+
+                for (Function* function : functions) {
+                    if (!function->intBody) {
+                        continue;
+                    }
+
+                    Type type;
+                    Node* intBody = specialize(function->body, &type);
+
+                    if (type == TYPE_INT) {
+                        function->intBody = intBody;
+                    }
+                    else {
+                        function->intBody = 0;
+                        changed = true;
+                    }
+                }
+            }
+
+            uint32_t numSpecialized = 0;
+
+            for (Function* function : functions) {
+                numSpecialized += function->intBody != 0;
+            }
+            return numSpecialized;
+        }
+    };
+
+    // SimplifyCalls::fib's tree over Values, called with arg
+    Value fib(Value arg) {
+        Context ctx;
+        Module module;
+
+        SimplifyCalls::IfElseNode* tree = SimplifyCalls::buildFib(&module);
+
+        Translator translator(&module);
+        Values::Function* function = translator.function(tree);
+
+        if (!function) {
+            return Value::integer(0);
+        }
+
+        std::vector<Values::Function*> functions;
+
+        for (const std::pair<Simplest::Node*, Values::Function*>& entry : translator.functions) {
+            functions.push_back(entry.second);
+        }
+        Specializer(&module).specialize(functions);
+
+        return module.make<Values::CallNode>(function, module.make<Values::ConstNode>(arg))->eval(&ctx);
+    }
+
+    // Past fib(47), where uint32_t overflows
+    int64_t fib(int64_t n) {
+        return fib(Value::integer(n)).i;
+    }
+
+    uint32_t fib(uint32_t n) {
+        return (uint32_t) fib((int64_t) n);
+    }
+
+    // The generic path: no integer versions are taken
+    double doubleFib(double n) {
+        return fib(Value::real(n)).toDouble();
+    }
+}
+
+namespace Profiler {
+    using namespace SimplifyCalls;
+
+    // Wraps a node to count its evaluations. Only instrumented trees pay for
+    // it, so the interpreters themselves carry no profiling code.
+    struct CountingNode : Node {
+        Node* node;
+        uint64_t hits;
+
+        CountingNode(Node* node) : node(node), hits(0) {}
+
+        uint32_t eval(Context* ctx) override {
+            hits += 1;
+            return node->eval(ctx);
+        }
+    };
+
+    struct Profile {
+        std::vector<CountingNode*> counters;
+        std::vector<const Simplest::Function*> functions;
+        // Call targets of CallAnyNodes, shared by every call site
+        std::vector<std::pair<Node*, CountingNode*>> targets;
+    };
+
+    CountingNode* wrap(Module* module, Profile* profile, Node* node) {
+        CountingNode* counter = module->make<CountingNode>(node);
+        profile->counters.push_back(counter);
+        return counter;
+    }
+
+    void instrumentChildren(Module* module, Profile* profile, Node* node);
+
+    Node* instrument(Module* module, Profile* profile, Node* node) {
+        CountingNode* counter = wrap(module, profile, node);
+        instrumentChildren(module, profile, node);
+        return counter;
+    }
+
+    void instrumentFunction(Module* module, Profile* profile, Simplest::Function* function) {
+        for (const Simplest::Function* seen : profile->functions) {
+            if (seen == function) {
+                return;
+            }
+        }
+        profile->functions.push_back(function);
+
+        for (uint32_t i = 0; i < function->numNodes; i++) {
+            function->body[i] = instrument(module, profile, function->body[i]);
+        }
+    }
+
+    Node* instrumentTarget(Module* module, Profile* profile, Node* target) {
+        for (const std::pair<Node*, CountingNode*>& seen : profile->targets) {
+            if (seen.first == target || seen.second == target) {
+                return seen.second;
+            }
+        }
+
+        CountingNode* counter = wrap(module, profile, target);
+        profile->targets.push_back(std::make_pair(target, counter));
+        instrumentChildren(module, profile, target);
+        return counter;
+    }
+
+    void instrumentChildren(Module* module, Profile* profile, Node* node) {
+        Node** slots[3];
+
+        for (uint32_t i = 0, end_i = Trees::childSlots(node, slots); i < end_i; i++) {
+            *slots[i] = instrument(module, profile, *slots[i]);
+        }
+
+        if (Simplest::CallNode* call = dynamic_cast<Simplest::CallNode*>(node)) {
+            instrumentFunction(module, profile, call->function);
+        }
+        else if (CallAnyNode* call = dynamic_cast<CallAnyNode*>(node)) {
+            call->function = instrumentTarget(module, profile, call->function);
+        }
+    }
+
+    // Pattern text such as "SubNode(ArgNode, _)", with `args` naming the
+    // children that are part of the pattern and 0 for the ones that aren't.
+    std::string shape(const char* name, const std::string* args, uint32_t numArgs) {
+        std::string text = name;
+
+        if (numArgs > 0) {
+            text += "(";
+            for (uint32_t i = 0; i < numArgs; i++) {
+                text += i > 0 ? ", " : "";
+                text += args[i].empty() ? "_" : args[i];
+            }
+            text += ")";
+        }
+
+        return text;
+    }
+
+    // The instrumented children of a node, unwrapped, with their hit counts.
+    uint32_t children(Node* node, Node* children[3], uint64_t hits[3]) {
+        Node** slots[3];
+        uint32_t numChildren = Trees::childSlots(node, slots);
+
+        for (uint32_t i = 0; i < numChildren; i++) {
+            CountingNode* child = dynamic_cast<CountingNode*>(*slots[i]);
+            children[i] = child ? child->node : *slots[i];
+            hits[i] = child ? child->hits : 0;
+        }
+
+        return numChildren;
+    }
+
+    typedef std::vector<std::pair<std::string, uint64_t>> Ranking;
+
+    void count(Ranking* ranking, const std::string& pattern, uint64_t hits) {
+        for (std::pair<std::string, uint64_t>& entry : *ranking) {
+            if (entry.first == pattern) {
+                entry.second += hits;
+                return;
+            }
+        }
+        ranking->push_back(std::make_pair(pattern, hits));
+    }
+
+    // A pattern is weighted by its least-evaluated node, which is how often
+    // the whole shape ran and so how often a fused node would replace it.
+    void rank(const Profile& profile, Ranking* nodes, Ranking* pairs, Ranking* triples) {
+        for (CountingNode* counter : profile.counters) {
+            Node* kids[3];
+            uint64_t kidHits[3];
+            uint32_t numKids = children(counter->node, kids, kidHits);
+            const char* name = Trees::nodeName(counter->node);
+
+            count(nodes, name, counter->hits);
+
+            for (uint32_t i = 0; i < numKids; i++) {
+                std::string args[3];
+                args[i] = Trees::nodeName(kids[i]);
+                count(pairs, shape(name, args, numKids), std::min(counter->hits, kidHits[i]));
+
+                // Parent with two of its children
+                for (uint32_t j = i + 1; j < numKids; j++) {
+                    args[j] = Trees::nodeName(kids[j]);
+                    count(triples, shape(name, args, numKids),
+                        std::min(counter->hits, std::min(kidHits[i], kidHits[j])));
+                    args[j].clear();
+                }
+
+                // Parent, child and grandchild
+                Node* grandKids[3];
+                uint64_t grandKidHits[3];
+                uint32_t numGrandKids = children(kids[i], grandKids, grandKidHits);
+
+                for (uint32_t j = 0; j < numGrandKids; j++) {
+                    std::string grandArgs[3];
+                    grandArgs[j] = Trees::nodeName(grandKids[j]);
+                    args[i] = shape(Trees::nodeName(kids[i]), grandArgs, numGrandKids);
+                    count(triples, shape(name, args, numKids),
+                        std::min(counter->hits, std::min(kidHits[i], grandKidHits[j])));
+                }
+            }
+        }
+    }
+
+    void printRanking(FILE* out, const char* title, Ranking* ranking, uint32_t limit) {
+        std::sort(ranking->begin(), ranking->end(),
+            [](const std::pair<std::string, uint64_t>& a, const std::pair<std::string, uint64_t>& b) {
+                return a.second > b.second;
+            });
+
+        fprintf(out, "%s\n", title);
+
+        for (uint32_t i = 0; i < ranking->size() && i < limit; i++) {
+            fprintf(out, "  %14llu  %s\n", (unsigned long long) (*ranking)[i].second, (*ranking)[i].first.c_str());
+        }
+    }
+
+    void report(FILE* out, const Profile& profile, uint32_t limit = 10) {
+        Ranking nodes, pairs, triples;
+
+        rank(profile, &nodes, &pairs, &triples);
+
+        printRanking(out, "hottest nodes:", &nodes, limit);
+        printRanking(out, "hottest pairs:", &pairs, limit);
+        printRanking(out, "hottest triples:", &triples, limit);
+    }
+
+    uint32_t fib(uint32_t n) {
+        using Simplest::ArgNode;
+        using Simplest::CallNode;
+        using Simplest::ConstNode;
+        using Simplest::Function;
+
+        Context ctx;
+        Module module;
+
+        Function* function = module.make<Function>();
+
+        // Same tree as Simplest::fib, profiled before any fusion
+        function->init(&module, {
+            module.make<IfNode>(
+                module.make<LessNode>(module.make<ArgNode>(), module.make<ConstNode>(2)),
+                module.make<ReturnNode>(module.make<ArgNode>())),
+            module.make<ReturnNode>(
+                module.make<AddNode>(
+                    module.make<CallNode>(function,
+                        module.make<SubNode>(module.make<ArgNode>(), module.make<ConstNode>(1))),
+                    module.make<CallNode>(function,
+                        module.make<SubNode>(module.make<ArgNode>(), module.make<ConstNode>(2)))))
+        });
+
+        Profile profile;
+        Node* call = instrument(&module, &profile, module.make<CallNode>(function, module.make<ConstNode>(n)));
+
+        uint32_t result = call->eval(&ctx);
+
+        report(stdout, profile);
+
+        return result;
+    }
+}
+
+// Functions with any number of arguments and locals. A function with one
+// argument and no locals is called just as CallAnyNode calls, with its
+// argument on top of the stack for ArgNode; every other function gets a
+// frame, which costs a saved and restored frame index per call. fib takes
+// the first path, and reaching the body through the Function still leaves it
+// about 7% behind simplify_calls.
+namespace Frames {
+    using namespace SimplifyCalls;
+    using BetterFusion::ConstNode;
+
+    // Arguments are stored in reverse just below ctx->frame, and locals start
+    // at it, so argument i is at frame - 1 - i and local i at frame + i. Slot
+    // addresses then don't depend on the arity. A one-argument function
+    // without locals has no frame of its own and reads its argument with
+    // ArgNode, never ArgN<0>.
+    struct Function {
+        Node* body;
+        uint32_t numArgs;
+        uint32_t numLocals;
+
+        Function(uint32_t numArgs, uint32_t numLocals)
+            : body(0), numArgs(numArgs), numLocals(numLocals) {}
+    };
+
+    template<uint32_t index>
+    struct ArgN : Node {
+        uint32_t eval(Context* ctx) override {
+            return compute(ctx);
+        }
+
+        uint32_t FORCEINLINE compute(Context* ctx) {
+            return ctx->stack[ctx->frame - 1 - index];
+        }
+    };
+
+    template<uint32_t index>
+    struct LocalN : Node {
+        uint32_t eval(Context* ctx) override {
+            return compute(ctx);
+        }
+
+        uint32_t FORCEINLINE compute(Context* ctx) {
+            return ctx->stack[ctx->frame + index];
+        }
+    };
+
+    // Slot is an ArgN or LocalN
+    template<typename Slot>
+    struct LessSlotConstNode : Node {
+        Slot* lhs;
+        ConstNode* rhs;
+
+        LessSlotConstNode(Slot* lhs, ConstNode* rhs) : lhs(lhs), rhs(rhs) {}
+
+        uint32_t eval(Context* ctx) override {
+            return compute(ctx);
+        }
+
+        uint32_t FORCEINLINE compute(Context* ctx) {
+            return lhs->compute(ctx) < rhs->compute(ctx);
+        }
+    };
+
+    template<typename Slot>
+    struct SubSlotConstNode : Node {
+        Slot* lhs;
+        ConstNode* rhs;
+
+        SubSlotConstNode(Slot* lhs, ConstNode* rhs) : lhs(lhs), rhs(rhs) {}
+
+        uint32_t eval(Context* ctx) override {
+            return compute(ctx);
+        }
+
+        uint32_t FORCEINLINE compute(Context* ctx) {
+            return lhs->compute(ctx) - rhs->compute(ctx);
+        }
+    };
+
+    template<typename Lhs, typename Rhs>
+    struct AddSlotsNode : Node {
+        Lhs* lhs;
+        Rhs* rhs;
+
+        AddSlotsNode(Lhs* lhs, Rhs* rhs) : lhs(lhs), rhs(rhs) {}
+
+        uint32_t eval(Context* ctx) override {
+            return compute(ctx);
+        }
+
+        uint32_t FORCEINLINE compute(Context* ctx) {
+            return lhs->compute(ctx) + rhs->compute(ctx);
+        }
+    };
+
+    // The arity is a template parameter so the argument loop unrolls away.
+    // It must match function->numArgs.
+    template<uint32_t numArgs>
+    struct CallNode : Node {
+        Function* function;
+        // One slot even without arguments, since C++ has no empty arrays
+        Node* args[numArgs ? numArgs : 1];
+
+        template<typename... Args>
+        CallNode(Function* function, Args... args)
+            : function(function), args{ args... } {
+            static_assert(sizeof...(Args) == numArgs, "wrong number of arguments");
+        }
+
+        uint32_t eval(Context* ctx) override {
+            if (ctx->tick()) {
+                return ctx->stopped();
+            }
+
+            // CallAnyNode's path, with no frame to set up
+            if (numArgs == 1 && !function->numLocals) {
+                ctx->push(args[0]->eval(ctx));
+
+                uint32_t result = function->body->eval(ctx);
+                assert(!ctx->tailTarget);
+
+                ctx->pop();
+                return result;
+            }
+
+            return callWithFrame(ctx);
+        }
+
+        // Out of line, so the registers it needs aren't saved on the path above
+        NOINLINE uint32_t callWithFrame(Context* ctx) {
+            uint32_t base = ctx->reserve(numArgs);
+
+            // Nested calls in the arguments push above the reserved slots,
+            // and still see the caller's frame
+            for (uint32_t i = 0; i < numArgs; i++) {
+                ctx->stack[base + numArgs - 1 - i] = args[i]->eval(ctx);
+            }
+
+            uint32_t callerFrame = ctx->frame;
+            uint32_t numLocals = function->numLocals;
+            ctx->frame = ctx->reserve(numLocals);
+
+            for (uint32_t i = 0; i < numLocals; i++) {
+                ctx->stack[ctx->frame + i] = 0;
+            }
+
+            uint32_t result = function->body->eval(ctx);
+
+            // A callee that makes tail calls left one staged for a trampoline,
+            // see TailCalls: calls into it must be TrampolineCallNodes
+            assert(!ctx->tailTarget);
+
+            ctx->stackTop = base;
+            ctx->frame = callerFrame;
+
+            return result;
+        }
+    };
+
+    uint32_t fib(uint32_t n) {
+        using BetterFusion::ArgNode;
+
+        Context ctx;
+        Module module;
+
+        Function* function = module.make<Function>(1, 0);
+
+        function->body = module.make<IfElseNode>(
+            module.make<LessArgConstNode>(module.make<ArgNode>(), module.make<ConstNode>(2)),
+            module.make<ArgNode>(),
+            module.make<AddNode>(
+                module.make<CallNode<1>>(function,
+                    module.make<SubArgConstNode>(module.make<ArgNode>(), module.make<ConstNode>(1))),
+                module.make<CallNode<1>>(function,
+                    module.make<SubArgConstNode>(module.make<ArgNode>(), module.make<ConstNode>(2)))));
+
+        return module.make<CallNode<1>>(function, module.make<ConstNode>(n))->eval(&ctx);
+    }
+}
+
+namespace Statements {
+    using namespace SimplifyCalls;
+    using BetterFusion::ConstNode;
+    using Frames::CallNode;
+    using Frames::Function;
+
+    // What a statement hands back to its block: the returned value and
+    // whether control is returning at all. It's 8 bytes, so it comes back in
+    // a register instead of going through ctx->returnValue and a flag.
+    struct Completion {
+        uint32_t value;
+        uint32_t returning;
+    };
+
+    // Statements are Nodes, so one can be a Frames::Function body: its eval()
+    // is the value the function returns.
+    struct StatementNode : Node {
+        virtual Completion exec(Context* ctx) = 0;
+    };
+
+    // eval() calls the statement's own exec() directly rather than through the
+    // vtable a second time
+    template<typename Self>
+    struct Statement : StatementNode {
+        uint32_t eval(Context* ctx) override {
+            return static_cast<Self*>(this)->Self::exec(ctx).value;
+        }
+    };
+
+    struct ExprStatementNode : Statement<ExprStatementNode> {
+        Node* expr;
+
+        ExprStatementNode(Node* expr) : expr(expr) {}
+
+        Completion exec(Context* ctx) override {
+            expr->eval(ctx);
+            return { 0, 0 };
+        }
+    };
+
+    struct ReturnNode : Statement<ReturnNode> {
+        Node* rhs;
+
+        ReturnNode(Node* rhs) : rhs(rhs) {}
+
+        Completion exec(Context* ctx) override {
+            return { rhs->eval(ctx), 1 };
+        }
+    };
+
+    struct IfNode : Statement<IfNode> {
+        Node* condition;
+        StatementNode* body;
+
+        IfNode(Node* condition, StatementNode* body)
+            : condition(condition), body(body) {}
+
+        Completion exec(Context* ctx) override {
+            if (condition->eval(ctx)) {
+                return body->exec(ctx);
+            }
+            return { 0, 0 };
+        }
+    };
+
+    struct IfElseNode : Statement<IfElseNode> {
+        Node* condition;
+        StatementNode* ifBody;
+        StatementNode* elseBody;
+
+        IfElseNode(Node* condition, StatementNode* ifBody, StatementNode* elseBody)
+            : condition(condition), ifBody(ifBody), elseBody(elseBody) {}
+
+        Completion exec(Context* ctx) override {
+            if (condition->eval(ctx)) {
+                return ifBody->exec(ctx);
+            }
+            else {
+                return elseBody->exec(ctx);
+            }
+        }
+    };
+
+    // `if (condition) return value;` and the rest of the block, fused: a block
+    // loop calls every statement from one indirect call site, which mispredicts
+    // as soon as the statements differ, while here each site has one target
+    struct IfReturnNode : Statement<IfReturnNode> {
+        Node* condition;
+        Node* value;
+        StatementNode* rest;
+
+        IfReturnNode(Node* condition, Node* value, StatementNode* rest)
+            : condition(condition), value(value), rest(rest) {}
+
+        Completion exec(Context* ctx) override {
+            if (condition->eval(ctx)) {
+                return { value->eval(ctx), 1 };
+            }
+            return rest->exec(ctx);
+        }
+    };
+
+    // `if (condition) return value; return otherwise;`, a whole function body
+    // with both returns fused in. Through an IfReturnNode the second return
+    // would be one more virtual exec() per call than the expression bodies of
+    // SimplifyCalls make.
+    struct IfReturnElseNode : Statement<IfReturnElseNode> {
+        Node* condition;
+        Node* value;
+        Node* otherwise;
+
+        IfReturnElseNode(Node* condition, Node* value, Node* otherwise)
+            : condition(condition), value(value), otherwise(otherwise) {}
+
+        Completion exec(Context* ctx) override {
+            if (condition->eval(ctx)) {
+                return { value->eval(ctx), 1 };
+            }
+            return { otherwise->eval(ctx), 1 };
+        }
+    };
+
+    // Falling off the end of a block completes normally, so a function whose
+    // body does it returns 0
+    struct BlockNode : Statement<BlockNode> {
+        StatementNode** statements;
+        uint32_t numStatements;
+
+        BlockNode() : statements(0), numStatements(0) {}
+
+        void init(Module* module, std::initializer_list<StatementNode*> body) {
+            numStatements = (uint32_t) body.size();
+            statements = module->array<StatementNode*>(numStatements);
+
+            uint32_t i = 0;
+
+            for (StatementNode* statement : body) {
+                statements[i++] = statement;
+            }
+        }
+
+        Completion exec(Context* ctx) override {
+            for (uint32_t i = 0, end_i = numStatements; i < end_i; i++) {
+                Completion completion = statements[i]->exec(ctx);
+                if (completion.returning) {
+                    return completion;
+                }
+            }
+            return { 0, 0 };
+        }
+    };
+
+    uint32_t fib(uint32_t n) {
+        using BetterFusion::ArgNode;
+
+        Context ctx;
+        Module module;
+
+        Function* function = module.make<Function>(1, 0);
+
+        function->body = module.make<IfReturnElseNode>(
+            module.make<LessArgConstNode>(module.make<ArgNode>(), module.make<ConstNode>(2)),
+            module.make<ArgNode>(),
+            module.make<AddNode>(
+                module.make<CallNode<1>>(function,
+                    module.make<SubArgConstNode>(module.make<ArgNode>(), module.make<ConstNode>(1))),
+                module.make<CallNode<1>>(function,
+                    module.make<SubArgConstNode>(module.make<ArgNode>(), module.make<ConstNode>(2)))));
+
+        return module.make<CallNode<1>>(function, module.make<ConstNode>(n))->eval(&ctx);
+    }
+}
+
+// Loops and assignments for statement bodies, over Frames locals. The plain
+// nodes go through eval() for every operand; the fused ones take typed
+// operands (ArgN, LocalN, ConstNode or AddSlotsNode) and inline them, in the
+// style of BetterFusion.
+namespace Loops {
+    using namespace SimplifyCalls;
+    using BetterFusion::ConstNode;
+    using Frames::AddSlotsNode;
+    using Frames::ArgN;
+    using Frames::CallNode;
+    using Frames::Function;
+    using Frames::LocalN;
+    using Statements::BlockNode;
+    using Statements::Completion;
+    using Statements::ReturnNode;
+    using Statements::Statement;
+    using Statements::StatementNode;
+
+    struct WhileNode : Statement<WhileNode> {
+        Node* condition;
+        StatementNode* body;
+
+        WhileNode(Node* condition, StatementNode* body) : condition(condition), body(body) {}
+
+        Completion exec(Context* ctx) override {
+            while (condition->eval(ctx)) {
+                if (ctx->tick()) {
+                    return { 0, 1 };
+                }
+
+                Completion completion = body->exec(ctx);
+                if (completion.returning) {
+                    return completion;
+                }
+            }
+            return { 0, 0 };
+        }
+    };
+
+    struct AssignLocalNode : Statement<AssignLocalNode> {
+        uint32_t index;
+        Node* value;
+
+        AssignLocalNode(uint32_t index, Node* value) : index(index), value(value) {}
+
+        Completion exec(Context* ctx) override {
+            ctx->stack[ctx->frame + index] = value->eval(ctx);
+            return { 0, 0 };
+        }
+    };
+
+    struct IncrementLocalNode : Statement<IncrementLocalNode> {
+        uint32_t index;
+
+        IncrementLocalNode(uint32_t index) : index(index) {}
+
+        Completion exec(Context* ctx) override {
+            ctx->stack[ctx->frame + index] += 1;
+            return { 0, 0 };
+        }
+    };
+
+    // `local = value`, fused
+    template<uint32_t index, typename Value>
+    struct SetLocalNode : Statement<SetLocalNode<index, Value>> {
+        Value* value;
+
+        SetLocalNode(Value* value) : value(value) {}
+
+        Completion exec(Context* ctx) override {
+            ctx->stack[ctx->frame + index] = value->compute(ctx);
+            return { 0, 0 };
+        }
+    };
+
+    // `local += rhs`, fused
+    template<uint32_t index, typename Rhs>
+    struct AddToLocalNode : Statement<AddToLocalNode<index, Rhs>> {
+        Rhs* rhs;
+
+        AddToLocalNode(Rhs* rhs) : rhs(rhs) {}
+
+        Completion exec(Context* ctx) override {
+            ctx->stack[ctx->frame + index] += rhs->compute(ctx);
+            return { 0, 0 };
+        }
+    };
+
+    // What the fused loops have in common, so passes can reach their bodies
+    struct FusedLoopNode : StatementNode {
+        StatementNode* body;
+
+        FusedLoopNode(StatementNode* body) : body(body) {}
+    };
+
+    // `while (lhs < rhs)`, fused, e.g. "while local < const"
+    template<typename Lhs, typename Rhs>
+    struct WhileLessNode : FusedLoopNode {
+        Lhs* lhs;
+        Rhs* rhs;
+
+        WhileLessNode(Lhs* lhs, Rhs* rhs, StatementNode* body)
+            : FusedLoopNode(body), lhs(lhs), rhs(rhs) {}
+
+        Completion exec(Context* ctx) override {
+            while (lhs->compute(ctx) < rhs->compute(ctx)) {
+                if (ctx->tick()) {
+                    return { 0, 1 };
+                }
+
+                Completion completion = body->exec(ctx);
+                if (completion.returning) {
+                    return completion;
+                }
+            }
+            return { 0, 0 };
+        }
+
+        uint32_t eval(Context* ctx) override {
+            return WhileLessNode::exec(ctx).value;
+        }
+    };
+
+    // Iterative fib over locals a, b, i and t:
+    //
+    //     b = 1
+    //     while (i < n) { t = a + b; a = b; b = t; i++ }
+    //     return a
+    uint32_t fib(uint32_t n) {
+        Context ctx;
+        Module module;
+
+        Function* function = module.make<Function>(1, 4);
+        BlockNode* body = module.make<BlockNode>();
+        BlockNode* loop = module.make<BlockNode>();
+
+        loop->init(&module, {
+            module.make<AssignLocalNode>(3, module.make<AddNode>(module.make<LocalN<0>>(), module.make<LocalN<1>>())),
+            module.make<AssignLocalNode>(0, module.make<LocalN<1>>()),
+            module.make<AssignLocalNode>(1, module.make<LocalN<3>>()),
+            module.make<IncrementLocalNode>(2)
+        });
+        body->init(&module, {
+            module.make<AssignLocalNode>(1, module.make<ConstNode>(1)),
+            module.make<WhileNode>(module.make<LessNode>(module.make<LocalN<2>>(), module.make<ArgN<0>>()), loop),
+            module.make<ReturnNode>(module.make<LocalN<0>>())
+        });
+
+        function->body = body;
+
+        return module.make<CallNode<1>>(function, module.make<ConstNode>(n))->eval(&ctx);
+    }
+
+    // The same loop from fused nodes: nothing but the statements themselves
+    // is dispatched per iteration
+    uint32_t fusedFib(uint32_t n) {
+        Context ctx;
+        Module module;
+
+        Function* function = module.make<Function>(1, 4);
+        BlockNode* body = module.make<BlockNode>();
+        BlockNode* loop = module.make<BlockNode>();
+
+        loop->init(&module, {
+            module.make<SetLocalNode<3, AddSlotsNode<LocalN<0>, LocalN<1>>>>(
+                module.make<AddSlotsNode<LocalN<0>, LocalN<1>>>(module.make<LocalN<0>>(), module.make<LocalN<1>>())),
+            module.make<SetLocalNode<0, LocalN<1>>>(module.make<LocalN<1>>()),
+            module.make<SetLocalNode<1, LocalN<3>>>(module.make<LocalN<3>>()),
+            module.make<AddToLocalNode<2, ConstNode>>(module.make<ConstNode>(1))
+        });
+        body->init(&module, {
+            module.make<SetLocalNode<1, ConstNode>>(module.make<ConstNode>(1)),
+            module.make<WhileLessNode<LocalN<2>, ArgN<0>>>(module.make<LocalN<2>>(), module.make<ArgN<0>>(), loop),
+            module.make<ReturnNode>(module.make<LocalN<0>>())
+        });
+
+        function->body = body;
+
+        return module.make<CallNode<1>>(function, module.make<ConstNode>(n))->eval(&ctx);
+    }
+}
+
+// Calls by name through a table of global functions. Once everything is
+// defined, a pass binds each call site to its callee's concrete node type,
+// so the call to the body is direct instead of virtual. Each table entry has
+// a version, bumped on redefinition, which bound calls check to fall back
+// to the generic path.
+namespace InlineCaching {
+    using namespace SimplifyCalls;
+    using BetterFusion::ArgNode;
+    using BetterFusion::ConstNode;
+
+    struct Global {
+        const char* name;
+        Node* body;
+        uint32_t version;
+
+        Global(const char* name) : name(name), body(0), version(0) {}
+    };
+
+    struct Globals {
+        Module* module;
+        std::vector<Global*> functions;
+
+        Globals(Module* module) : module(module) {}
+
+        // Entries are created on first use, so calls can be built before the callee
+        Global* lookup(const char* name) {
+            for (Global* global : functions) {
+                if (strcmp(global->name, name) == 0) {
+                    return global;
+                }
+            }
+            functions.push_back(module->make<Global>(name));
+            return functions.back();
+        }
+
+        void define(const char* name, Node* body) {
+            Global* global = lookup(name);
+            global->body = body;
+            global->version++;
+        }
+    };
+
+    // Looks the callee up on every call
+    struct GlobalCallNode : Node {
+        Global* global;
+        Node* arg;
+
+        GlobalCallNode(Global* global, Node* arg) : global(global), arg(arg) {}
+
+        uint32_t eval(Context* ctx) override {
+            if (ctx->tick()) {
+                return ctx->stopped();
+            }
+
+            ctx->push(arg->eval(ctx));
+
+            uint32_t result = global->body->eval(ctx);
+
+            ctx->stopForReturn = false;
+            ctx->pop();
+
+            return result;
+        }
+    };
+
+    // Bound to a body of exactly type Body: while the entry has the version
+    // we bound to, this is a direct call the branch predictor never misses.
+    // For a self-recursive function like fib it is the whole recursive call.
+    template<typename Body>
+    struct DirectCallNode : Node {
+        Global* global;
+        Node* arg;
+        Body* target;
+        uint32_t version;
+
+        DirectCallNode(Global* global, Node* arg, Body* target)
+            : global(global), arg(arg), target(target), version(global->version) {}
+
+        uint32_t eval(Context* ctx) override {
+            if (ctx->tick()) {
+                return ctx->stopped();
+            }
+
+            ctx->push(arg->eval(ctx));
+
+            uint32_t result = global->version == version
+                ? target->Body::eval(ctx)
+                : global->body->eval(ctx);
+
+            ctx->stopForReturn = false;
+            ctx->pop();
+
+            return result;
+        }
+    };
+
+    // The exact type is checked, since a subclass may override eval()
+    template<typename Body>
+    Node* bindTo(Module* module, GlobalCallNode* call) {
+        if (typeid(*call->global->body) != typeid(Body)) {
+            return 0;
+        }
+        return module->make<DirectCallNode<Body>>(call->global, call->arg, static_cast<Body*>(call->global->body));
+    }
+
+    // Call sites whose callee isn't one of these stay generic
+    Node* bind(Module* module, GlobalCallNode* call) {
+        if (!call->global->body) {
+            return call;
+        }
+
+        Node* bound;
+
+        if ((bound = bindTo<IfElseNode>(module, call)) ||
+            (bound = bindTo<AddNode>(module, call)) ||
+            (bound = bindTo<SubNode>(module, call)) ||
+            (bound = bindTo<CallAnyNode>(module, call))) {
+            return bound;
+        }
+        return call;
+    }
+
+    Node* bindCalls(Module* module, Node* node) {
+        if (GlobalCallNode* call = dynamic_cast<GlobalCallNode*>(node)) {
+            call->arg = bindCalls(module, call->arg);
+            return bind(module, call);
+        }
+
+        Node** slots[3];
+
+        for (uint32_t i = 0, end_i = Trees::childSlots(node, slots); i < end_i; i++) {
+            *slots[i] = bindCalls(module, *slots[i]);
+        }
+        return node;
+    }
+
+    // Binds every call site once all functions are defined. A call's target
+    // is a body's root, and roots of the bound types are never replaced here,
+    // so the versions stay as they are.
+    void bindAll(Module* module, Globals* globals) {
+        for (Global* global : globals->functions) {
+            if (global->body) {
+                global->body = bindCalls(module, global->body);
+            }
+        }
+    }
+
+    uint32_t fib(uint32_t n) {
+        Context ctx;
+        Module module;
+        Globals globals(&module);
+
+        Global* global = globals.lookup("fib");
+
+        // Same tree as SimplifyCalls::fib, calling itself by name
+        globals.define("fib", module.make<IfElseNode>(
+            module.make<LessArgConstNode>(module.make<ArgNode>(), module.make<ConstNode>(2)),
+            module.make<ArgNode>(),
+            module.make<AddNode>(
+                module.make<GlobalCallNode>(global, module.make<SubArgConstNode>(module.make<ArgNode>(), module.make<ConstNode>(1))),
+                module.make<GlobalCallNode>(global, module.make<SubArgConstNode>(module.make<ArgNode>(), module.make<ConstNode>(2))))));
+
+        bindAll(&module, &globals);
+
+        return bind(&module, module.make<GlobalCallNode>(global, module.make<ConstNode>(n)))->eval(&ctx);
+    }
+}
+
+// Memoized calls for functions that are pure over their argument. Only call
+// sites of memoized functions are rewritten, to MemoCallNode, so every other
+// call keeps the plain CallNode path.
+namespace Memoization {
+    using namespace Simplest;
+
+    // Open addressing over a power-of-two capacity. A key is only looked for
+    // within `window` slots of its home; when they're all taken by other keys,
+    // the one at home is evicted, so the table never grows past its cap.
+    struct MemoTable {
+        struct Entry {
+            uint32_t key;
+            uint32_t value;
+            uint32_t used;
+        };
+
+        static const uint32_t window = 8;
+
+        Entry* entries;
+        uint32_t mask;
+        uint32_t shift;
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t evictions;
+
+        // `capacity` is rounded up to a power of two
+        MemoTable(Module* module, uint32_t capacity) : hits(0), misses(0), evictions(0) {
+            uint32_t bits = 3;
+            while ((1u << bits) < capacity && bits < 31) {
+                bits++;
+            }
+
+            mask = (1u << bits) - 1;
+            shift = 32 - bits;
+            entries = module->array<Entry>(mask + 1);
+            memset(entries, 0, sizeof(Entry) * (mask + 1));
+        }
+
+        uint32_t home(uint32_t key) {
+            return (key * 2654435761u) >> shift;
+        }
+
+        bool find(uint32_t key, uint32_t* value) {
+            for (uint32_t i = 0, slot = home(key); i < window; i++, slot = (slot + 1) & mask) {
+                if (!entries[slot].used) {
+                    break;
+                }
+                if (entries[slot].key == key) {
+                    hits++;
+                    *value = entries[slot].value;
+                    return true;
+                }
+            }
+            misses++;
+            return false;
+        }
+
+        void insert(uint32_t key, uint32_t value) {
+            uint32_t slot = home(key);
+
+            for (uint32_t i = 0; i < window; i++, slot = (slot + 1) & mask) {
+                if (!entries[slot].used || entries[slot].key == key) {
+                    entries[slot] = { key, value, 1 };
+                    return;
+                }
+            }
+
+            evictions++;
+            entries[home(key)] = { key, value, 1 };
+        }
+    };
+
+    struct MemoCallNode : Node {
+        Function* function;
+        Node* arg;
+        MemoTable* table;
+
+        MemoCallNode(Function* function, Node* arg, MemoTable* table)
+            : function(function), arg(arg), table(table) {}
+
+        uint32_t eval(Context* ctx) override {
+            if (ctx->tick()) {
+                return ctx->stopped();
+            }
+
+            uint32_t key = arg->eval(ctx);
+            uint32_t result;
+#if defined(TRACING)
+            Tracing::Scope scope(ctx->trace, this, function);
+#endif
+
+            if (table->find(key, &result)) {
+                return result;
+            }
+
+            // Falling off the end returns 0, as in bytecode, rather than
+            // whatever an earlier call left in returnValue: it gets cached
+            ctx->returnValue = 0;
+            ctx->push(key);
+
+            for (uint32_t i = 0, end_i = function->numNodes; i < end_i; i++) {
+                function->body[i]->eval(ctx);
+                if (ctx->stopForReturn) {
+                    break;
+                }
+            }
+
+            ctx->stopForReturn = false;
+            ctx->pop();
+
+            // A stopped call's result is meaningless, and mustn't outlive it
+            result = ctx->returnValue;
+            if (ctx->stop == STOP_NONE) {
+                table->insert(key, result);
+            }
+            return result;
+        }
+    };
+
+    bool isPure(Function* function, std::vector<Function*>* visiting);
+
+    // Pure nodes compute from their argument and children only. Calls are
+    // pure if their callee is; a function already being checked is assumed
+    // to be, which is what makes recursion pure.
+    bool isPure(Node* node, std::vector<Function*>* visiting) {
+        if (Simplest::CallNode* call = dynamic_cast<Simplest::CallNode*>(node)) {
+            return isPure(call->arg, visiting) && isPure(call->function, visiting);
+        }
+        if (MemoCallNode* call = dynamic_cast<MemoCallNode*>(node)) {
+            return isPure(call->arg, visiting) && isPure(call->function, visiting);
+        }
+
+        bool known =
+            dynamic_cast<Simplest::ConstNode*>(node) || dynamic_cast<Simplest::ArgNode*>(node) ||
+            dynamic_cast<Simplest::AddNode*>(node) || dynamic_cast<Simplest::SubNode*>(node) ||
+            dynamic_cast<Simplest::LessNode*>(node) || dynamic_cast<Simplest::IfNode*>(node) ||
+            dynamic_cast<Simplest::ReturnNode*>(node) || dynamic_cast<Simplest::SeqNode*>(node) ||
+            dynamic_cast<SimplifyCalls::IfElseNode*>(node) ||
+            dynamic_cast<SimpleFusion::LessConstNode*>(node) || dynamic_cast<SimpleFusion::SubConstNode*>(node) ||
+            dynamic_cast<BetterFusion::ConstNode*>(node) || dynamic_cast<BetterFusion::ArgNode*>(node) ||
+            dynamic_cast<BetterFusion::LessArgConstNode*>(node) || dynamic_cast<BetterFusion::SubArgConstNode*>(node);
+
+        if (!known) {
+            return false;
+        }
+
+        Node** slots[3];
+
+        for (uint32_t i = 0, end_i = Trees::childSlots(node, slots); i < end_i; i++) {
+            if (!isPure(*slots[i], visiting)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool isPure(Function* function, std::vector<Function*>* visiting) {
+        if (std::find(visiting->begin(), visiting->end(), function) != visiting->end()) {
+            return true;
+        }
+
+        visiting->push_back(function);
+
+        bool pure = true;
+        for (uint32_t i = 0; i < function->numNodes && pure; i++) {
+            pure = isPure(function->body[i], visiting);
+        }
+
+        visiting->pop_back();
+        return pure;
+    }
+
+    bool isPure(Function* function) {
+        std::vector<Function*> visiting;
+        return isPure(function, &visiting);
+    }
+
+    Node* rewriteCalls(Module* module, Node* node, Function* target, MemoTable* table) {
+        if (MemoCallNode* call = dynamic_cast<MemoCallNode*>(node)) {
+            call->arg = rewriteCalls(module, call->arg, target, table);
+            return node;
+        }
+
+        Node** slots[3];
+
+        for (uint32_t i = 0, end_i = Trees::childSlots(node, slots); i < end_i; i++) {
+            *slots[i] = rewriteCalls(module, *slots[i], target, table);
+        }
+
+        Simplest::CallNode* call = dynamic_cast<Simplest::CallNode*>(node);
+        if (call && call->function == target) {
+            return module->make<MemoCallNode>(target, call->arg, table);
+        }
+        return node;
+    }
+
+    // Memoizes `target` without checking it's pure, for when the caller knows
+    // better, rewriting its call sites in `functions`
+    MemoTable* memoizeFunction(Module* module, Function* target,
+                               Function* const* functions, uint32_t numFunctions, uint32_t capacity) {
+        MemoTable* table = module->make<MemoTable>(module, capacity);
+
+        for (uint32_t i = 0; i < numFunctions; i++) {
+            Function* function = functions[i];
+            for (uint32_t j = 0; j < function->numNodes; j++) {
+                function->body[j] = rewriteCalls(module, function->body[j], target, table);
+            }
+        }
+        return table;
+    }
+
+    // Memoizes every pure function in `functions` and returns how many there were
+    uint32_t memoize(Module* module, Function* const* functions, uint32_t numFunctions, uint32_t capacity) {
+        std::vector<Function*> pure;
+
+        for (uint32_t i = 0; i < numFunctions; i++) {
+            if (isPure(functions[i])) {
+                pure.push_back(functions[i]);
+            }
+        }
+
+        for (Function* function : pure) {
+            memoizeFunction(module, function, functions, numFunctions, capacity);
+        }
+        return (uint32_t) pure.size();
+    }
+
+    uint32_t fib(uint32_t n) {
+        Context ctx;
+        Module module;
+
+        Function* function = module.make<Function>();
+
+        // Same tree as Simplest::fib
+        function->init(&module, {
+            module.make<IfNode>(
+                module.make<LessNode>(module.make<ArgNode>(), module.make<ConstNode>(2)),
+                module.make<ReturnNode>(module.make<ArgNode>())),
+            module.make<ReturnNode>(
+                module.make<AddNode>(
+                    module.make<CallNode>(function,
+                        module.make<SubNode>(module.make<ArgNode>(), module.make<ConstNode>(1))),
+                    module.make<CallNode>(function,
+                        module.make<SubNode>(module.make<ArgNode>(), module.make<ConstNode>(2)))))
+        });
+
+        memoize(&module, &function, 1, 1024);
+
+        CallNode* call = module.make<CallNode>(function, module.make<ConstNode>(n));
+
+        return call->eval(&ctx);
+    }
+}
+
+// Tail calls for Frames functions. A call whose value is the caller's result
+// (the body's root, a branch of an IfElseNode in tail position, or a
+// Statements return) doesn't call at all: it stages its arguments and leaves
+// the callee in ctx->tailTarget, and the nodes above it return straight to
+// the trampoline that made the current call. That reuses its frame in a loop,
+// so recursion through tail calls runs in constant native and value stack.
+namespace TailCalls {
+    using namespace SimplifyCalls;
+    using BetterFusion::ConstNode;
+    using Frames::ArgN;
+    using Frames::Function;
+    using Frames::LessSlotConstNode;
+    using Frames::SubSlotConstNode;
+
+    template<uint32_t numArgs>
+    struct TailCallNode : Node {
+        Function* function;
+        // One slot even without arguments, since C++ has no empty arrays
+        Node* args[numArgs ? numArgs : 1];
+
+        TailCallNode(Function* function, Node* const* args) : function(function) {
+            for (uint32_t i = 0; i < numArgs; i++) {
+                this->args[i] = args[i];
+            }
+        }
+
+        // Arguments go on top of the stack in the callee's layout; the
+        // trampoline moves them down into its frame
+        uint32_t eval(Context* ctx) override {
+            uint32_t base = ctx->reserve(numArgs);
+
+            for (uint32_t i = 0; i < numArgs; i++) {
+                ctx->stack[base + numArgs - 1 - i] = args[i]->eval(ctx);
+            }
+
+            ctx->tailTarget = function;
+            return 0;
+        }
+    };
+
+    // A Frames::CallNode that also runs the tail calls its callee makes. Only
+    // calls into functions that make tail calls need it; the rest stay plain.
+    template<uint32_t numArgs>
+    struct TrampolineCallNode : Node {
+        Function* function;
+        // One slot even without arguments, since C++ has no empty arrays
+        Node* args[numArgs ? numArgs : 1];
+
+        TrampolineCallNode(Function* function, Node* const* args) : function(function) {
+            for (uint32_t i = 0; i < numArgs; i++) {
+                this->args[i] = args[i];
+            }
+        }
+
+        uint32_t eval(Context* ctx) override {
+            uint32_t base = ctx->reserve(numArgs);
+
+            for (uint32_t i = 0; i < numArgs; i++) {
+                ctx->stack[base + numArgs - 1 - i] = args[i]->eval(ctx);
+            }
+
+            uint32_t callerFrame = ctx->frame;
+            Function* callee = function;
+            uint32_t result;
+
+            for (;;) {
+                // Each tail call counts, so a tail-recursive loop can be stopped
+                if (ctx->tick()) {
+                    ctx->tailTarget = 0;
+                    result = 0;
+                    break;
+                }
+
+                uint32_t numLocals = callee->numLocals;
+                ctx->frame = ctx->reserve(numLocals);
+
+                for (uint32_t i = 0; i < numLocals; i++) {
+                    ctx->stack[ctx->frame + i] = 0;
+                }
+
+                result = callee->body->eval(ctx);
+
+                if (!ctx->tailTarget) {
+                    break;
+                }
+
+                callee = (Function*) ctx->tailTarget;
+                ctx->tailTarget = 0;
+
+                // The staged arguments are the top callee->numArgs slots
+                uint32_t count = callee->numArgs;
+                memmove(ctx->stack + base, ctx->stack + ctx->stackTop - count, count * sizeof(uint32_t));
+                ctx->stackTop = base + count;
+            }
+
+            ctx->stackTop = base;
+            ctx->frame = callerFrame;
+
+            return result;
+        }
+    };
+
+    // Rewrites calls in two rounds: first tail calls, remembering which
+    // functions make them, then the other calls into those functions.
+    struct Pass {
+        Module* module;
+        bool trampolines;
+        Function* current;
+        std::vector<Function*> tailCalling;
+
+        Pass(Module* module) : module(module), trampolines(false), current(0) {}
+
+        bool makesTailCalls(Function* function) {
+            return std::find(tailCalling.begin(), tailCalling.end(), function) != tailCalling.end();
+        }
+    };
+
+    Node* visit(Pass* pass, Node* node, bool tail);
+
+    template<uint32_t numArgs>
+    void visitArgs(Pass* pass, Node** args) {
+        for (uint32_t i = 0; i < numArgs; i++) {
+            args[i] = visit(pass, args[i], false);
+        }
+    }
+
+    // Tries every arity from numArgs down, returning 0 for nodes that aren't calls
+    template<uint32_t numArgs>
+    struct Calls {
+        static Node* visit(Pass* pass, Node* node, bool tail) {
+            if (Frames::CallNode<numArgs>* call = dynamic_cast<Frames::CallNode<numArgs>*>(node)) {
+                visitArgs<numArgs>(pass, call->args);
+
+                if (!pass->trampolines && tail) {
+                    if (!pass->makesTailCalls(pass->current)) {
+                        pass->tailCalling.push_back(pass->current);
+                    }
+                    return pass->module->make<TailCallNode<numArgs>>(call->function, call->args);
+                }
+                if (pass->trampolines && pass->makesTailCalls(call->function)) {
+                    return pass->module->make<TrampolineCallNode<numArgs>>(call->function, call->args);
+                }
+                return node;
+            }
+            if (TailCallNode<numArgs>* call = dynamic_cast<TailCallNode<numArgs>*>(node)) {
+                visitArgs<numArgs>(pass, call->args);
+                return node;
+            }
+            if (TrampolineCallNode<numArgs>* call = dynamic_cast<TrampolineCallNode<numArgs>*>(node)) {
+                visitArgs<numArgs>(pass, call->args);
+                return node;
+            }
+            return Calls<numArgs - 1>::visit(pass, node, tail);
+        }
+    };
+
+    template<>
+    struct Calls<0> {
+        static Node* visit(Pass* pass, Node* node, bool tail) {
+            return 0;
+        }
+    };
+
+    const uint32_t maxArgs = 4;
+
+    // Statements pass no tail position down: a return is one wherever it is
+    Node* visitStatement(Pass* pass, Node* node) {
+        if (Statements::ReturnNode* ret = dynamic_cast<Statements::ReturnNode*>(node)) {
+            ret->rhs = visit(pass, ret->rhs, true);
+            return node;
+        }
+        if (Statements::IfReturnNode* ifReturn = dynamic_cast<Statements::IfReturnNode*>(node)) {
+            ifReturn->condition = visit(pass, ifReturn->condition, false);
+            ifReturn->value = visit(pass, ifReturn->value, true);
+            ifReturn->rest = (Statements::StatementNode*) visitStatement(pass, ifReturn->rest);
+            return node;
+        }
+        if (Statements::IfReturnElseNode* ifReturn = dynamic_cast<Statements::IfReturnElseNode*>(node)) {
+            ifReturn->condition = visit(pass, ifReturn->condition, false);
+            ifReturn->value = visit(pass, ifReturn->value, true);
+            ifReturn->otherwise = visit(pass, ifReturn->otherwise, true);
+            return node;
+        }
+        if (Statements::ExprStatementNode* statement = dynamic_cast<Statements::ExprStatementNode*>(node)) {
+            statement->expr = visit(pass, statement->expr, false);
+            return node;
+        }
+        if (Statements::IfNode* ifNode = dynamic_cast<Statements::IfNode*>(node)) {
+            ifNode->condition = visit(pass, ifNode->condition, false);
+            visitStatement(pass, ifNode->body);
+            return node;
+        }
+        if (Statements::IfElseNode* ifElse = dynamic_cast<Statements::IfElseNode*>(node)) {
+            ifElse->condition = visit(pass, ifElse->condition, false);
+            visitStatement(pass, ifElse->ifBody);
+            visitStatement(pass, ifElse->elseBody);
+            return node;
+        }
+        if (Statements::BlockNode* block = dynamic_cast<Statements::BlockNode*>(node)) {
+            for (uint32_t i = 0; i < block->numStatements; i++) {
+                visitStatement(pass, block->statements[i]);
+            }
+            return node;
+        }
+        if (Loops::WhileNode* loop = dynamic_cast<Loops::WhileNode*>(node)) {
+            loop->condition = visit(pass, loop->condition, false);
+            visitStatement(pass, loop->body);
+            return node;
+        }
+        if (Loops::FusedLoopNode* loop = dynamic_cast<Loops::FusedLoopNode*>(node)) {
+            visitStatement(pass, loop->body);
+            return node;
+        }
+        if (Loops::AssignLocalNode* assign = dynamic_cast<Loops::AssignLocalNode*>(node)) {
+            assign->value = visit(pass, assign->value, false);
+            return node;
+        }
+        return 0;
+    }
+
+    Node* visit(Pass* pass, Node* node, bool tail) {
+        if (Node* call = Calls<maxArgs>::visit(pass, node, tail)) {
+            return call;
+        }
+        if (Node* statement = visitStatement(pass, node)) {
+            return statement;
+        }
+        if (IfElseNode* ifElse = dynamic_cast<IfElseNode*>(node)) {
+            ifElse->condition = visit(pass, ifElse->condition, false);
+            ifElse->ifBody = visit(pass, ifElse->ifBody, tail);
+            ifElse->elseBody = visit(pass, ifElse->elseBody, tail);
+            return node;
+        }
+
+        Node** slots[3];
+
+        for (uint32_t i = 0, end_i = Trees::childSlots(node, slots); i < end_i; i++) {
+            *slots[i] = visit(pass, *slots[i], false);
+        }
+        return node;
+    }
+
+    // Eliminates tail calls in `functions`, with up to maxArgs arguments.
+    // Calls into them from anywhere else must be TrampolineCallNodes; a plain
+    // Frames::CallNode asserts in debug builds.
+    void eliminate(Module* module, Function* const* functions, uint32_t numFunctions) {
+        Pass pass(module);
+
+        for (uint32_t round = 0; round < 2; round++) {
+            pass.trampolines = round == 1;
+
+            for (uint32_t i = 0; i < numFunctions; i++) {
+                pass.current = functions[i];
+                functions[i]->body = visit(&pass, functions[i]->body, true);
+            }
+        }
+    }
+
+    // fib with accumulators, which is a loop once its tail call is gone:
+    // fib(n, a, b) = n < 1 ? a : fib(n - 1, b, a + b)
+    uint32_t fib(uint32_t n) {
+        Context ctx;
+        Module module;
+
+        Function* function = module.make<Function>(3, 0);
+
+        function->body = module.make<IfElseNode>(
+            module.make<LessSlotConstNode<ArgN<0>>>(module.make<ArgN<0>>(), module.make<ConstNode>(1)),
+            module.make<ArgN<1>>(),
+            module.make<Frames::CallNode<3>>(function,
+                module.make<SubSlotConstNode<ArgN<0>>>(module.make<ArgN<0>>(), module.make<ConstNode>(1)),
+                module.make<ArgN<2>>(),
+                module.make<Frames::AddSlotsNode<ArgN<1>, ArgN<2>>>(module.make<ArgN<1>>(), module.make<ArgN<2>>())));
+
+        eliminate(&module, &function, 1);
+
+        Node* args[] = { module.make<ConstNode>(n), module.make<ConstNode>(0), module.make<ConstNode>(1) };
+
+        return module.make<TrampolineCallNode<3>>(function, args)->eval(&ctx);
+    }
+}
+
+// Runs independent halves of pure additions on a work-stealing pool. The
+// thread that forks keeps the left operand and offers the right one as a task;
+// if nobody stole it by the time the left is done it runs it inline, otherwise
+// it helps with other tasks until the thief is finished. Each thread owns a
+// Context, and a task carries the argument its subtree reads.
+namespace Parallel {
+    using namespace SimplifyCalls;
+
+    struct Task {
+        Node* node;
+        uint32_t arg;
+        // Stack depth where the task was forked, which it runs at again so
+        // the depth limit means the same on every thread
+        uint32_t depth;
+        // Context whose limits the task runs under, wherever it runs
+        Context* owner;
+        uint32_t result;
+        // Why the task stopped, if it did, for the thread that joins it
+        Stop stop;
+        std::atomic<bool> done;
+
+        Task(Node* node, uint32_t arg, uint32_t depth, Context* owner)
+            : node(node), arg(arg), depth(depth), owner(owner), result(0), stop(STOP_NONE), done(false) {}
+    };
+
+    // The owner pushes and pops at the back, thieves take from the front, so
+    // they get the oldest and largest tasks. Tasks are coarse enough that a
+    // lock per queue doesn't show.
+    struct Queue {
+        std::mutex lock;
+        std::deque<Task*> tasks;
+    };
+
+    struct Pool;
+
+    // The pool the current thread works for, if any, and its queue there
+    struct Worker {
+        const Pool* pool;
+        uint32_t index;
+    };
+
+    thread_local Worker worker = { 0, 0 };
+
+    struct Pool {
+        std::vector<Queue*> queues;
+        std::vector<std::thread> threads;
+        std::atomic<bool> stopping;
+
+        Pool(uint32_t numThreads) : stopping(false) {
+            numThreads = numThreads ? numThreads : 1;
+
+            for (uint32_t i = 0; i < numThreads; i++) {
+                queues.push_back(new Queue());
+            }
+            for (uint32_t i = 1; i < numThreads; i++) {
+                threads.emplace_back(&Pool::work, this, i);
+            }
+        }
+
+        Pool(const Pool&) = delete;
+        Pool& operator=(const Pool&) = delete;
+
+        ~Pool() {
+            stopping.store(true);
+            for (std::thread& thread : threads) {
+                thread.join();
+            }
+            for (Queue* queue : queues) {
+                delete queue;
+            }
+        }
+
+        // Queue of the current thread: its own if it's one of our workers,
+        // else 0, the queue of threads that call into the pool
+        uint32_t queueIndex() const {
+            return worker.pool == this ? worker.index : 0;
+        }
+
+        void push(Task* task) {
+            Queue* queue = queues[queueIndex()];
+            std::lock_guard<std::mutex> guard(queue->lock);
+            queue->tasks.push_back(task);
+        }
+
+        // Takes task back if it's still at the back of our queue, which it is
+        // unless someone stole it: everything pushed after it has been joined.
+        bool takeBack(Task* task) {
+            Queue* queue = queues[queueIndex()];
+            std::lock_guard<std::mutex> guard(queue->lock);
+
+            if (queue->tasks.empty() || queue->tasks.back() != task) {
+                return false;
+            }
+            queue->tasks.pop_back();
+            return true;
+        }
+
+        // Newest task of our own, or else the oldest of someone else's
+        Task* find() {
+            uint32_t self = queueIndex();
+            uint32_t numQueues = (uint32_t) queues.size();
+
+            for (uint32_t i = 0; i < numQueues; i++) {
+                Queue* queue = queues[(self + i) % numQueues];
+                std::lock_guard<std::mutex> guard(queue->lock);
+
+                if (!queue->tasks.empty()) {
+                    Task* task;
+                    if (i == 0) {
+                        task = queue->tasks.back();
+                        queue->tasks.pop_back();
+                    }
+                    else {
+                        task = queue->tasks.front();
+                        queue->tasks.pop_front();
+                    }
+                    return task;
+                }
+            }
+            return 0;
+        }
+
+        // Runs task on ctx under the task owner's limits: its first tick
+        // takes a slice of the owner's budget, and what's left of the slice
+        // goes back at the end, so threads share one budget. ctx may be in
+        // the middle of a task of its own, which carries on afterwards.
+        static void execute(Task* task, Context* ctx) {
+            uint32_t saved = ctx->stackTop;
+            uint32_t savedTicks = ctx->ticks;
+            Stop savedStop = ctx->stop;
+            Context* savedOwner = ctx->owner;
+
+            ctx->ticks = 1;
+            ctx->stop = STOP_NONE;
+            ctx->owner = task->owner;
+
+            if (ctx->stackTop + 1 < task->depth) {
+                ctx->stackTop = task->depth - 1;
+            }
+            ctx->push(task->arg);
+            task->result = task->node->eval(ctx);
+            task->stop = ctx->stop;
+            ctx->stopForReturn = false;
+            ctx->stackTop = saved;
+
+            if (ctx->stop == STOP_NONE) {
+                task->owner->budget.fetch_add(ctx->ticks - 1, std::memory_order_relaxed);
+            }
+            ctx->ticks = savedTicks;
+            ctx->stop = savedStop;
+            ctx->owner = savedOwner;
+
+            task->done.store(true, std::memory_order_release);
+        }
+
+        // Waits for a stolen task, running others meanwhile. If the task
+        // stopped, ctx stops too, so the stop unwinds to the root.
+        void join(Task* task, Context* ctx) {
+            while (!task->done.load(std::memory_order_acquire)) {
+                if (Task* other = find()) {
+                    execute(other, ctx);
+                }
+                else {
+                    std::this_thread::yield();
+                }
+            }
+
+            if (task->stop != STOP_NONE && ctx->stop == STOP_NONE) {
+                ctx->stop = task->stop;
+                ctx->ticks = 1;
+            }
+        }
+
+        void work(uint32_t index) {
+            worker = { this, index };
+
+            Context ctx;
+
+            while (!stopping.load(std::memory_order_relaxed)) {
+                if (Task* task = find()) {
+                    execute(task, &ctx);
+                }
+                else {
+                    std::this_thread::yield();
+                }
+            }
+        }
+    };
+
+    // lhs + rhs with rhs offered to the pool. Below maxDepth calls, subtrees
+    // are assumed too small to pay for a task and it's a plain AddNode.
+    struct ForkAddNode : Node {
+        Node* lhs;
+        Node* rhs;
+        Pool* pool;
+        uint32_t maxDepth;
+
+        ForkAddNode(Node* lhs, Node* rhs, Pool* pool, uint32_t maxDepth)
+            : lhs(lhs), rhs(rhs), pool(pool), maxDepth(maxDepth) {}
+
+        uint32_t eval(Context* ctx) override {
+            if (ctx->stackTop > maxDepth) {
+                return lhs->eval(ctx) + rhs->eval(ctx);
+            }
+            return fork(ctx);
+        }
+
+        // Apart from eval so the sequential path doesn't set up a task
+        NOINLINE uint32_t fork(Context* ctx) {
+            Task task(rhs, ctx->stackTop ? ctx->stack[ctx->stackTop - 1] : 0, ctx->stackTop, ctx->limits());
+
+            pool->push(&task);
+
+            uint32_t left = lhs->eval(ctx);
+
+            if (pool->takeBack(&task)) {
+                return left + rhs->eval(ctx);
+            }
+
+            pool->join(&task, ctx);
+            return left + task.result;
+        }
+    };
+
+    // Whether evaluating node only computes a value. Functions being visited
+    // count as pure, so recursion doesn't make a function impure.
+    bool isPure(Node* node, std::vector<Node*>* visiting) {
+        if (CallAnyNode* call = dynamic_cast<CallAnyNode*>(node)) {
+            if (!isPure(call->arg, visiting)) {
+                return false;
+            }
+            if (std::find(visiting->begin(), visiting->end(), call->function) != visiting->end()) {
+                return true;
+            }
+
+            visiting->push_back(call->function);
+            bool pure = isPure(call->function, visiting);
+            visiting->pop_back();
+            return pure;
+        }
+
+        bool known =
+            dynamic_cast<Simplest::ConstNode*>(node) || dynamic_cast<Simplest::ArgNode*>(node) ||
+            dynamic_cast<Simplest::AddNode*>(node) || dynamic_cast<Simplest::SubNode*>(node) ||
+            dynamic_cast<Simplest::LessNode*>(node) || dynamic_cast<IfElseNode*>(node) ||
+            dynamic_cast<BetterFusion::ConstNode*>(node) || dynamic_cast<BetterFusion::ArgNode*>(node) ||
+            dynamic_cast<BetterFusion::LessArgConstNode*>(node) || dynamic_cast<BetterFusion::SubArgConstNode*>(node);
+
+        if (!known) {
+            return false;
+        }
+
+        Node** slots[3];
+
+        for (uint32_t i = 0, end_i = Trees::childSlots(node, slots); i < end_i; i++) {
+            if (!isPure(*slots[i], visiting)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool hasCall(Node* node) {
+        if (dynamic_cast<CallAnyNode*>(node)) {
+            return true;
+        }
+
+        Node** slots[3];
+
+        for (uint32_t i = 0, end_i = Trees::childSlots(node, slots); i < end_i; i++) {
+            if (hasCall(*slots[i])) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Turns pure additions of two calls in a function body (the root a
+    // CallAnyNode calls) into ForkAddNodes. Returns how many were replaced.
+    uint32_t parallelize(Module* module, Node** slot, Pool* pool, uint32_t maxDepth) {
+        uint32_t numForks = 0;
+        Node** slots[3];
+
+        for (uint32_t i = 0, end_i = Trees::childSlots(*slot, slots); i < end_i; i++) {
+            numForks += parallelize(module, slots[i], pool, maxDepth);
+        }
+
+        Simplest::AddNode* add = dynamic_cast<Simplest::AddNode*>(*slot);
+        std::vector<Node*> visiting;
+
+        if (add && hasCall(add->lhs) && hasCall(add->rhs) && isPure(add, &visiting)) {
+            *slot = module->make<ForkAddNode>(add->lhs, add->rhs, pool, maxDepth);
+            numForks += 1;
+        }
+        return numForks;
+    }
+
+    uint32_t defaultThreads() {
+        uint32_t numThreads = std::thread::hardware_concurrency();
+        return numThreads ? numThreads : 1;
+    }
+
+    // SimplifyCalls::fib with the two recursive calls forked. 12 levels make
+    // up to 4096 tasks, plenty to keep a few dozen threads busy.
+    uint32_t fib(uint32_t n, uint32_t numThreads) {
+        using BetterFusion::ConstNode;
+
+        Context ctx;
+        Module module;
+        Pool pool(numThreads);
+
+        IfElseNode* function = buildFib(&module);
+
+        parallelize(&module, &function->elseBody, &pool, 12);
+
+        CallAnyNode* call = module.make<CallAnyNode>(function, module.make<ConstNode>(n));
+
+        uint32_t result = call->eval(&ctx);
+
+        return result;
+    }
+
+    uint32_t fib(uint32_t n) {
+        return fib(n, defaultThreads());
+    }
+}
+
+// Programs built once and run from many threads. A frozen Program is only ever
+// read while it runs, so any number of Contexts can execute it at the same
+// time without locks; all mutable state lives in the Context. Contexts come
+// from a pool, so a request doesn't map a fresh stack.
+namespace Serving {
+    using namespace Simplest;
+
+    struct Program {
+        Module module;
+        Function* entry;
+
+        Program() : entry(0) {}
+
+        Program(const Program&) = delete;
+        Program& operator=(const Program&) = delete;
+
+        // Nodes that update themselves or the trees they call as they run, so
+        // they can't be shared. A tiered call counts calls and fuses and
+        // compiles its callee in place.
+        static bool isShared(Node* node, std::vector<Function*>* visited) {
+            if (dynamic_cast<Memoization::MemoCallNode*>(node) || dynamic_cast<Profiler::CountingNode*>(node) ||
+                dynamic_cast<Quickening::QuickeningNode*>(node) || dynamic_cast<Tiering::TieredCallNode*>(node)) {
+                return false;
+            }
+            if (CallNode* call = dynamic_cast<CallNode*>(node)) {
+                if (!isShared(call->function, visited)) {
+                    return false;
+                }
+            }
+
+            Node** slots[3];
+
+            for (uint32_t i = 0, end_i = Trees::childSlots(node, slots); i < end_i; i++) {
+                if (!isShared(*slots[i], visited)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        static bool isShared(Function* function, std::vector<Function*>* visited) {
+            if (std::find(visited->begin(), visited->end(), function) != visited->end()) {
+                return true;
+            }
+
+            visited->push_back(function);
+
+            for (uint32_t i = 0; i < function->numNodes; i++) {
+                if (!isShared(function->body[i], visited)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        // Makes entry the program's entry point once its trees are built in
+        // module. Fails if they contain nodes with per-run state or nodes
+        // that rewrite themselves or their callees; children are found
+        // through Trees, so only its node types are checked.
+        bool freeze(Function* entry) {
+            std::vector<Function*> visited;
+
+            if (!isShared(entry, &visited)) {
+                return false;
+            }
+            this->entry = entry;
+            return true;
+        }
+
+        // A call to entry, without a CallNode so nothing is built per run
+        uint32_t run(uint32_t arg, Context* ctx) const {
+            // Falling off the end returns 0 rather than whatever an earlier
+            // request on this lease left in returnValue
+            ctx->returnValue = 0;
+            ctx->push(arg);
+
+            for (uint32_t i = 0, end_i = entry->numNodes; i < end_i; i++) {
+                entry->body[i]->eval(ctx);
+                if (ctx->stopForReturn) {
+                    break;
+                }
+            }
+
+            ctx->stopForReturn = false;
+            ctx->pop();
+
+            return ctx->returnValue;
+        }
+    };
+
+    // Idle Contexts, handed out to whichever thread needs one. The lock is
+    // only held to take or return a Context, never while one runs.
+    struct ContextPool {
+        std::mutex lock;
+        std::vector<Context*> idle;
+        uint32_t stackSize;
+
+        ContextPool(uint32_t stackSize = 4096) : stackSize(stackSize) {}
+
+        ContextPool(const ContextPool&) = delete;
+        ContextPool& operator=(const ContextPool&) = delete;
+
+        ~ContextPool() {
+            for (Context* ctx : idle) {
+                delete ctx;
+            }
+        }
+
+        Context* acquire() {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+
+                if (!idle.empty()) {
+                    Context* ctx = idle.back();
+                    idle.pop_back();
+                    return ctx;
+                }
+            }
+            return new Context(stackSize);
+        }
+
+        void release(Context* ctx) {
+            ctx->reset();
+
+            std::lock_guard<std::mutex> guard(lock);
+            idle.push_back(ctx);
+        }
+    };
+
+    // A Context for the length of one request
+    struct Lease {
+        ContextPool* pool;
+        Context* ctx;
+
+        Lease(ContextPool* pool) : pool(pool), ctx(pool->acquire()) {}
+
+        Lease(const Lease&) = delete;
+        Lease& operator=(const Lease&) = delete;
+
+        ~Lease() {
+            pool->release(ctx);
+        }
+    };
+
+    // Serves requests for fib(n) from a few threads sharing one fused program.
+    // Each request leases a Context, so at most one per thread is created.
+    uint32_t fib(uint32_t n) {
+        const uint32_t numThreads = 4;
+        const uint32_t requestsPerThread = 8;
+
+        Program program;
+        Module* module = &program.module;
+        Function* function = module->make<Function>();
+
+        function->init(module, {
+            module->make<IfNode>(
+                module->make<LessNode>(module->make<ArgNode>(), module->make<ConstNode>(2)),
+                module->make<ReturnNode>(module->make<ArgNode>())),
+            module->make<ReturnNode>(
+                module->make<AddNode>(
+                    module->make<CallNode>(function,
+                        module->make<SubNode>(module->make<ArgNode>(), module->make<ConstNode>(1))),
+                    module->make<CallNode>(function,
+                        module->make<SubNode>(module->make<ArgNode>(), module->make<ConstNode>(2)))))
+        });
+
+        AutoFusion::fuse(module, function);
+        if (!program.freeze(function)) {
+            return 0;
+        }
+
+        const Program& shared = program;
+        ContextPool contexts;
+        std::vector<uint32_t> results(numThreads * requestsPerThread);
+        std::vector<std::thread> threads;
+
+        for (uint32_t i = 0; i < numThreads; i++) {
+            threads.emplace_back([&, i]() {
+                for (uint32_t j = 0; j < requestsPerThread; j++) {
+                    Lease lease(&contexts);
+                    results[i * requestsPerThread + j] = shared.run(n, lease.ctx);
+                }
+            });
+        }
+
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+
+        // Every request must agree
+        for (uint32_t result : results) {
+            if (result != results[0]) {
+                return 0;
+            }
+        }
+        return results[0];
+    }
+}
+
+// Evaluates one tree over a batch of arguments, a lane per argument, so each
+// virtual eval() is paid once per batch instead of once per argument. Nodes
+// compute every lane with the kernels below: AVX2 where the compiler targets it
+// (-DOIF_NATIVE=ON on an AVX2 machine), NEON on ARM, and otherwise plain loops
+// over a fixed width that the compiler may still vectorize. Control flow is
+// masked: a branch runs if any active lane takes it, and a call only returns
+// once all its active lanes have, so lanes that diverge pay for each other's
+// work. Batch trees are translated from SimplifyCalls trees and give the same
+// results, lane by lane, as evaluating those one argument at a time.
+namespace Batch {
+    using Simplest::Module;
+
+    // A multiple of 8, the most lanes a kernel takes at a time
+    const uint32_t width = 8;
+
+    struct Lanes {
+        uint32_t v[width];
+    };
+
+    // All ones for active lanes, zero for the others
+    typedef Lanes Mask;
+
+    // AVX2 takes 8 lanes at a time, NEON 4
+    void fill(Lanes* out, uint32_t value) {
+#if defined(__AVX2__)
+        for (uint32_t i = 0; i < width; i += 8) {
+            _mm256_storeu_si256((__m256i*) (out->v + i), _mm256_set1_epi32((int) value));
+        }
+#elif defined(__ARM_NEON)
+        for (uint32_t i = 0; i < width; i += 4) {
+            vst1q_u32(out->v + i, vdupq_n_u32(value));
+        }
+#else
+        for (uint32_t i = 0; i < width; i++) {
+            out->v[i] = value;
+        }
+#endif
+    }
+
+    bool any(const Mask& mask) {
+#if defined(__AVX2__)
+        __m256i bits = _mm256_setzero_si256();
+        for (uint32_t i = 0; i < width; i += 8) {
+            bits = _mm256_or_si256(bits, _mm256_loadu_si256((const __m256i*) (mask.v + i)));
+        }
+        return !_mm256_testz_si256(bits, bits);
+#elif defined(__ARM_NEON)
+        uint32x4_t bits = vdupq_n_u32(0);
+        for (uint32_t i = 0; i < width; i += 4) {
+            bits = vorrq_u32(bits, vld1q_u32(mask.v + i));
+        }
+        uint32x2_t half = vorr_u32(vget_low_u32(bits), vget_high_u32(bits));
+        return (vget_lane_u32(half, 0) | vget_lane_u32(half, 1)) != 0;
+#else
+        uint32_t bits = 0;
+        for (uint32_t i = 0; i < width; i++) {
+            bits |= mask.v[i];
+        }
+        return bits != 0;
+#endif
+    }
+
+    // Op is one of Composed's OpAdd, OpSub and OpLess
+    template<typename Op>
+    struct Kernel {
+        static void apply(const Lanes& l, const Lanes& r, Lanes* out) {
+            for (uint32_t i = 0; i < width; i++) {
+                out->v[i] = Op::apply(l.v[i], r.v[i]);
+            }
+        }
+    };
+
+#if defined(__AVX2__)
+    template<>
+    struct Kernel<Composed::OpAdd> {
+        static void apply(const Lanes& l, const Lanes& r, Lanes* out) {
+            for (uint32_t i = 0; i < width; i += 8) {
+                __m256i a = _mm256_loadu_si256((const __m256i*) (l.v + i));
+                __m256i b = _mm256_loadu_si256((const __m256i*) (r.v + i));
+                _mm256_storeu_si256((__m256i*) (out->v + i), _mm256_add_epi32(a, b));
+            }
+        }
+    };
+
+    template<>
+    struct Kernel<Composed::OpSub> {
+        static void apply(const Lanes& l, const Lanes& r, Lanes* out) {
+            for (uint32_t i = 0; i < width; i += 8) {
+                __m256i a = _mm256_loadu_si256((const __m256i*) (l.v + i));
+                __m256i b = _mm256_loadu_si256((const __m256i*) (r.v + i));
+                _mm256_storeu_si256((__m256i*) (out->v + i), _mm256_sub_epi32(a, b));
+            }
+        }
+    };
+
+    // AVX2 only compares signed, so both sides are flipped into signed order
+    // first. The all-ones result becomes the 1 that OpLess gives.
+    template<>
+    struct Kernel<Composed::OpLess> {
+        static void apply(const Lanes& l, const Lanes& r, Lanes* out) {
+            __m256i bias = _mm256_set1_epi32((int) 0x80000000u);
+            for (uint32_t i = 0; i < width; i += 8) {
+                __m256i a = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*) (l.v + i)), bias);
+                __m256i b = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*) (r.v + i)), bias);
+                _mm256_storeu_si256((__m256i*) (out->v + i), _mm256_srli_epi32(_mm256_cmpgt_epi32(b, a), 31));
+            }
+        }
+    };
+#elif defined(__ARM_NEON)
+    template<>
+    struct Kernel<Composed::OpAdd> {
+        static void apply(const Lanes& l, const Lanes& r, Lanes* out) {
+            for (uint32_t i = 0; i < width; i += 4) {
+                vst1q_u32(out->v + i, vaddq_u32(vld1q_u32(l.v + i), vld1q_u32(r.v + i)));
+            }
+        }
+    };
+
+    template<>
+    struct Kernel<Composed::OpSub> {
+        static void apply(const Lanes& l, const Lanes& r, Lanes* out) {
+            for (uint32_t i = 0; i < width; i += 4) {
+                vst1q_u32(out->v + i, vsubq_u32(vld1q_u32(l.v + i), vld1q_u32(r.v + i)));
+            }
+        }
+    };
+
+    // The all-ones result becomes the 1 that OpLess gives
+    template<>
+    struct Kernel<Composed::OpLess> {
+        static void apply(const Lanes& l, const Lanes& r, Lanes* out) {
+            for (uint32_t i = 0; i < width; i += 4) {
+                vst1q_u32(out->v + i, vshrq_n_u32(vcltq_u32(vld1q_u32(l.v + i), vld1q_u32(r.v + i)), 31));
+            }
+        }
+    };
+#endif
+
+    // The lanes of mask where taken is true, and those where it's false
+    void split(const Mask& mask, const Lanes& taken, Mask* ifMask, Mask* elseMask) {
+#if defined(__AVX2__)
+        for (uint32_t i = 0; i < width; i += 8) {
+            __m256i m = _mm256_loadu_si256((const __m256i*) (mask.v + i));
+            __m256i t = _mm256_loadu_si256((const __m256i*) (taken.v + i));
+            __m256i notTaken = _mm256_cmpeq_epi32(t, _mm256_setzero_si256());
+            _mm256_storeu_si256((__m256i*) (ifMask->v + i), _mm256_andnot_si256(notTaken, m));
+            _mm256_storeu_si256((__m256i*) (elseMask->v + i), _mm256_and_si256(notTaken, m));
+        }
+#elif defined(__ARM_NEON)
+        for (uint32_t i = 0; i < width; i += 4) {
+            uint32x4_t m = vld1q_u32(mask.v + i);
+            uint32x4_t notTaken = vceqq_u32(vld1q_u32(taken.v + i), vdupq_n_u32(0));
+            vst1q_u32(ifMask->v + i, vbicq_u32(m, notTaken));
+            vst1q_u32(elseMask->v + i, vandq_u32(m, notTaken));
+        }
+#else
+        for (uint32_t i = 0; i < width; i++) {
+            uint32_t lane = taken.v[i] ? 0xffffffffu : 0;
+            ifMask->v[i] = mask.v[i] & lane;
+            elseMask->v[i] = mask.v[i] & ~lane;
+        }
+#endif
+    }
+
+    // a in the lanes of ifMask, b in the others
+    void select(const Mask& ifMask, const Lanes& a, const Lanes& b, Lanes* out) {
+#if defined(__AVX2__)
+        for (uint32_t i = 0; i < width; i += 8) {
+            __m256i m = _mm256_loadu_si256((const __m256i*) (ifMask.v + i));
+            __m256i x = _mm256_loadu_si256((const __m256i*) (a.v + i));
+            __m256i y = _mm256_loadu_si256((const __m256i*) (b.v + i));
+            _mm256_storeu_si256((__m256i*) (out->v + i), _mm256_blendv_epi8(y, x, m));
+        }
+#elif defined(__ARM_NEON)
+        for (uint32_t i = 0; i < width; i += 4) {
+            vst1q_u32(out->v + i, vbslq_u32(vld1q_u32(ifMask.v + i), vld1q_u32(a.v + i), vld1q_u32(b.v + i)));
+        }
+#else
+        for (uint32_t i = 0; i < width; i++) {
+            out->v[i] = ifMask.v[i] ? a.v[i] : b.v[i];
+        }
+#endif
+    }
+
+    // One Lanes of arguments per call
+    struct Context {
+        std::vector<Lanes> stack;
+
+        Context(uint32_t stackSize = 4096) {
+            stack.reserve(stackSize);
+        }
+    };
+
+    // Writes every lane of out; only the active ones are meaningful
+    struct Node {
+        virtual void eval(Context* ctx, const Mask& mask, Lanes* out) = 0;
+    };
+
+    struct ConstNode : Node {
+        uint32_t value;
+
+        ConstNode(uint32_t value) : value(value) {}
+
+        void eval(Context* ctx, const Mask& mask, Lanes* out) override {
+            fill(out, value);
+        }
+    };
+
+    struct ArgNode : Node {
+        void eval(Context* ctx, const Mask& mask, Lanes* out) override {
+            *out = ctx->stack.back();
+        }
+    };
+
+    template<typename Op>
+    struct BinaryNode : Node {
+        Node* lhs;
+        Node* rhs;
+
+        BinaryNode(Node* lhs, Node* rhs) : lhs(lhs), rhs(rhs) {}
+
+        void eval(Context* ctx, const Mask& mask, Lanes* out) override {
+            Lanes l, r;
+            lhs->eval(ctx, mask, &l);
+            rhs->eval(ctx, mask, &r);
+
+            Kernel<Op>::apply(l, r, out);
+        }
+    };
+
+    struct IfElseNode : Node {
+        Node* condition;
+        Node* ifBody;
+        Node* elseBody;
+
+        IfElseNode(Node* condition, Node* ifBody, Node* elseBody)
+            : condition(condition), ifBody(ifBody), elseBody(elseBody) {}
+
+        void eval(Context* ctx, const Mask& mask, Lanes* out) override {
+            Lanes taken;
+            condition->eval(ctx, mask, &taken);
+
+            Mask ifMask, elseMask;
+            split(mask, taken, &ifMask, &elseMask);
+
+            Lanes a = {}, b = {};
+            if (any(ifMask)) {
+                ifBody->eval(ctx, ifMask, &a);
+            }
+            if (any(elseMask)) {
+                elseBody->eval(ctx, elseMask, &b);
+            }
+
+            select(ifMask, a, b, out);
+        }
+    };
+
+    // Like CallAnyNode, function is the root of the callee's tree
+    struct CallNode : Node {
+        Node* function;
+        Node* arg;
+
+        CallNode(Node* function, Node* arg) : function(function), arg(arg) {}
+
+        void eval(Context* ctx, const Mask& mask, Lanes* out) override {
+            Lanes args;
+            arg->eval(ctx, mask, &args);
+
+            ctx->stack.push_back(args);
+            function->eval(ctx, mask, out);
+            ctx->stack.pop_back();
+        }
+    };
+
+    // Batch nodes for a SimplifyCalls tree. Nodes are registered before their
+    // children are translated, so a call back to a root being translated finds
+    // it. Node types without a batch version make translation fail.
+    struct Translator {
+        Module* module;
+        std::unordered_map<Simplest::Node*, Node*> translated;
+
+        Translator(Module* module) : module(module) {}
+
+        template<typename Op, typename Scalar>
+        Node* binary(Scalar* node) {
+            BinaryNode<Op>* batch = module->make<BinaryNode<Op>>(nullptr, nullptr);
+            translated[node] = batch;
+            batch->lhs = translate(node->lhs);
+            batch->rhs = translate(node->rhs);
+            return batch->lhs && batch->rhs ? batch : 0;
+        }
+
+        Node* translate(Simplest::Node* node) {
+            std::unordered_map<Simplest::Node*, Node*>::const_iterator found = translated.find(node);
+            if (found != translated.end()) {
+                return found->second;
+            }
+
+            if (Simplest::ConstNode* constant = dynamic_cast<Simplest::ConstNode*>(node)) {
+                return module->make<ConstNode>(constant->value);
+            }
+            if (BetterFusion::ConstNode* constant = dynamic_cast<BetterFusion::ConstNode*>(node)) {
+                return module->make<ConstNode>(constant->value);
+            }
+            if (dynamic_cast<Simplest::ArgNode*>(node) || dynamic_cast<BetterFusion::ArgNode*>(node)) {
+                return module->make<ArgNode>();
+            }
+            if (Simplest::AddNode* add = dynamic_cast<Simplest::AddNode*>(node)) {
+                return binary<Composed::OpAdd>(add);
+            }
+            if (Simplest::SubNode* sub = dynamic_cast<Simplest::SubNode*>(node)) {
+                return binary<Composed::OpSub>(sub);
+            }
+            if (Simplest::LessNode* less = dynamic_cast<Simplest::LessNode*>(node)) {
+                return binary<Composed::OpLess>(less);
+            }
+            if (BetterFusion::SubArgConstNode* sub = dynamic_cast<BetterFusion::SubArgConstNode*>(node)) {
+                return binary<Composed::OpSub>(sub);
+            }
+            if (BetterFusion::LessArgConstNode* less = dynamic_cast<BetterFusion::LessArgConstNode*>(node)) {
+                return binary<Composed::OpLess>(less);
+            }
+            if (SimplifyCalls::IfElseNode* ifElse = dynamic_cast<SimplifyCalls::IfElseNode*>(node)) {
+                IfElseNode* batch = module->make<IfElseNode>(nullptr, nullptr, nullptr);
+                translated[node] = batch;
+                batch->condition = translate(ifElse->condition);
+                batch->ifBody = translate(ifElse->ifBody);
+                batch->elseBody = translate(ifElse->elseBody);
+                return batch->condition && batch->ifBody && batch->elseBody ? batch : 0;
+            }
+            if (SimplifyCalls::CallAnyNode* call = dynamic_cast<SimplifyCalls::CallAnyNode*>(node)) {
+                CallNode* batch = module->make<CallNode>(nullptr, nullptr);
+                translated[node] = batch;
+                batch->function = translate(call->function);
+                batch->arg = translate(call->arg);
+                return batch->function && batch->arg ? batch : 0;
+            }
+            return 0;
+        }
+    };
+
+    // Calls function with each of args, width at a time, and stores the
+    // results. A partial last batch runs with its missing lanes masked off.
+    void run(Node* function, const uint32_t* args, uint32_t* results, uint32_t count, Context* ctx) {
+        for (uint32_t start = 0; start < count; start += width) {
+            uint32_t used = count - start < width ? count - start : width;
+
+            Lanes lanes = {};
+            Mask mask = {};
+            for (uint32_t i = 0; i < used; i++) {
+                lanes.v[i] = args[start + i];
+                mask.v[i] = 0xffffffffu;
+            }
+
+            Lanes out;
+            ctx->stack.push_back(lanes);
+            function->eval(ctx, mask, &out);
+            ctx->stack.pop_back();
+
+            for (uint32_t i = 0; i < used; i++) {
+                results[start + i] = out.v[i];
+            }
+        }
+    }
+
+    // SimplifyCalls::fib's tree over n, n - 1, ..., one batch wide
+    uint32_t fib(uint32_t n) {
+        Module module;
+
+        SimplifyCalls::IfElseNode* function = SimplifyCalls::buildFib(&module);
+
+        Translator translator(&module);
+        Batch::Node* batch = translator.translate(function);
+        if (!batch) {
+            return 0;
+        }
+
+        uint32_t args[width];
+        uint32_t results[width];
+        for (uint32_t i = 0; i < width; i++) {
+            args[i] = n > i ? n - i : 0;
+        }
+
+        Batch::Context ctx;
+        run(batch, args, results, width, &ctx);
+
+        return results[0];
+    }
+}
+
+uint32_t fib(uint32_t n) {
+    if (n < 2) {
+        return n;
+    }
+    return fib(n - 1) + fib(n - 2);
+}
+
+// Hardware counters for the benchmark harness, compiled in with PERF_COUNTERS.
+// Events the kernel or CPU won't give us are reported as unavailable.
+#if defined(PERF_COUNTERS)
+namespace Counters {
+    enum Event {
+        EVENT_INSTRUCTIONS,
+        EVENT_BRANCH_MISSES,
+        EVENT_L1I_MISSES,
+        EVENT_L1D_MISSES,
+        NUM_EVENTS
+    };
+
+    const char* eventNames[NUM_EVENTS] = {
+        "instructions", "branch_misses", "l1i_misses", "l1d_misses"
+    };
+
+    struct Sample {
+        bool valid[NUM_EVENTS];
+        uint64_t values[NUM_EVENTS];
+        // Counted only part of the time, and scaled up to all of it
+        bool scaled;
+    };
+
+#if defined(__linux__)
+    // One perf group, so every event counts exactly the same interval and
+    // the kernel schedules them together or not at all. The first event
+    // that opens leads. If the PMU has to multiplex the group with other
+    // users, the counts are scaled up to the time the group was enabled.
+    // Events count this thread only: perf can't read a group that also
+    // follows new threads (inherit), so workers a strategy starts are missed.
+    struct Group {
+        int fds[NUM_EVENTS];
+        int leader;
+        // Events in the order the group reads them back
+        uint32_t order[NUM_EVENTS];
+        uint32_t numOpen;
+
+        Group() : leader(-1), numOpen(0) {
+            static const uint32_t types[NUM_EVENTS] = {
+                PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_HW_CACHE
+            };
+            static const uint64_t configs[NUM_EVENTS] = {
+                PERF_COUNT_HW_INSTRUCTIONS,
+                PERF_COUNT_HW_BRANCH_MISSES,
+                PERF_COUNT_HW_CACHE_L1I | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+                PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+            };
+
+            for (uint32_t i = 0; i < NUM_EVENTS; i++) {
+                perf_event_attr attr;
+                memset(&attr, 0, sizeof(attr));
+                attr.size = sizeof(attr);
+                attr.type = types[i];
+                attr.config = configs[i];
+                attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+                // Members follow the leader, which starts disabled
+                attr.disabled = leader < 0;
+                attr.exclude_kernel = 1;
+                attr.exclude_hv = 1;
+
+                // This thread, any CPU
+                fds[i] = (int) syscall(__NR_perf_event_open, &attr, 0, -1, leader, 0);
+                if (fds[i] >= 0) {
+                    leader = leader < 0 ? fds[i] : leader;
+                    order[numOpen++] = i;
+                }
+            }
+
+            if (leader < 0) {
+                fprintf(stderr, "perf_event_open failed, hardware counters unavailable "
+                    "(check /proc/sys/kernel/perf_event_paranoid)\n");
+            }
+        }
+
+        ~Group() {
+            for (uint32_t i = 0; i < NUM_EVENTS; i++) {
+                if (fds[i] >= 0) {
+                    close(fds[i]);
+                }
+            }
+        }
+
+        void start() {
+            if (leader >= 0) {
+                ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+                ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+            }
+        }
+
+        Sample stop() {
+            Sample sample;
+            memset(&sample, 0, sizeof(sample));
+
+            if (leader < 0) {
+                return sample;
+            }
+
+            ioctl(leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+
+            // nr, time enabled, time running, then a value per member
+            uint64_t data[3 + NUM_EVENTS];
+            ssize_t size = (ssize_t) ((3 + numOpen) * sizeof(uint64_t));
+
+            if (read(leader, data, (size_t) size) != size || data[0] != numOpen || !data[2]) {
+                return sample;
+            }
+
+            sample.scaled = data[2] < data[1];
+
+            for (uint32_t i = 0; i < numOpen; i++) {
+                uint64_t value = data[3 + i];
+                if (sample.scaled) {
+                    value = (uint64_t) ((double) value * data[1] / data[2]);
+                }
+                sample.valid[order[i]] = true;
+                sample.values[order[i]] = value;
+            }
+
+            return sample;
+        }
+    };
+#else
+    struct Group {
+        Group() {
+            fprintf(stderr, "hardware counters are only supported on Linux\n");
+        }
+
+        void start() {}
+
+        Sample stop() {
+            Sample sample;
+            memset(&sample, 0, sizeof(sample));
+            return sample;
+        }
+    };
+#endif
+
+    Group& group() {
+        static Group group;
+        return group;
+    }
+}
+#endif
+
+namespace Benchmark {
+    // Evals per call describe how much dispatch each strategy does for fib:
+    // root covers the outermost call site, leaf a call with n < 2, and inner
+    // any other call including its two call sites. For tree walkers this is
+    // the number of virtual eval() calls, for bytecode the number of dispatches.
+    // Loop strategies (and tail_calls, whose one call loops on its tail
+    // calls) instead make one call with n iterations, each costing
+    // iterationEvals; at fib's sizes their time is mostly setup. The counts
+    // are read off each strategy's tree by hand, not measured, and strategies
+    // without one (all zero: native, jit, tiered, and those that don't make
+    // fib's calls once each: image runs it twice, memoize skips repeats,
+    // serving answers many requests and batch runs lanes) report no evals.
+    struct Strategy {
+        const char* name;
+        uint32_t (*fib)(uint32_t n);
+        uint32_t rootEvals;
+        uint32_t leafEvals;
+        uint32_t innerEvals;
+        uint32_t iterationEvals;
+        // Does part of the work on threads of its own, which hardware
+        // counters don't see
+        bool threaded;
+    };
+
+    const Strategy strategies[] = {
+        { "baseline", ::fib, 0, 0, 0, 0, false },
+        { "simplest", Simplest::fib, 2, 6, 14, 0, false },
+        { "simple_fusion", SimpleFusion::fib, 2, 5, 11, 0, false },
+        { "better_fusion", BetterFusion::fib, 2, 4, 8, 0, false },
+        { "simplify_calls", SimplifyCalls::fib, 2, 3, 7, 0, false },
+        { "auto_fusion", AutoFusion::fib, 2, 4, 8, 0, false },
+        { "composed", Composed::fib, 2, 4, 8, 0, false },
+        { "quickening", Quickening::fib, 2, 4, 8, 0, false },
+        { "folding", Folding::fib, 2, 4, 8, 0, false },
+        { "bytecode", Bytecode::fib, 2, 5, 8, 0, false },
+        { "register_vm", RegisterVM::fib, 2, 2, 7, 0, false },
+        { "jit", Jit::fib, 0, 0, 0, 0, false },
+        { "tiered", Tiering::fib, 0, 0, 0, 0, false },
+        { "image", Image::fib, 0, 0, 0, 0, false },
+        { "tagged", Tagged::fib, 0, 3, 7, 0, false },
+        { "tagged_table", Tagged::tableFib, 0, 3, 7, 0, false },
+        { "values", Values::fib, 2, 3, 7, 0, false },
+        { "frames", Frames::fib, 2, 3, 7, 0, false },
+        { "statements", Statements::fib, 2, 3, 7, 0, false },
+        { "inline_caching", InlineCaching::fib, 2, 2, 6, 0, false },
+        { "memoize", Memoization::fib, 0, 0, 0, 0, false },
+        { "tail_calls", TailCalls::fib, 7, 0, 0, 6, false },
+        { "parallel", Parallel::fib, 2, 3, 7, 0, true },
+        { "serving", Serving::fib, 0, 0, 0, 0, true },
+        { "batch", Batch::fib, 0, 0, 0, 0, false },
+        { "loop", Loops::fib, 11, 0, 0, 13, false },
+        { "fused_loop", Loops::fusedFib, 7, 0, 0, 5, false },
+    };
+
+    const uint32_t numStrategies = sizeof(strategies) / sizeof(strategies[0]);
+
+    struct Options {
+        uint32_t minN;
+        uint32_t maxN;
+        uint32_t warmup;
+        uint32_t runs;
+        const char* format;
+        const char* only;
+        // With --threads, only the parallel strategy runs, once per count
+        std::vector<uint32_t> threads;
+
+        Options() : minN(30), maxN(30), warmup(1), runs(5), format("table"), only(0) {}
+    };
+
+    struct Result {
+        const Strategy* strategy;
+        uint32_t n;
+        uint32_t value;
+        bool correct;
+        double medianMs;
+        double p95Ms;
+        double minMs;
+        // The very first call, before any warmup: time to first result
+        double firstMs;
+        uint64_t calls;
+        uint64_t evals;
+        // Whether evals comes from a model, see Strategy
+        bool modelled;
+#if defined(PERF_COUNTERS)
+        // One extra run, measured separately so counting doesn't skew timings
+        Counters::Sample counters;
+#endif
+    };
+
+    // Calls made by fib(n), and how many of them are leaves.
+    void countCalls(uint32_t n, uint64_t* calls, uint64_t* leaves) {
+        uint64_t c0 = 1, c1 = 1, l0 = 1, l1 = 1;
+
+        for (uint32_t i = 2; i <= n; i++) {
+            uint64_t c = 1 + c1 + c0;
+            uint64_t l = l1 + l0;
+            c0 = c1;
+            c1 = c;
+            l0 = l1;
+            l1 = l;
+        }
+
+        *calls = c1;
+        *leaves = l1;
+    }
+
+    bool selected(const Options& options, const char* name) {
+        if (!options.only) {
+            return true;
+        }
+
+        size_t length = strlen(name);
+
+        for (const char* p = options.only; (p = strstr(p, name)) != 0; p += length) {
+            bool startsItem = p == options.only || p[-1] == ',';
+            bool endsItem = p[length] == 0 || p[length] == ',';
+            if (startsItem && endsItem) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    // Fills in the result's value, the time of a first cold call, and
+    // timings from the runs after warmup
+    template<typename Call>
+    void time(const Options& options, Call call, Result* result) {
+        std::chrono::steady_clock::time_point first = std::chrono::steady_clock::now();
+        result->value = call();
+        result->firstMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - first).count();
+
+        for (uint32_t i = 0; i < options.warmup; i++) {
+            result->value = call();
+        }
+
+        std::vector<double> times;
+
+        for (uint32_t i = 0; i < options.runs; i++) {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            result->value = call();
+            std::chrono::steady_clock::time_point stop = std::chrono::steady_clock::now();
+
+            times.push_back(std::chrono::duration<double, std::milli>(stop - start).count());
+        }
+
+        std::sort(times.begin(), times.end());
+
+        // Nearest-rank percentiles
+        result->minMs = times[0];
+        result->medianMs = times[(times.size() - 1) / 2];
+        result->p95Ms = times[(times.size() * 95 + 99) / 100 - 1];
+        result->correct = result->value == ::fib(result->n);
+    }
+
+    Result measure(const Strategy& strategy, uint32_t n, const Options& options) {
+        Result result;
+        result.strategy = &strategy;
+        result.n = n;
+
+        time(options, [&]() { return strategy.fib(n); }, &result);
+
+#if defined(PERF_COUNTERS)
+        Counters::group().start();
+        strategy.fib(n);
+        result.counters = Counters::group().stop();
+#endif
+
+        result.modelled = strategy.rootEvals || strategy.leafEvals
+            || strategy.innerEvals || strategy.iterationEvals;
+
+        if (strategy.iterationEvals) {
+            result.calls = 1;
+            result.evals = strategy.rootEvals + (uint64_t) n * strategy.iterationEvals;
+            return result;
+        }
+
+        uint64_t leaves;
+        countCalls(n, &result.calls, &leaves);
+        result.evals = strategy.rootEvals + leaves * strategy.leafEvals
+            + (result.calls - leaves) * strategy.innerEvals;
+
+        return result;
+    }
+
+    double perSecond(uint64_t count, double ms) {
+        return ms > 0 ? count / (ms / 1000.0) : 0;
+    }
+
+    bool isFormat(const Options& options, const char* format) {
+        return strcmp(options.format, format) == 0;
+    }
+
+    void printHeader(const Options& options) {
+        if (isFormat(options, "csv")) {
+            printf("strategy,n,runs,median_ms,p95_ms,min_ms,first_ms,calls,node_evals,evals_per_sec,calls_per_sec,result,correct");
+#if defined(PERF_COUNTERS)
+            for (uint32_t i = 0; i < Counters::NUM_EVENTS; i++) {
+                printf(",%s", Counters::eventNames[i]);
+            }
+            printf(",indirect_calls,branch_misses_per_call,counters_scaled,counters_calling_thread_only");
+#endif
+            printf("\n");
+        }
+        else if (isFormat(options, "json")) {
+            printf("[");
+        }
+        else {
+            printf("%-16s %4s %12s %12s %12s %12s %14s %14s %10s",
+                "strategy", "n", "median ms", "p95 ms", "min ms", "first ms", "evals/s", "calls/s", "result");
+#if defined(PERF_COUNTERS)
+            printf(" %14s %14s %12s %12s %14s %12s",
+                "instructions", "br misses", "L1i misses", "L1d misses", "indirect", "misses/call");
+#endif
+            printf("\n");
+        }
+    }
+
+#if defined(PERF_COUNTERS)
+    // Indirect calls come from the eval model rather than the PMU: every
+    // virtual eval() (or threaded dispatch) is one indirect branch.
+    void printCounters(const Options& options, const Result& result) {
+        const Counters::Sample& sample = result.counters;
+        bool hasMisses = sample.valid[Counters::EVENT_BRANCH_MISSES];
+        double missesPerCall = (double) sample.values[Counters::EVENT_BRANCH_MISSES] / result.calls;
+
+        for (uint32_t i = 0; i < Counters::NUM_EVENTS; i++) {
+            unsigned long long value = (unsigned long long) sample.values[i];
+
+            if (isFormat(options, "csv")) {
+                sample.valid[i] ? printf(",%llu", value) : printf(",");
+            }
+            else if (isFormat(options, "json")) {
+                sample.valid[i]
+                    ? printf(", \"%s\": %llu", Counters::eventNames[i], value)
+                    : printf(", \"%s\": null", Counters::eventNames[i]);
+            }
+            else {
+                int width = i < 2 ? 14 : 12;
+                sample.valid[i] ? printf(" %*llu", width, value) : printf(" %*s", width, "n/a");
+            }
+        }
+
+        unsigned long long indirect = (unsigned long long) result.evals;
+
+        const char* scaled = sample.scaled ? "true" : "false";
+        const char* threadOnly = result.strategy->threaded ? "true" : "false";
+
+        if (isFormat(options, "csv")) {
+            result.modelled ? printf(",%llu", indirect) : printf(",");
+            hasMisses ? printf(",%.4f", missesPerCall) : printf(",");
+            printf(",%s,%s", scaled, threadOnly);
+        }
+        else if (isFormat(options, "json")) {
+            result.modelled ? printf(", \"indirect_calls\": %llu", indirect) : printf(", \"indirect_calls\": null");
+            hasMisses
+                ? printf(", \"branch_misses_per_call\": %.4f", missesPerCall)
+                : printf(", \"branch_misses_per_call\": null");
+            printf(", \"counters_scaled\": %s, \"counters_calling_thread_only\": %s", scaled, threadOnly);
+        }
+        else {
+            result.modelled ? printf(" %14llu", indirect) : printf(" %14s", "-");
+            hasMisses ? printf(" %12.4f", missesPerCall) : printf(" %12s", "n/a");
+            printf("%s%s", sample.scaled ? " (scaled)" : "", result.strategy->threaded ? " (calling thread only)" : "");
+        }
+    }
+#endif
+
+    void printResult(const Options& options, const Result& result, bool first) {
+        double evalsPerSecond = perSecond(result.evals, result.medianMs);
+        double callsPerSecond = perSecond(result.calls, result.medianMs);
+
+        unsigned long long evals = (unsigned long long) result.evals;
+
+        if (isFormat(options, "csv")) {
+            printf("%s,%u,%u,%.3f,%.3f,%.3f,%.3f,%llu,",
+                result.strategy->name, result.n, options.runs,
+                result.medianMs, result.p95Ms, result.minMs, result.firstMs,
+                (unsigned long long) result.calls);
+            result.modelled ? printf("%llu,%.0f", evals, evalsPerSecond) : printf(",");
+            printf(",%.0f,%u,%s", callsPerSecond, result.value, result.correct ? "true" : "false");
+        }
+        else if (isFormat(options, "json")) {
+            printf("%s\n  {\"strategy\": \"%s\", \"n\": %u, \"runs\": %u, "
+                "\"median_ms\": %.3f, \"p95_ms\": %.3f, \"min_ms\": %.3f, \"first_ms\": %.3f, "
+                "\"calls\": %llu, ",
+                first ? "" : ",", result.strategy->name, result.n, options.runs,
+                result.medianMs, result.p95Ms, result.minMs, result.firstMs,
+                (unsigned long long) result.calls);
+            result.modelled
+                ? printf("\"node_evals\": %llu, \"evals_per_sec\": %.0f, ", evals, evalsPerSecond)
+                : printf("\"node_evals\": null, \"evals_per_sec\": null, ");
+            printf("\"calls_per_sec\": %.0f, \"result\": %u, \"correct\": %s",
+                callsPerSecond, result.value, result.correct ? "true" : "false");
+        }
+        else {
+            printf("%-16s %4u %12.3f %12.3f %12.3f %12.3f",
+                result.strategy->name, result.n, result.medianMs, result.p95Ms, result.minMs, result.firstMs);
+            result.modelled ? printf(" %14.4g", evalsPerSecond) : printf(" %14s", "-");
+            printf(" %14.4g %10u", callsPerSecond, result.value);
+        }
+
+#if defined(PERF_COUNTERS)
+        printCounters(options, result);
+#endif
+
+        if (isFormat(options, "json")) {
+            printf("}");
+        }
+        else {
+            printf(isFormat(options, "csv") || result.correct ? "\n" : " (WRONG)\n");
+        }
+    }
+
+    void printFooter(const Options& options) {
+        if (isFormat(options, "json")) {
+            printf("\n]\n");
+        }
+        else if (!isFormat(options, "csv")) {
+#if defined(PERF_COUNTERS)
+            printf("evals/s and indirect are modelled from each strategy's eval counts, not measured; - has no model\n");
+#else
+            printf("evals/s is modelled from each strategy's eval counts, not measured; - has no model\n");
+#endif
+            printf("calls/s counts one fib(n)'s calls, though image runs it twice, memoize skips repeated calls,\n"
+                "serving answers 32 requests on 4 threads and batch computes 8 results at once\n");
+        }
+    }
+
+    // Parallel::fib for each thread count, with speedup over the first count
+    bool runScaling(const Options& options) {
+        bool first = true;
+        bool allCorrect = true;
+
+        if (isFormat(options, "csv")) {
+            printf("threads,n,runs,median_ms,p95_ms,min_ms,speedup,efficiency,result,correct\n");
+        }
+        else if (isFormat(options, "json")) {
+            printf("[");
+        }
+        else {
+            printf("%7s %4s %12s %12s %12s %8s %10s %10s\n",
+                "threads", "n", "median ms", "p95 ms", "min ms", "speedup", "efficiency", "result");
+        }
+
+        for (uint32_t n = options.minN; n <= options.maxN; n++) {
+            double referenceMs = 0;
+
+            for (uint32_t threads : options.threads) {
+                Result result;
+                result.strategy = 0;
+                result.n = n;
+
+                time(options, [&]() { return Parallel::fib(n, threads); }, &result);
+
+                if (referenceMs == 0) {
+                    referenceMs = result.medianMs;
+                }
+
+                double speedup = result.medianMs > 0 ? referenceMs / result.medianMs : 0;
+                double efficiency = speedup * options.threads[0] / threads;
+
+                if (isFormat(options, "csv")) {
+                    printf("%u,%u,%u,%.3f,%.3f,%.3f,%.3f,%.3f,%u,%s\n",
+                        threads, n, options.runs, result.medianMs, result.p95Ms, result.minMs,
+                        speedup, efficiency, result.value, result.correct ? "true" : "false");
+                }
+                else if (isFormat(options, "json")) {
+                    printf("%s\n  {\"threads\": %u, \"n\": %u, \"runs\": %u, "
+                        "\"median_ms\": %.3f, \"p95_ms\": %.3f, \"min_ms\": %.3f, "
+                        "\"speedup\": %.3f, \"efficiency\": %.3f, \"result\": %u, \"correct\": %s}",
+                        first ? "" : ",", threads, n, options.runs, result.medianMs, result.p95Ms, result.minMs,
+                        speedup, efficiency, result.value, result.correct ? "true" : "false");
+                }
+                else {
+                    printf("%7u %4u %12.3f %12.3f %12.3f %7.2fx %10.2f %10u%s\n",
+                        threads, n, result.medianMs, result.p95Ms, result.minMs,
+                        speedup, efficiency, result.value, result.correct ? "" : " (WRONG)");
+                }
+                fflush(stdout);
+
+                first = false;
+                allCorrect = allCorrect && result.correct;
+            }
+        }
+
+        if (isFormat(options, "json")) {
+            printf("\n]\n");
+        }
+
+        return allCorrect;
+    }
+
+    // Comma-separated thread counts, each at least 1
+    bool parseThreads(const char* value, std::vector<uint32_t>* threads) {
+        threads->clear();
+
+        for (const char* p = value; *p; ) {
+            char* end;
+            unsigned long count = strtoul(p, &end, 10);
+
+            if (end == p || count == 0 || (*end != ',' && *end != 0)) {
+                return false;
+            }
+
+            threads->push_back((uint32_t) count);
+            p = *end ? end + 1 : end;
+        }
+
+        return !threads->empty();
+    }
+
+    void usage() {
+        fprintf(stderr,
+            "usage: oif [--n N | --min N --max N] [--runs R] [--warmup W]\n"
+            "           [--format table|csv|json] [--only name,name,...]\n"
+            "           [--threads T,T,...]  (parallel speedup over the first count)\n"
+            "strategies:");
+        for (uint32_t i = 0; i < numStrategies; i++) {
+            fprintf(stderr, " %s", strategies[i].name);
+        }
+        fprintf(stderr, "\n");
+    }
+
+    bool parse(int argc, const char** argv, Options* options) {
+        for (int i = 1; i < argc; i++) {
+            const char* arg = argv[i];
+            const char* value = i + 1 < argc ? argv[i + 1] : 0;
+
+            if (!value) {
+                return false;
+            }
+
+            if (strcmp(arg, "--n") == 0) {
+                options->minN = options->maxN = (uint32_t) atoi(value);
+            }
+            else if (strcmp(arg, "--min") == 0) {
+                options->minN = (uint32_t) atoi(value);
+            }
+            else if (strcmp(arg, "--max") == 0) {
+                options->maxN = (uint32_t) atoi(value);
+            }
+            else if (strcmp(arg, "--runs") == 0) {
+                options->runs = (uint32_t) atoi(value);
+            }
+            else if (strcmp(arg, "--warmup") == 0) {
+                options->warmup = (uint32_t) atoi(value);
+            }
+            else if (strcmp(arg, "--format") == 0) {
+                options->format = value;
+            }
+            else if (strcmp(arg, "--only") == 0) {
+                options->only = value;
+            }
+            else if (strcmp(arg, "--threads") == 0) {
+                if (!parseThreads(value, &options->threads)) {
+                    return false;
+                }
+            }
+            else {
+                return false;
+            }
+            i++;
+        }
+
+        return options->runs > 0 && options->minN <= options->maxN;
+    }
+
+    int run(int argc, const char** argv) {
+        Options options;
+
+        if (!parse(argc, argv, &options)) {
+            usage();
+            return 1;
+        }
+
+        if (!options.threads.empty()) {
+            return runScaling(options) ? 0 : 1;
+        }
+
+        bool first = true;
+        bool allCorrect = true;
+
+        printHeader(options);
+
+        for (uint32_t n = options.minN; n <= options.maxN; n++) {
+            for (uint32_t i = 0; i < numStrategies; i++) {
+                if (!selected(options, strategies[i].name)) {
+                    continue;
+                }
+
+                Result result = measure(strategies[i], n, options);
+                printResult(options, result, first);
+                fflush(stdout);
+
+                first = false;
+                allCorrect = allCorrect && result.correct;
+            }
+        }
+
+        printFooter(options);
+
+        return allCorrect ? 0 : 1;
+    }
+}
+
+// Loads fib.das-style scripts into Simplest trees:
+//
+//     def fib(n)
+//         if (n < 2)
+//             return n
+//         return fib(n - 1) + fib(n - 2)
+//
+//     def main
+//         print("{fib(42)}")
+//
+// Blocks are indented, `//` starts a comment, and [annotations] and type
+// annotations are skipped. Functions take zero or one argument, as Simplest
+// calls do. Expressions have +, -, <, > and calls; print() takes a string
+// with {expression} holes. The script starts at main.
+namespace Script {
+    using namespace Simplest;
+    using SimplifyCalls::IfElseNode;
+
+    struct Line {
+        uint32_t number;
+        uint32_t indent;
+        std::string text;
+    };
+
+    struct Definition {
+        std::string name;
+        std::string param;
+        bool hasParam;
+        uint32_t header;
+        uint32_t bodyEnd;
+        Function* function;
+    };
+
+    struct Parser {
+        Module* module;
+        const char* path;
+        std::vector<Line> lines;
+        std::vector<Definition> definitions;
+        const Definition* current;
+        const char* cursor;
+        uint32_t lineNumber;
+        char error[256];
+
+        Parser(Module* module, const char* path)
+            : module(module), path(path), current(0), cursor(0), lineNumber(0) {
+            error[0] = 0;
+        }
+
+        bool fail(const char* format, ...) {
+            int length = snprintf(error, sizeof(error), "%s:%u: ", path, lineNumber);
+
+            va_list args;
+            va_start(args, format);
+            vsnprintf(error + length, sizeof(error) - length, format, args);
+            va_end(args);
+            return false;
+        }
+
+        // Splits the source into non-blank lines, without comments and
+        // without annotation lines
+        void split(const std::string& source) {
+            uint32_t number = 0;
+            size_t start = 0;
+
+            while (start < source.size()) {
+                size_t end = source.find('\n', start);
+                if (end == std::string::npos) {
+                    end = source.size();
+                }
+                number++;
+
+                std::string text = source.substr(start, end - start);
+                start = end + 1;
+
+                bool inString = false;
+                for (size_t i = 0; i < text.size(); i++) {
+                    if (text[i] == '"' && (i == 0 || text[i - 1] != '\\')) {
+                        inString = !inString;
+                    }
+                    if (!inString && text.compare(i, 2, "//") == 0) {
+                        text.resize(i);
+                        break;
+                    }
+                }
+
+                uint32_t indent = 0;
+                size_t first = 0;
+                for (; first < text.size() && (text[first] == ' ' || text[first] == '\t'); first++) {
+                    indent = text[first] == '\t' ? (indent / 4 + 1) * 4 : indent + 1;
+                }
+
+                size_t last = text.find_last_not_of(" \t\r");
+                if (last == std::string::npos || text[first] == '[') {
+                    continue;
+                }
+
+                lines.push_back({ number, indent, text.substr(first, last + 1 - first) });
+            }
+        }
+
+        void skipSpaces() {
+            while (*cursor == ' ' || *cursor == '\t') {
+                cursor++;
+            }
+        }
+
+        bool atEnd() {
+            skipSpaces();
+            return *cursor == 0;
+        }
+
+        bool accept(char c) {
+            skipSpaces();
+            if (*cursor != c) {
+                return false;
+            }
+            cursor++;
+            return true;
+        }
+
+        bool expect(char c) {
+            return accept(c) || fail("expected '%c'", c);
+        }
+
+        static bool isNameStart(char c) {
+            return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+        }
+
+        static bool isNameChar(char c) {
+            return isNameStart(c) || (c >= '0' && c <= '9');
+        }
+
+        bool name(std::string* out) {
+            skipSpaces();
+            if (!isNameStart(*cursor)) {
+                return false;
+            }
+            const char* start = cursor;
+            while (isNameChar(*cursor)) {
+                cursor++;
+            }
+            out->assign(start, cursor);
+            return true;
+        }
+
+        // Consumes `word` if it's the next whole word
+        bool keyword(const char* word) {
+            skipSpaces();
+            size_t length = strlen(word);
+            if (strncmp(cursor, word, length) != 0 || isNameChar(cursor[length])) {
+                return false;
+            }
+            cursor += length;
+            return true;
+        }
+
+        // `: type`, which we don't check
+        void skipType() {
+            std::string type;
+            if (accept(':')) {
+                name(&type);
+            }
+        }
+
+        const Definition* find(const std::string& name) {
+            for (const Definition& definition : definitions) {
+                if (definition.name == name) {
+                    return &definition;
+                }
+            }
+            return 0;
+        }
+
+        const char* copy(const std::string& text) {
+            char* result = module->array<char>((uint32_t) text.size() + 1);
+            memcpy(result, text.c_str(), text.size() + 1);
+            return result;
+        }
+
+        Node* sequence(const std::vector<Node*>& statements) {
+            Node* result = statements.back();
+            for (size_t i = statements.size() - 1; i-- > 0; ) {
+                result = module->make<SeqNode>(statements[i], result);
+            }
+            return result;
+        }
+
+        bool parsePrimary(Node** out) {
+            skipSpaces();
+
+            if (*cursor >= '0' && *cursor <= '9') {
+                uint32_t value = 0;
+                while (*cursor >= '0' && *cursor <= '9') {
+                    value = value * 10 + (uint32_t) (*cursor++ - '0');
+                }
+                *out = module->make<ConstNode>(value);
+                return true;
+            }
+            if (accept('(')) {
+                return parseExpression(out) && expect(')');
+            }
+            if (accept('-')) {
+                Node* operand;
+                if (!parsePrimary(&operand)) {
+                    return false;
+                }
+                *out = module->make<SubNode>(module->make<ConstNode>(0), operand);
+                return true;
+            }
+
+            std::string identifier;
+            if (!name(&identifier)) {
+                return fail("expected an expression");
+            }
+
+            if (accept('(')) {
+                const Definition* callee = find(identifier);
+                if (!callee) {
+                    return fail("unknown function '%s'", identifier.c_str());
+                }
+
+                Node* arg = 0;
+                if (!accept(')')) {
+                    if (!parseExpression(&arg) || !expect(')')) {
+                        return false;
+                    }
+                }
+                if ((arg != 0) != callee->hasParam) {
+                    return fail("'%s' takes %u argument%s", identifier.c_str(),
+                        callee->hasParam ? 1 : 0, callee->hasParam ? "" : "s");
+                }
+
+                // Calls always push an argument, so argument-less ones push 0
+                *out = module->make<CallNode>(callee->function, arg ? arg : module->make<ConstNode>(0));
+                return true;
+            }
+
+            if (!current->hasParam || identifier != current->param) {
+                return fail("unknown name '%s'", identifier.c_str());
+            }
+            *out = module->make<ArgNode>();
+            return true;
+        }
+
+        bool parseSum(Node** out) {
+            if (!parsePrimary(out)) {
+                return false;
+            }
+            for (;;) {
+                Node* rhs;
+                if (accept('+')) {
+                    if (!parsePrimary(&rhs)) {
+                        return false;
+                    }
+                    *out = module->make<AddNode>(*out, rhs);
+                }
+                else if (accept('-')) {
+                    if (!parsePrimary(&rhs)) {
+                        return false;
+                    }
+                    *out = module->make<SubNode>(*out, rhs);
+                }
+                else {
+                    return true;
+                }
+            }
+        }
+
+        // There is only LessNode, so `a > b` becomes `b < a`, evaluating b first
+        bool parseExpression(Node** out) {
+            if (!parseSum(out)) {
+                return false;
+            }
+            Node* rhs;
+            if (accept('<')) {
+                if (!parseSum(&rhs)) {
+                    return false;
+                }
+                *out = module->make<LessNode>(*out, rhs);
+            }
+            else if (accept('>')) {
+                if (!parseSum(&rhs)) {
+                    return false;
+                }
+                *out = module->make<LessNode>(rhs, *out);
+            }
+            return true;
+        }
+
+        // print("text {expression} text"), one PrintNode per hole
+        bool parsePrint(Node** out) {
+            if (!expect('(') || !expect('"')) {
+                return false;
+            }
+
+            std::vector<Node*> parts;
+            std::string text;
+
+            for (;;) {
+                char c = *cursor++;
+
+                if (c == 0) {
+                    return fail("unterminated string");
+                }
+                if (c == '"') {
+                    break;
+                }
+                if (c == '\\') {
+                    c = *cursor++;
+                    if (c == 0) {
+                        return fail("unterminated string");
+                    }
+                    text += c == 'n' ? '\n' : c == 't' ? '\t' : c;
+                    continue;
+                }
+                if (c == '{') {
+                    Node* value;
+                    if (!parseExpression(&value) || !expect('}')) {
+                        return false;
+                    }
+                    parts.push_back(module->make<PrintNode>(copy(text), value));
+                    text.clear();
+                    continue;
+                }
+                text += c;
+            }
+
+            if (!expect(')')) {
+                return false;
+            }
+
+            parts.push_back(module->make<PrintNode>(copy(text + "\n"), (Node*) 0));
+            *out = sequence(parts);
+            return true;
+        }
+
+        bool parseStatement(uint32_t* i, uint32_t end, Node** out) {
+            const Line& line = lines[*i];
+            uint32_t indent = line.indent;
+
+            lineNumber = line.number;
+            cursor = line.text.c_str();
+            (*i)++;
+
+            if (keyword("if")) {
+                Node* condition;
+                Node* body;
+                if (!parseExpression(&condition) || !endOfLine() || !parseBlock(i, end, indent, &body)) {
+                    return false;
+                }
+
+                if (*i < end && lines[*i].indent == indent && lines[*i].text == "else") {
+                    Node* elseBody;
+                    (*i)++;
+                    if (!parseBlock(i, end, indent, &elseBody)) {
+                        return false;
+                    }
+                    *out = module->make<IfElseNode>(condition, body, elseBody);
+                    return true;
+                }
+
+                *out = module->make<IfNode>(condition, body);
+                return true;
+            }
+            if (keyword("return")) {
+                Node* value = 0;
+                if (!atEnd() && !parseExpression(&value)) {
+                    return false;
+                }
+                *out = module->make<ReturnNode>(value ? value : module->make<ConstNode>(0));
+                return endOfLine();
+            }
+            if (keyword("print")) {
+                return parsePrint(out) && endOfLine();
+            }
+            return parseExpression(out) && endOfLine();
+        }
+
+        bool endOfLine() {
+            return atEnd() || fail("unexpected '%s'", cursor);
+        }
+
+        bool parseStatements(uint32_t* i, uint32_t end, uint32_t indent, std::vector<Node*>* out) {
+            while (*i < end && lines[*i].indent >= indent) {
+                if (lines[*i].indent > indent) {
+                    lineNumber = lines[*i].number;
+                    return fail("unexpected indent");
+                }
+                Node* statement;
+                if (!parseStatement(i, end, &statement)) {
+                    return false;
+                }
+                out->push_back(statement);
+            }
+            return true;
+        }
+
+        // The lines after a statement that are indented deeper than it
+        bool parseBlock(uint32_t* i, uint32_t end, uint32_t parentIndent, Node** out) {
+            if (*i >= end || lines[*i].indent <= parentIndent) {
+                return fail("expected an indented block");
+            }
+
+            std::vector<Node*> statements;
+            if (!parseStatements(i, end, lines[*i].indent, &statements)) {
+                return false;
+            }
+            *out = sequence(statements);
+            return true;
+        }
+
+        // def name[(param[: type])][: type]
+        bool parseHeader(Definition* definition) {
+            const Line& line = lines[definition->header];
+
+            lineNumber = line.number;
+            cursor = line.text.c_str();
+
+            if (line.indent != 0 || !keyword("def")) {
+                return fail("expected 'def'");
+            }
+            if (!name(&definition->name)) {
+                return fail("expected a function name");
+            }
+            if (find(definition->name)) {
+                return fail("'%s' is already defined", definition->name.c_str());
+            }
+
+            definition->hasParam = false;
+            if (accept('(') && !accept(')')) {
+                if (!name(&definition->param)) {
+                    return fail("expected a parameter name");
+                }
+                skipType();
+                if (accept(',')) {
+                    return fail("functions take at most one argument");
+                }
+                if (!expect(')')) {
+                    return false;
+                }
+                definition->hasParam = true;
+            }
+            skipType();
+            return endOfLine();
+        }
+
+        bool parse(const std::string& source) {
+            split(source);
+
+            // Headers first, so calls can refer to functions defined later
+            for (uint32_t i = 0; i < lines.size(); ) {
+                Definition definition;
+                definition.header = i;
+                if (!parseHeader(&definition)) {
+                    return false;
+                }
+                for (i++; i < lines.size() && lines[i].indent > 0; i++) {}
+                definition.bodyEnd = i;
+                definition.function = module->make<Function>();
+                definitions.push_back(definition);
+            }
+
+            for (const Definition& definition : definitions) {
+                current = &definition;
+
+                std::vector<Node*> statements;
+                uint32_t i = definition.header + 1;
+                if (i < definition.bodyEnd && !parseStatements(&i, definition.bodyEnd, lines[i].indent, &statements)) {
+                    return false;
+                }
+
+                Function* function = definition.function;
+                function->numNodes = (uint32_t) statements.size();
+                function->body = module->array<Node*>(function->numNodes);
+                for (uint32_t j = 0; j < function->numNodes; j++) {
+                    function->body[j] = statements[j];
+                }
+            }
+            return true;
+        }
+    };
+
+    bool readFile(const char* path, std::string* out) {
+        FILE* file = fopen(path, "rb");
+        if (!file) {
+            return false;
+        }
+
+        char buffer[4096];
+        size_t length;
+
+        while ((length = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+            out->append(buffer, length);
+        }
+
+        fclose(file);
+        return true;
+    }
+
+    double sinceMs(std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    void usage() {
+        fprintf(stderr, "usage: oif [--backend tree|fused|composed|bytecode|register|tiered] [--memoize] script.das\n");
+        fprintf(stderr, "           [--budget CALLS] [--timeout MS]\n");
+#if defined(TRACING)
+        fprintf(stderr, "           [--trace out.json] [--trace-every N]  (tree backends)\n");
+#endif
+    }
+
+    // Runs a script and reports where the time went on stderr, so stdout is
+    // just the script's output
+    int run(int argc, const char** argv) {
+        const char* backend = "fused";
+        const char* path = 0;
+        bool memoize = false;
+        // Calls and loop iterations, and milliseconds; 0 is no limit
+        uint64_t budget = 0;
+        uint32_t timeoutMs = 0;
+#if defined(TRACING)
+        const char* tracePath = 0;
+        uint32_t traceEvery = 1;
+#endif
+
+        for (int i = 1; i < argc; i++) {
+            if (strcmp(argv[i], "--backend") == 0 && i + 1 < argc) {
+                backend = argv[++i];
+            }
+            else if (strcmp(argv[i], "--memoize") == 0) {
+                memoize = true;
+            }
+            else if (strcmp(argv[i], "--budget") == 0 && i + 1 < argc && atoll(argv[i + 1]) > 0) {
+                budget = (uint64_t) atoll(argv[++i]);
+            }
+            else if (strcmp(argv[i], "--timeout") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+                timeoutMs = (uint32_t) atoi(argv[++i]);
+            }
+#if defined(TRACING)
+            else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+                tracePath = argv[++i];
+            }
+            else if (strcmp(argv[i], "--trace-every") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+                traceEvery = (uint32_t) atoi(argv[++i]);
+            }
+#endif
+            else if (argv[i][0] != '-' && !path) {
+                path = argv[i];
+            }
+            else {
+                usage();
+                return 1;
+            }
+        }
+
+        if (!path) {
+            usage();
+            return 1;
+        }
+
+        bool tree = strcmp(backend, "tree") == 0;
+        bool fused = strcmp(backend, "fused") == 0;
+        bool composed = strcmp(backend, "composed") == 0;
+        bool bytecode = strcmp(backend, "bytecode") == 0;
+        bool registers = strcmp(backend, "register") == 0;
+        bool tiered = strcmp(backend, "tiered") == 0;
+
+        if (!tree && !fused && !composed && !bytecode && !registers && !tiered) {
+            fprintf(stderr, "unknown backend '%s'\n", backend);
+            usage();
+            return 1;
+        }
+        if (memoize && (bytecode || registers || tiered)) {
+            fprintf(stderr, "--memoize needs a tree backend\n");
+            return 1;
+        }
+#if defined(TRACING)
+        if (tracePath && (bytecode || registers)) {
+            fprintf(stderr, "--trace needs a tree backend\n");
+            return 1;
+        }
+#endif
+
+        std::string source;
+        if (!readFile(path, &source)) {
+            fprintf(stderr, "%s: can't read file\n", path);
+            return 1;
+        }
+
+        Context ctx;
+        Module module;
+        Parser parser(&module, path);
+#if defined(TRACING)
+        Tracing::Buffer trace(1 << 16, traceEvery);
+        if (tracePath) {
+            ctx.trace = &trace;
+        }
+#endif
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+        if (!parser.parse(source)) {
+            fprintf(stderr, "%s\n", parser.error);
+            return 1;
+        }
+
+        double parseMs = sinceMs(start);
+
+        const Definition* entry = parser.find("main");
+        if (!entry || entry->hasParam) {
+            fprintf(stderr, "%s: expected 'def main' without arguments\n", path);
+            return 1;
+        }
+
+        // The tree backend walks the tree exactly as parsed, the others get
+        // it simplified first so fusion and the compiler see canonical shapes.
+        // Tiered starts from the parsed tree too, since it fuses on its own.
+        uint32_t numFolded = 0;
+        double simplifyMs = 0;
+
+        if (!tree && !tiered) {
+            start = std::chrono::steady_clock::now();
+            for (const Definition& definition : parser.definitions) {
+                numFolded += Folding::simplify(&module, definition.function);
+            }
+            simplifyMs = sinceMs(start);
+        }
+
+        const char* prepareName = 0;
+        double prepareMs = 0;
+        Bytecode::Program program;
+        RegisterVM::Program registerProgram;
+        Tiering::Engine engine(&module);
+        Node* root = 0;
+
+        start = std::chrono::steady_clock::now();
+
+        if (fused || composed) {
+            const AutoFusion::Rule* rules = AutoFusion::defaultRules;
+            uint32_t numRules = AutoFusion::numDefaultRules;
+
+            if (composed) {
+                rules = Composed::rules().data();
+                numRules = (uint32_t) Composed::rules().size();
+            }
+
+            for (const Definition& definition : parser.definitions) {
+                AutoFusion::fuse(&module, definition.function, rules, numRules);
+            }
+            prepareName = "fuse";
+        }
+
+        // After fusion, which doesn't look inside memoized calls. Composed
+        // shapes hide their operands from the purity check, so with that
+        // backend nothing is memoized.
+        uint32_t numMemoized = 0;
+
+        if (memoize) {
+            std::vector<Function*> functions;
+            for (const Definition& definition : parser.definitions) {
+                functions.push_back(definition.function);
+            }
+            numMemoized = Memoization::memoize(&module, functions.data(), (uint32_t) functions.size(), 4096);
+            prepareName = prepareName ? prepareName : "memoize";
+        }
+        else if (bytecode) {
+            Bytecode::Compiler compiler(&program);
+
+            if (!compiler.compile(Bytecode::Compiler::SIMPLEST_FUNCTION, entry->function)) {
+                fprintf(stderr, "%s: bytecode: %s\n", path, compiler.error);
+                return 1;
+            }
+            prepareName = "compile";
+        }
+        else if (registers) {
+            RegisterVM::Compiler compiler(&registerProgram);
+
+            if (!compiler.compile(RegisterVM::Compiler::SIMPLEST_FUNCTION, entry->function)) {
+                fprintf(stderr, "%s: register vm: %s\n", path, compiler.error);
+                return 1;
+            }
+            prepareName = "compile";
+        }
+        else if (tiered) {
+            std::vector<Function*> functions;
+            for (const Definition& definition : parser.definitions) {
+                functions.push_back(definition.function);
+            }
+            Tiering::instrument(&engine, functions.data(), (uint32_t) functions.size());
+            root = Tiering::instrument(&engine, module.make<CallNode>(entry->function, module.make<ConstNode>(0)));
+            prepareName = "instrument";
+        }
+
+        prepareMs = sinceMs(start);
+
+        // Only the run counts against the limits
+        if (budget) {
+            ctx.setBudget(budget);
+        }
+        if (timeoutMs) {
+            ctx.setDeadline(std::chrono::milliseconds(timeoutMs));
+        }
+
+        start = std::chrono::steady_clock::now();
+
+        if (bytecode) {
+            Bytecode::run(program, 0, &ctx);
+        }
+        else if (registers) {
+            RegisterVM::run(registerProgram, 0, &ctx);
+        }
+        else if (tiered) {
+            root->eval(&ctx);
+        }
+        else {
+            module.make<CallNode>(entry->function, module.make<ConstNode>(0))->eval(&ctx);
+        }
+
+        double runMs = sinceMs(start);
+
+        fflush(stdout);
+        fprintf(stderr, "backend %s: parse %.3f ms", backend, parseMs);
+        if (!tree && !tiered) {
+            fprintf(stderr, ", simplify %.3f ms (%u rewrite%s)", simplifyMs, numFolded, numFolded == 1 ? "" : "s");
+        }
+        if (prepareName) {
+            fprintf(stderr, ", %s %.3f ms", prepareName, prepareMs);
+        }
+        if (memoize) {
+            fprintf(stderr, ", %u function%s memoized", numMemoized, numMemoized == 1 ? "" : "s");
+        }
+        fprintf(stderr, ", run %.3f ms", runMs);
+        if (tiered) {
+            fprintf(stderr, " (%u fused, %u compiled)", engine.numFused, engine.numCompiled);
+        }
+        fprintf(stderr, "\n");
+
+        // Output up to the stop is kept, but the script didn't finish
+        if (ctx.stop != STOP_NONE) {
+            fprintf(stderr, "%s: stopped, %s\n", path,
+                ctx.stop == STOP_BUDGET ? "budget exhausted" : ctx.stop == STOP_DEADLINE ? "deadline passed" : "interrupted");
+        }
+
+#if defined(TRACING)
+        if (tracePath) {
+            std::vector<std::pair<const void*, std::string>> names;
+            for (const Definition& definition : parser.definitions) {
+                names.push_back(std::make_pair((const void*) definition.function, definition.name));
+            }
+
+            FILE* out = fopen(tracePath, "w");
+            if (!out || !Tracing::write(out, { &trace }, names)) {
+                fprintf(stderr, "%s: can't write trace\n", tracePath);
+                if (out) {
+                    fclose(out);
+                }
+                return 1;
+            }
+            fclose(out);
+
+            uint64_t numEvents = trace.head.load();
+            fprintf(stderr, "trace: %llu event%s sampled, last %llu kept in %s\n", (unsigned long long) numEvents,
+                numEvents == 1 ? "" : "s", (unsigned long long) std::min<uint64_t>(numEvents, trace.events.size()), tracePath);
+        }
+#endif
+        return ctx.stop != STOP_NONE ? 2 : 0;
+    }
+}
+
+int main(int argc, const char** argv) {
+#if defined(BENCHMARK)
+    return Benchmark::run(argc, argv);
+#elif defined(SCRIPT)
+    return Script::run(argc, argv);
+#else
+    uint32_t n = argc > 1 ? (uint32_t) atoi(argv[1]) : 42;
+
+#if defined(BASELINE)
+    printf("%d\n", fib(n));
+#elif defined(SIMPLEST)
+    printf("%d\n", Simplest::fib(n));
+#elif defined(SIMPLE_FUSION)
+    printf("%d\n", SimpleFusion::fib(n));
+#elif defined(BETTER_FUSION)
+    printf("%d\n", BetterFusion::fib(n));
+#elif defined(SIMPLIFY_CALLS)
+    printf("%d\n", SimplifyCalls::fib(n));
+#elif defined(REGISTER_VM)
+    printf("%d\n", RegisterVM::fib(n));
+#elif defined(JIT)
+    printf("%d\n", Jit::fib(n));
+#elif defined(TIERED)
+    printf("%d\n", Tiering::fib(n));
+#elif defined(IMAGE)
+    printf("%d\n", Image::fib(n));
+#elif defined(TAGGED)
+    printf("%d\n", Tagged::fib(n));
+#elif defined(TAGGED_TABLE)
+    printf("%d\n", Tagged::tableFib(n));
+#elif defined(VALUES)
+    printf("%g\n", Values::doubleFib(n));
+    printf("%lld\n", (long long) Values::fib((int64_t) n));
+#elif defined(AUTO_FUSION)
+    printf("%d\n", AutoFusion::fib(n));
+#elif defined(FOLDING)
+    printf("%d\n", Folding::fib(n));
+#elif defined(COMPOSED)
+    printf("%d\n", Composed::fib(n));
+#elif defined(QUICKENING)
+    Quickening::Stats stats;
+    uint32_t result = Quickening::fib(n, &stats);
+    printf("quickened %u of %u nodes, %u to plain nodes\n", stats.numQuickened, stats.numInstalled, stats.numGeneric);
+    printf("%d\n", result);
+#elif defined(BYTECODE)
+    printf("%d\n", Bytecode::fib(n));
+#elif defined(PROFILE)
+    printf("%d\n", Profiler::fib(n));
+#elif defined(FRAMES)
+    printf("%d\n", Frames::fib(n));
+#elif defined(STATEMENTS)
+    printf("%d\n", Statements::fib(n));
+#elif defined(INLINE_CACHING)
+    printf("%d\n", InlineCaching::fib(n));
+#elif defined(MEMOIZE)
+    printf("%d\n", Memoization::fib(n));
+#elif defined(TAIL_CALLS)
+    printf("%d\n", TailCalls::fib(n));
+#elif defined(PARALLEL)
+    printf("%d\n", Parallel::fib(n));
+#elif defined(SERVING)
+    printf("%d\n", Serving::fib(n));
+#elif defined(BATCH)
+    printf("%d\n", Batch::fib(n));
+#elif defined(LOOP)
+    printf("%d\n", Loops::fib(n));
+#elif defined(FUSED_LOOP)
+    printf("%d\n", Loops::fusedFib(n));
+#else
+#error Please define one of: BASELINE, SIMPLEST, SIMPLE_FUSION, BETTER_FUSION, SIMPLIFY_CALLS, REGISTER_VM, JIT, TIERED, IMAGE, TAGGED, TAGGED_TABLE, VALUES, AUTO_FUSION, FOLDING, COMPOSED, QUICKENING, BYTECODE, PROFILE, FRAMES, STATEMENTS, INLINE_CACHING, MEMOIZE, TAIL_CALLS, PARALLEL, SERVING, BATCH, LOOP, FUSED_LOOP, BENCHMARK, or SCRIPT
+#endif
+
+	return 0;
+#endif
 }